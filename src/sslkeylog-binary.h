@@ -0,0 +1,85 @@
+/**
+ * キーログのバイナリ形式 (SSLKEYLOG_FORMAT=binary) の定義。
+ * libsslkeylog.so と tools/sslkeylog-convert で共有する。
+ *
+ * 1 レコードは KEYLOG_BINARY_RECORD_SIZE バイトの固定長で、ファイルにはヘッダ無しで
+ * レコードが連続して格納される。(複数プロセスからの追記、ローテーションに対応するため)
+ * 多バイトの数値はリトルエンディアンとする。
+ *
+ *   オフセット  サイズ  内容
+ *   0           2       マジック ("KL")
+ *   2           1       バージョン (KEYLOG_BINARY_VERSION)
+ *   3           1       ラベル (KeyLogBinary_labels のインデックス)
+ *   4           1       クライアントランダムの長さ
+ *   5           1       シークレットの長さ
+ *   6           2       予約 (0)
+ *   8           8       タイムスタンプ (UNIX時刻[ns])
+ *   16          32      クライアントランダム
+ *   48          48      シークレット (長さに満たない部分は 0)
+ *
+ * 上記で表現できないキー情報 (未知のラベル、最大長を超えるクライアントランダム・シークレットなど) は、
+ * テキスト形式の 1 行 (改行なし) のまま、連続する 1 つ以上のレコードに格納する。
+ * 先頭のレコードのラベルは KEYLOG_BINARY_LABEL_TEXT、後続のレコードのラベルは
+ * KEYLOG_BINARY_LABEL_TEXT_CONTINUATION とし、マジック、バージョン、タイムスタンプは同じ値とする。
+ *
+ *   オフセット  サイズ  内容
+ *   4           1       レコード数 (先頭のレコードのみ。先頭のレコードを含む)
+ *   6           2       行の長さ (先頭のレコードのみ)
+ *   16          80      行 (各レコードに KEYLOG_BINARY_TEXT_CHUNK バイトずつ。最後のレコードの残りは 0)
+ */
+#ifndef SSLKEYLOG_BINARY_H
+#define SSLKEYLOG_BINARY_H
+
+
+// =============================================================================
+//  マクロ定義
+// =============================================================================
+#define KEYLOG_BINARY_RECORD_SIZE 96
+#define KEYLOG_BINARY_MAGIC "KL"
+#define KEYLOG_BINARY_VERSION 1
+
+#define KEYLOG_BINARY_OFFSET_MAGIC 0
+#define KEYLOG_BINARY_OFFSET_VERSION 2
+#define KEYLOG_BINARY_OFFSET_LABEL 3
+#define KEYLOG_BINARY_OFFSET_RANDOM_LENGTH 4
+#define KEYLOG_BINARY_OFFSET_SECRET_LENGTH 5
+#define KEYLOG_BINARY_OFFSET_TEXT_COUNT 4
+#define KEYLOG_BINARY_OFFSET_TEXT_LENGTH 6
+#define KEYLOG_BINARY_OFFSET_TIMESTAMP 8
+#define KEYLOG_BINARY_OFFSET_RANDOM 16
+#define KEYLOG_BINARY_OFFSET_SECRET 48
+#define KEYLOG_BINARY_OFFSET_TEXT 16
+
+// クライアントランダム、シークレットの最大長
+// (シークレットは TLS 1.2 のマスターキー、TLS 1.3 の SHA-384 によるシークレットの 48 バイトまで)
+#define KEYLOG_BINARY_RANDOM_MAX 32
+#define KEYLOG_BINARY_SECRET_MAX 48
+
+// テキストのまま格納する行の、レコード 1 つあたりの長さと最大長 (最大レコード数 255)
+#define KEYLOG_BINARY_TEXT_CHUNK (KEYLOG_BINARY_RECORD_SIZE - KEYLOG_BINARY_OFFSET_TEXT)
+#define KEYLOG_BINARY_TEXT_MAX (KEYLOG_BINARY_TEXT_CHUNK * 255)
+#define KEYLOG_BINARY_TEXT_RECORDS(len) (((len) == 0) ? 1 : ((len) + KEYLOG_BINARY_TEXT_CHUNK - 1) / KEYLOG_BINARY_TEXT_CHUNK)
+
+
+// =============================================================================
+//  ラベル
+// =============================================================================
+/** ラベル一覧 (0 はテキストのまま格納した行 (KEYLOG_BINARY_LABEL_TEXT)。新しいラベルは末尾に追加すること) */
+static const char *const KeyLogBinary_labels[] = {
+    NULL,
+    "CLIENT_RANDOM",
+    "CLIENT_EARLY_TRAFFIC_SECRET",
+    "CLIENT_HANDSHAKE_TRAFFIC_SECRET",
+    "SERVER_HANDSHAKE_TRAFFIC_SECRET",
+    "CLIENT_TRAFFIC_SECRET_0",
+    "SERVER_TRAFFIC_SECRET_0",
+    "EARLY_EXPORTER_SECRET",
+    "EXPORTER_SECRET",
+};
+
+#define KEYLOG_BINARY_LABEL_COUNT (sizeof(KeyLogBinary_labels) / sizeof(KeyLogBinary_labels[0]))
+#define KEYLOG_BINARY_LABEL_CLIENT_RANDOM 1
+#define KEYLOG_BINARY_LABEL_TEXT 0
+#define KEYLOG_BINARY_LABEL_TEXT_CONTINUATION 0xff
+
+#endif // SSLKEYLOG_BINARY_H
@@ -0,0 +1,68 @@
+/**
+ * キーログの圧縮形式 (SSLKEYLOG_COMPRESS=zstd|lz4) の定義。
+ * libsslkeylog.so と tools/sslkeylog-convert で共有する。
+ *
+ * 非同期出力モードの書き込みスレッドが、まとめて書き込む毎に独立したフレーム
+ * (zstd フレーム、または LZ4 フレーム) に圧縮して出力する。ファイルにはヘッダ無しで
+ * フレームが連続して格納される。(ローテーション、途中で終了した場合も、完全なフレームは復元できる)
+ * フレームの中身は、圧縮しない場合と同じテキスト形式、またはバイナリ形式となる。
+ *
+ * 圧縮ライブラリのヘッダはビルド環境に存在しないことがあるため、実行時に dlopen して
+ * 以下の関数のみを利用する。(いずれも各ライブラリの安定 API)
+ */
+#ifndef SSLKEYLOG_COMPRESS_H
+#define SSLKEYLOG_COMPRESS_H
+
+#include <stddef.h>
+
+
+// =============================================================================
+//  マクロ定義
+// =============================================================================
+#define KEYLOG_COMPRESS_NONE 0
+#define KEYLOG_COMPRESS_ZSTD 1
+#define KEYLOG_COMPRESS_LZ4 2
+
+// 圧縮ライブラリ (dlopen するファイル名)
+#define KEYLOG_COMPRESS_ZSTD_LIBRARY "libzstd.so.1"
+#define KEYLOG_COMPRESS_LZ4_LIBRARY "liblz4.so.1"
+
+// フレームのマジックナンバー (リトルエンディアン)
+#define KEYLOG_COMPRESS_ZSTD_MAGIC 0xFD2FB528U
+#define KEYLOG_COMPRESS_LZ4_MAGIC 0x184D2204U
+
+// zstd の圧縮レベル (ZSTD_CLEVEL_DEFAULT)
+#define KEYLOG_COMPRESS_ZSTD_LEVEL 3
+
+// LZ4 フレーム API のバージョン (LZ4F_VERSION)
+#define KEYLOG_COMPRESS_LZ4F_VERSION 100
+
+// ZSTD_getFrameContentSize のエラー値
+#define KEYLOG_COMPRESS_ZSTD_CONTENTSIZE_UNKNOWN (0ULL - 1)
+#define KEYLOG_COMPRESS_ZSTD_CONTENTSIZE_ERROR (0ULL - 2)
+
+
+// =============================================================================
+//  関数型定義
+// =============================================================================
+// zstd (zstd.h)
+typedef size_t (*KeyLogCompress_ZSTD_compressBound)(size_t src_size);
+typedef size_t (*KeyLogCompress_ZSTD_compress)(void *dst, size_t dst_capacity,
+        const void *src, size_t src_size, int level);
+typedef unsigned (*KeyLogCompress_ZSTD_isError)(size_t code);
+typedef size_t (*KeyLogCompress_ZSTD_findFrameCompressedSize)(const void *src, size_t src_size);
+typedef unsigned long long (*KeyLogCompress_ZSTD_getFrameContentSize)(const void *src, size_t src_size);
+typedef size_t (*KeyLogCompress_ZSTD_decompress)(void *dst, size_t dst_capacity,
+        const void *src, size_t compressed_size);
+
+// LZ4 フレーム API (lz4frame.h。設定 (LZ4F_preferences_t 等) は NULL を指定してデフォルトとする)
+typedef size_t (*KeyLogCompress_LZ4F_compressFrameBound)(size_t src_size, const void *preferences);
+typedef size_t (*KeyLogCompress_LZ4F_compressFrame)(void *dst, size_t dst_capacity,
+        const void *src, size_t src_size, const void *preferences);
+typedef unsigned (*KeyLogCompress_LZ4F_isError)(size_t code);
+typedef size_t (*KeyLogCompress_LZ4F_createDecompressionContext)(void **context, unsigned version);
+typedef size_t (*KeyLogCompress_LZ4F_freeDecompressionContext)(void *context);
+typedef size_t (*KeyLogCompress_LZ4F_decompress)(void *context, void *dst, size_t *dst_size,
+        const void *src, size_t *src_size, const void *options);
+
+#endif // SSLKEYLOG_COMPRESS_H
@@ -0,0 +1,60 @@
+/**
+ * libsslkeylog.so の統計情報の定義。
+ *
+ * 統計情報は、LD_PRELOAD されたプロセス内から sslkeylog_get_stats にて取得できる。
+ * アプリケーションは本ライブラリにリンクしないため、dlsym にて関数を取得して呼び出す。
+ *   size_t (*get_stats)(SslKeyLogStats *, size_t) = dlsym(RTLD_DEFAULT, "sslkeylog_get_stats");
+ *   if (get_stats != NULL) { SslKeyLogStats stats; get_stats(&stats, sizeof(stats)); ... }
+ *
+ * 環境変数 SSLKEYLOG_STATS にファイル名を指定した場合、プロセス終了時および SIGUSR1 受信時に
+ * 統計情報をテキスト形式で出力する。(書き込み時間の計測も、指定した場合のみ行う)
+ */
+#ifndef SSLKEYLOG_STATS_H
+#define SSLKEYLOG_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+// =============================================================================
+//  マクロ定義
+// =============================================================================
+// 書き込み時間のヒストグラムのバケット数
+// バケット i は 2^i [us] 未満 (最後のバケットは 2^(i-1) [us] 以上) の書き込み回数となる。
+#define SSLKEYLOG_STATS_LATENCY_BUCKETS 16
+
+
+// =============================================================================
+//  構造体定義
+// =============================================================================
+/** 統計情報 (新しい項目は末尾に追加すること) */
+typedef struct
+{
+    uint64_t secrets;               // 受け取ったキー情報数
+    uint64_t filtered;              // フィルタ (SSLKEYLOG_SAMPLE, SNI, LABELS) により出力しなかったキー情報数
+    uint64_t dedup_hits;            // 重複排除により出力しなかったキー情報数
+    uint64_t lines;                 // 出力したキー情報数 (行数、またはバイナリ形式のレコード数。リングバッファ満杯により破棄したものを除く)
+    uint64_t bytes;                 // 書き込んだバイト数
+    uint64_t short_writes;          // 部分書き込みの回数
+    uint64_t write_errors;          // 書き込みエラーの回数
+    uint64_t drops;                 // リングバッファ満杯により破棄したキー情報数 + 送信できずに破棄したデータグラム数
+    uint64_t write_latency[SSLKEYLOG_STATS_LATENCY_BUCKETS];   // キー情報 1 件の出力に要した時間の分布
+    uint64_t quic_secrets;          // secrets のうち、QUIC 接続のキー情報数 (SSL_is_quic が利用可能な場合のみ)
+    uint64_t config_errors;         // 設定の誤りの回数 (SSLKEYLOG_COMPRESS の形式が不明・ライブラリを読み込めない、制御ファイルの出力先に切り替えられない)
+} SslKeyLogStats;
+
+
+// =============================================================================
+//  関数
+// =============================================================================
+/**
+ * 統計情報を取得します。
+ * 各スレッドの統計情報を集計するため、高頻度での呼び出しは避けてください。
+ *
+ * @param stats 統計情報の格納先
+ * @param size 格納先のサイズ (sizeof(SslKeyLogStats))
+ * @return 格納したサイズ
+ */
+size_t sslkeylog_get_stats(SslKeyLogStats *stats, size_t size);
+
+#endif // SSLKEYLOG_STATS_H
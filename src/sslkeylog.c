@@ -8,19 +8,56 @@
  * OpenSSL 1.1.0 の場合、SSL_CTX_set_keylog_callback が存在しないため、
  * SSL_connect/SSL_accept/SSL_do_handshake を フックし、(TLS 1.2 まで対応した)
  * キー情報を SSLKEYLOGFILE に出力する。
+ * 情報コールバック (SSL_CTX_set_info_callback) も登録し、SSL_read/SSL_write などの内部で
+ * 行われた再ネゴシエーションのキー情報も、ハンドシェイク完了の通知 (SSL_CB_HANDSHAKE_DONE) にて出力する。
  * (※ OpenSSL 1.1.0 は、TLS 1.2 までしか対応していない)
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <limits.h>
+#include <semaphore.h>
+#include <pthread.h>
 #include <unistd.h>
 
-#define _GNU_SOURCE
 #include <dlfcn.h>
 #include <openssl/ssl.h>
 #include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <poll.h>
 #include <threads.h>
+#include <stdatomic.h>
+#include <stdalign.h>
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define KEYLOG_HAVE_IO_URING 1
+#endif
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <tmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "sslkeylog-binary.h"
+#include "sslkeylog-compress.h"
+#include "sslkeylog-stats.h"
 
 
 // =============================================================================
@@ -30,10 +67,110 @@
 #define CLIENT_RANDOM_LEN (sizeof(CLIENT_RANDOM) - 1)
 #define CLIENT_RANDOM_LINE_LENGTH (CLIENT_RANDOM_LEN + (SSL3_RANDOM_SIZE * 2) + 1 + (SSL_MAX_MASTER_KEY_LENGTH * 2) + 2)
 
+// SSL_CTX_set_keylog_callback/SSL_CTX_get_keylog_callback をフックするか否か
+// OpenSSL 1.1.1 以降のヘッダでビルドした場合のみフックし、1.1.0 のヘッダでビルドした場合は
+// libssl に存在しない関数をエクスポートしない。(アプリケーションが dlsym などで有無を判定できるようにする)
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+#define KEYLOG_HOOK_KEYLOG_CALLBACK
+#endif
+
+// キー情報 1 行 (改行含む) の最大長
+// TLS 1.3 の最長ラベル (CLIENT_HANDSHAKE_TRAFFIC_SECRET) + client_random + 最大長(64バイト)の secret が収まるサイズ
+#define KEYLOG_LINE_MAX 256
+
+// シャード出力モードで各行の前に付与するタイムスタンプ ("# <UNIX時刻[ns]>\n") の最大長
+#define KEYLOG_SHARD_STAMP_MAX 24
+
+// 出力 1 回分 (タイムスタンプ + キー情報 1 行) の最大長
+#define KEYLOG_RECORD_MAX (KEYLOG_LINE_MAX + KEYLOG_SHARD_STAMP_MAX)
+
+_Static_assert(CLIENT_RANDOM_LINE_LENGTH <= KEYLOG_LINE_MAX, "CLIENT_RANDOM line must fit in KEYLOG_LINE_MAX");
+_Static_assert(KEYLOG_BINARY_RECORD_SIZE <= KEYLOG_LINE_MAX, "binary record must fit in KEYLOG_LINE_MAX");
+_Static_assert(KEYLOG_BINARY_TEXT_MAX <= 0xffff, "text record length must fit in 16 bits");
+
+// シャード出力モードの設定
+#define KEYLOG_SHARD_MAX 256
+
+// 非同期出力モードの設定
+#define KEYLOG_ASYNC_DEFAULT_CAPACITY 4096
+#define KEYLOG_ASYNC_INTERVAL_MS 10
+#define KEYLOG_ASYNC_BATCH_SIZE (64 * 1024)
+#define KEYLOG_ASYNC_STOP_WAIT_MS 100
+#define KEYLOG_CACHE_LINE_SIZE 64
+
+// io_uring の設定 (同時に書き込み中とするまとめ書きバッファ数)
+#define KEYLOG_URING_DEPTH 4
+
+// ソケット出力モードの設定
+#define KEYLOG_SOCKET_UNIX_DATAGRAM_MAX (16 * 1024)
+#define KEYLOG_SOCKET_UDP_DATAGRAM_MAX 1400
+#define KEYLOG_SOCKET_MAX_MESSAGES 64
+#define KEYLOG_SOCKET_WAIT_MS 100
+
+// バッチ出力モードの設定
+#define KEYLOG_BATCH_DEFAULT_FLUSH_MS 1000
+
+// ローテーションの設定
+#define KEYLOG_ROTATE_CHECK_MS 100
+
+// 重複排除の設定
+#define KEYLOG_DEDUP_MAX_ENTRIES (1 << 24)
+#define KEYLOG_DEDUP_PROBES 8
+
+// 統計情報のカウンタ番号 (SslKeyLogStats の項目順)
+#define KEYLOG_STATS_SECRETS 0
+#define KEYLOG_STATS_FILTERED 1
+#define KEYLOG_STATS_DEDUP_HITS 2
+#define KEYLOG_STATS_LINES 3
+#define KEYLOG_STATS_BYTES 4
+#define KEYLOG_STATS_SHORT_WRITES 5
+#define KEYLOG_STATS_WRITE_ERRORS 6
+#define KEYLOG_STATS_DROPS 7
+#define KEYLOG_STATS_LATENCY 8
+#define KEYLOG_STATS_QUIC_SECRETS (KEYLOG_STATS_LATENCY + SSLKEYLOG_STATS_LATENCY_BUCKETS)
+#define KEYLOG_STATS_CONFIG_ERRORS (KEYLOG_STATS_QUIC_SECRETS + 1)
+#define KEYLOG_STATS_COUNT (sizeof(SslKeyLogStats) / sizeof(uint64_t))
+
+// トレースの設定 (スレッド毎のバッファサイズ、レコード 1 件の最大長)
+#define KEYLOG_TRACE_BUFFER_SIZE (64 * 1024)
+#define KEYLOG_TRACE_RECORD_MAX 256
+
+// 同期ポリシー (SSLKEYLOG_SYNC)
+#define KEYLOG_SYNC_NONE 0
+#define KEYLOG_SYNC_BATCH 1
+#define KEYLOG_SYNC_PERIODIC 2
+#define KEYLOG_SYNC_DEFAULT_MS 1000
+
+// 制御ファイルの確認間隔 [ms]
+#define KEYLOG_CONTROL_CHECK_MS 1000
+
+// ステージングの設定
+#define KEYLOG_STAGE_DEFAULT_MS 1000
+#define KEYLOG_STAGE_COPY_SIZE (64 * 1024)
+
+// mmap 出力モードの設定
+#define KEYLOG_MMAP_DEFAULT_CHUNK_SIZE (16 * 1024 * 1024)
+#define KEYLOG_MMAP_SLOTS 4
+#define KEYLOG_MMAP_WAIT_MS 1000
+
 
 // =============================================================================
 //  構造体定義
 // =============================================================================
+/** キーログ用コールバック (OpenSSL 1.1.1 以降の SSL_CTX_keylog_cb_func) */
+typedef void (*_SSL_CTX_keylog_cb_func)(const SSL *ssl, const char *line);
+
+/** 情報コールバック (SSL_CTX_set_info_callback, SSL_set_info_callback) */
+typedef void (*_SSL_info_cb_func)(const SSL *ssl, int type, int val);
+
+/** オリジナル関数のロード対象 */
+typedef struct
+{
+    const char *name;                   // シンボル名
+    void **func;                        // ロード先 (関数ポインタ)
+    bool required;                      // true: ロードできない場合は処理を中断する
+} OpenSslSymbol;
+
 /** マスターキー格納用構造体 */
 typedef struct
 {
@@ -48,44 +185,456 @@ typedef struct
     size_t length;
 } SslClientRandom;
 
+/**
+ * ハンドシェイクの状態 (OpenSSL 1.1.0 以前対応。SSL の ex_data に保持する)
+ * 最初に未完了となった際に SSL 毎に 1 回のみ確保し、以降のハンドシェイク (再ネゴシエーション) でも再利用する。
+ */
+typedef struct
+{
+    SslMasterKey before_key;            // ハンドシェイク開始前 (最初の呼び出し時) のマスターキー
+    bool pending;                       // ハンドシェイクが未完了か否か (before_key が有効か否か)
+} SslHandshakeState;
+
+/** 非同期出力用リングバッファのスロット */
+typedef struct
+{
+    atomic_size_t sequence;
+    size_t length;
+    char *heap;                         // data に収まらない行の複製 (書き込みスレッドが解放する。通常は NULL)
+    char data[KEYLOG_LINE_MAX];
+} KeyLogAsyncSlot;
+
+/** mmap 出力用のマッピング領域 (チャンク) */
+typedef struct
+{
+    atomic_size_t index;                // マッピング中のチャンク番号 (SIZE_MAX: 未マッピング)
+    atomic_uintptr_t base;              // マッピング先アドレス (0: マッピング失敗。pwrite にて書き込む)
+    atomic_size_t committed;            // 書き込み完了済みのバイト数
+} KeyLogMmapChunk;
+
+/** バッチ出力用スレッド毎のバッファ */
+typedef struct KeyLogBatchBuffer
+{
+    struct KeyLogBatchBuffer *next;     // 登録済みバッファのリスト
+    atomic_flag lock;                   // バッファ操作中フラグ (所有スレッドとフラッシュスレッド間)
+    int fd;                             // 出力先ファイルディスクリプタ
+    size_t used;                        // 使用済みサイズ
+    char data[];                        // バッファ (容量: バッチサイズ + KEYLOG_RECORD_MAX)
+} KeyLogBatchBuffer;
+
+/**
+ * キー情報 1 件の出力先 (KeyLogFile_reserve にて確保し、KeyLogFile_commit にて出力する)
+ * キー情報は、非同期出力モードではリングバッファのスロット、バッチ出力モードではスレッド毎のバッファに
+ * 直接組み立てるため、出力時のコピーおよびメモリ確保は発生しない。
+ * それ以外の出力モードでは、スタック上のバッファ (stack) に組み立ててから出力する。
+ */
+typedef struct
+{
+    char *data;                         // キー情報の組み立て先 (KEYLOG_LINE_MAX バイト)
+    size_t prefix;                      // data の前に付与したタイムスタンプの長さ (シャード出力モード)
+    int fd;                             // 出力先ファイルディスクリプタ
+    KeyLogAsyncSlot *slot;              // 非同期出力モード: 確保したスロット
+    size_t position;                    // 非同期出力モード: 確保したスロットの位置
+    struct KeyLogBatchBuffer *buffer;   // バッチ出力モード: ロック中のバッファ
+    uint64_t start;                     // 出力開始時刻 (統計情報用)
+    char stack[KEYLOG_RECORD_MAX];      // 上記以外の出力モード用のバッファ
+} KeyLogLine;
+
+/** スレッド毎の統計情報 (キャッシュライン単位で確保し、他スレッドと同じラインを共有しない) */
+typedef struct KeyLogStatsCounters
+{
+    struct KeyLogStatsCounters *next;   // 登録済みカウンタのリスト
+    _Atomic uint64_t values[KEYLOG_STATS_COUNT];    // カウンタ (所有スレッドのみが更新する)
+} KeyLogStatsCounters;
+
+/** トレース用スレッド毎のバッファ */
+typedef struct KeyLogTraceBuffer
+{
+    struct KeyLogTraceBuffer *next;     // 登録済みバッファのリスト
+    atomic_flag lock;                   // バッファ操作中フラグ (所有スレッドと終了処理間)
+    long tid;                           // 所有スレッドのスレッドID
+    size_t used;                        // 使用済みサイズ
+    char data[KEYLOG_TRACE_BUFFER_SIZE];    // バッファ (完全なレコードのみ格納する)
+} KeyLogTraceBuffer;
+
 
 // =============================================================================
 //  プロトタイプ宣言
 // =============================================================================
 static void init_openssl_hooks(void);
-static void logging_key(SSL *ssl, SslMasterKey *before_key);
+static void init_passthrough_hooks(void);
+static void init_keylog_hooks(void);
+static void init_constructor(void);
+static void init_keylog_file(void);
+static SSL_CTX *first_SSL_CTX_new(const SSL_METHOD *method);
+static SSL *first_SSL_new(SSL_CTX *ctx);
+#ifdef KEYLOG_HOOK_KEYLOG_CALLBACK
+static void first_SSL_CTX_set_keylog_callback(SSL_CTX *ctx, _SSL_CTX_keylog_cb_func cb);
+static _SSL_CTX_keylog_cb_func first_SSL_CTX_get_keylog_callback(const SSL_CTX *ctx);
+#endif
+static SSL_CTX *keylog_SSL_CTX_new(const SSL_METHOD *method);
+static SSL *keylog_SSL_new(SSL_CTX *ctx);
+#ifdef KEYLOG_HOOK_KEYLOG_CALLBACK
+static void keylog_SSL_CTX_set_keylog_callback(SSL_CTX *ctx, _SSL_CTX_keylog_cb_func cb);
+static _SSL_CTX_keylog_cb_func keylog_SSL_CTX_get_keylog_callback(const SSL_CTX *ctx);
+#endif
+static void keylog_SSL_CTX_set_info_callback(SSL_CTX *ctx, _SSL_info_cb_func cb);
+static _SSL_info_cb_func keylog_SSL_CTX_get_info_callback(SSL_CTX *ctx);
+static void keylog_SSL_set_info_callback(SSL *ssl, _SSL_info_cb_func cb);
+static _SSL_info_cb_func keylog_SSL_get_info_callback(const SSL *ssl);
+static SSL_CTX *lazy_SSL_CTX_new(const SSL_METHOD *method);
+static SSL *lazy_SSL_new(SSL_CTX *ctx);
+#ifdef KEYLOG_HOOK_KEYLOG_CALLBACK
+static void lazy_SSL_CTX_set_keylog_callback(SSL_CTX *ctx, _SSL_CTX_keylog_cb_func cb);
+static _SSL_CTX_keylog_cb_func lazy_SSL_CTX_get_keylog_callback(const SSL_CTX *ctx);
+#endif
+static void lazy_SSL_CTX_set_info_callback(SSL_CTX *ctx, _SSL_info_cb_func cb);
+static _SSL_info_cb_func lazy_SSL_CTX_get_info_callback(SSL_CTX *ctx);
+static void lazy_SSL_set_info_callback(SSL *ssl, _SSL_info_cb_func cb);
+static _SSL_info_cb_func lazy_SSL_get_info_callback(const SSL *ssl);
+static int lazy_SSL_connect(SSL *ssl);
+static int lazy_SSL_do_handshake(SSL *ssl);
+static int lazy_SSL_accept(SSL *ssl);
+static void install_keylog_callback(SSL_CTX *ctx);
+static _SSL_CTX_keylog_cb_func get_app_keylog_callback(const SSL_CTX *ctx);
+static void install_info_callback(SSL_CTX *ctx);
+static void keylog_info_callback(const SSL *ssl, int type, int val);
+static int legacy_SSL_connect(SSL *ssl);
+static int legacy_SSL_do_handshake(SSL *ssl);
+static int legacy_SSL_accept(SSL *ssl);
+static int legacy_handshake(SSL *ssl, int (*handshake)(SSL *ssl));
+static int trace_SSL_connect(SSL *ssl);
+static int trace_SSL_do_handshake(SSL *ssl);
+static int trace_SSL_accept(SSL *ssl);
+static int trace_handshake(SSL *ssl, int (*handshake)(SSL *ssl), const char *name);
+static void free_handshake_state(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp);
+static void get_master_key(const SSL *ssl, SslMasterKey *key);
+static void logging_key(const SSL *ssl, SslMasterKey *before_key);
+static void load_functions(void);
 static void *load_function(const char* sym);
-static void *load_function_or_die(const char *sym);
+static void *open_libssl(void);
+static void *open_libssl_candidate(const char *name, int mode);
 
 static void KeyLogFile_init(void);
+static void KeyLogFile_open(const char *sslkeylogfile_name);
+static char *KeyLogFile_make_template(const char *name, bool shard);
 static void KeyLogFile_finalize(void);
 static void KeyLogFile_callback(const SSL *ssl, const char *line);
 static void KeyLogFile_raw_dump(const SslClientRandom *client_random, const SslMasterKey *master_key);
+static bool KeyLogFile_reserve(KeyLogLine *out);
+static void KeyLogFile_commit(KeyLogLine *out, size_t len);
+static void KeyLogFile_write_long(const char *data, size_t len, bool newline);
+static bool KeyLogFile_write_all(int fd, const char *buf, size_t len);
+static bool KeyLogFile_writev_all(int fd, struct iovec *iov, int iovcnt);
+static bool KeyLogFile_is_fifo(const char *name);
+static void hex_encode_init(void);
+static void hex_encode_table(char *dst, const unsigned char *src, size_t len);
+#if defined(__x86_64__) || defined(__i386__)
+static void hex_encode_ssse3(char *dst, const unsigned char *src, size_t len);
+#elif defined(__aarch64__)
+static void hex_encode_neon(char *dst, const unsigned char *src, size_t len);
+#endif
+
+static size_t KeyLogFile_getenv_size(const char *name, size_t default_value);
+static void KeyLogFile_debug(const char *format, ...) __attribute__((format(printf, 1, 2)));
+static bool KeyLogFile_start_thread(thrd_t *thread, thrd_start_t func);
+static void KeyLogFile_deadline(struct timespec *ts, size_t ms);
+static void KeyLogFile_set_signal(int sig, void (*handler)(int, siginfo_t *, void *), struct sigaction *old_action);
+static void KeyLogFile_chain_signal(const struct sigaction *old_action, int sig, siginfo_t *info, void *context);
+static bool KeyLogFile_expand_name(char *out, size_t size, const char *template, unsigned long sequence, int shard);
+static uint64_t KeyLogFile_realtime_ns(void);
+
+static void KeyLogStats_start(const char *name);
+static void KeyLogStats_stop(void);
+static void KeyLogStats_fork_child(void);
+static void KeyLogStats_add(size_t counter, uint64_t value);
+static uint64_t KeyLogStats_timer_start(void);
+static void KeyLogStats_timer_stop(uint64_t start);
+static void KeyLogStats_collect(uint64_t *values);
+static KeyLogStatsCounters *KeyLogStats_get_counters(void);
+static void KeyLogStats_thread_exit(void *arg);
+static void KeyLogStats_dump(void);
+static void KeyLogStats_sigusr1(int sig, siginfo_t *info, void *context);
+static int KeyLogStats_thread(void *arg);
+
+static void KeyLogTrace_start(const char *name);
+static void KeyLogTrace_stop(void);
+static uint64_t KeyLogTrace_now(void);
+static void KeyLogTrace_handshake(const SSL *ssl, const char *name, uint64_t start, int ret);
+static void KeyLogTrace_secret(const SSL *ssl, const char *label, size_t label_len);
+static void KeyLogTrace_append(KeyLogTraceBuffer *buffer, const char *record, size_t len);
+static KeyLogTraceBuffer *KeyLogTrace_get_buffer(void);
+static void KeyLogTrace_flush(KeyLogTraceBuffer *buffer);
+static void KeyLogTrace_thread_exit(void *arg);
+
+static int KeyLogSync_parse(const char *value, size_t *interval_ms);
+static void KeyLogSync_start(const char *value, bool batch_writer);
+static void KeyLogSync_stop(void);
+static void KeyLogSync_batch(void);
+static void KeyLogSync_all(void);
+static int KeyLogSync_thread(void *arg);
+
+static int KeyLogStage_open(const char *name, const char *dir);
+static void KeyLogStage_start(size_t interval_ms, bool sync);
+static void KeyLogStage_stop(void);
+static void KeyLogStage_copy(void);
+static int KeyLogStage_thread(void *arg);
+static void KeyLogStage_fork_child(const char *name);
+
+static void KeyLogFork_start(bool reopen);
+static void KeyLogFork_prepare(void);
+static void KeyLogFork_parent(void);
+static void KeyLogFork_child(void);
+static void KeyLogFork_release(void);
+static bool KeyLogFork_child_name(char *out, size_t size, int shard);
+static void KeyLogFork_reopen(void);
+static bool KeyLogFork_start_thread(thrd_t *thread, thrd_start_t func, cnd_t *cond);
+
+static void KeyLogControl_start(const char *path, const char *initial);
+static void KeyLogControl_stop(void);
+static void KeyLogControl_fork_child(void);
+static void KeyLogControl_reload(void);
+static void KeyLogControl_apply(const char *value);
+static bool KeyLogControl_switch(const char *name);
+static void KeyLogControl_sigusr2(int sig, siginfo_t *info, void *context);
+static int KeyLogControl_thread(void *arg);
+
+static bool KeyLogBinary_from_line(unsigned char *record, const char *line, size_t len);
+static void KeyLogBinary_build(unsigned char *record, int label,
+        const unsigned char *random, size_t random_len, const unsigned char *secret, size_t secret_len);
+static size_t KeyLogBinary_build_text(unsigned char *records, const char *line, size_t len);
+static size_t KeyLogBinary_decode_hex(unsigned char *dst, size_t size, const char *src, size_t len);
+
+static void KeyLogFilter_init(void);
+static bool KeyLogFilter_accept(const SSL *ssl, const char *label, size_t label_len);
+static bool KeyLogFilter_parse_list(const char *value, char ***items, size_t *count,
+        int (*compare)(const void *, const void *));
+static int KeyLogFilter_compare_host(const void *a, const void *b);
+static int KeyLogFilter_compare_label(const void *a, const void *b);
+static int KeyLogFilter_find_label(const void *key, const void *item);
+
+static bool KeyLogAsync_start(size_t capacity);
+static void KeyLogAsync_stop(void);
+static bool KeyLogAsync_reserve(KeyLogLine *out);
+static void KeyLogAsync_commit(KeyLogLine *out, size_t len);
+static int KeyLogAsync_writer(void *arg);
+static bool KeyLogAsync_output(char *batch, size_t len);
+static bool KeyLogAsync_write_long(size_t tail, bool *unsynced);
+static bool KeyLogAsync_wait_writable(int fd);
+static void KeyLogAsync_fork_child(void);
+
+static bool KeyLogUring_start(int fd);
+static void KeyLogUring_stop(void);
+static void KeyLogUring_fork_child(void);
+static void KeyLogUring_release(void);
+static char *KeyLogUring_get_buffer(void);
+static bool KeyLogUring_submit(size_t len);
+static void KeyLogUring_flush(void);
+static void KeyLogUring_wait(void);
+#ifdef KEYLOG_HAVE_IO_URING
+static void KeyLogUring_fallback(int group, size_t begin, size_t end);
+#endif
+
+static bool KeyLogCompress_start(const char *value);
+static void KeyLogCompress_stop(void);
+static bool KeyLogCompress_is_enabled(void);
+static bool KeyLogCompress_write(const char *data, size_t len);
+
+static bool KeyLogSocket_is_address(const char *name);
+static int KeyLogSocket_open(const char *address);
+static void KeyLogSocket_stop(void);
+static bool KeyLogSocket_send(const char *data, size_t len, bool wait);
+static size_t KeyLogSocket_split(const char *data, size_t len);
+
+static bool KeyLogRotate_start(size_t max_bytes, size_t rotate_secs, bool sighup);
+static void KeyLogRotate_stop(void);
+static bool KeyLogRotate_rotate(bool rename_current);
+static bool KeyLogRotate_reopen(bool rename_current);
+static void KeyLogRotate_sighup(int sig, siginfo_t *info, void *context);
+static int KeyLogRotate_thread(void *arg);
+
+static bool KeyLogShard_start(size_t count);
+static void KeyLogShard_stop(void);
+static int KeyLogShard_get_fd(void);
+static size_t KeyLogShard_stamp(char *out);
+
+static bool KeyLogDedup_start(size_t entries);
+static bool KeyLogDedup_seen(const void *key, size_t len);
+static uint64_t KeyLogDedup_fingerprint(const unsigned char *key, size_t len);
+
+static bool KeyLogMmap_start(const char *name, size_t chunk_size);
+static void KeyLogMmap_stop(void);
+static void KeyLogMmap_fork_child(const char *name);
+static bool KeyLogMmap_writev(const struct iovec *iov, int iovcnt);
+static void KeyLogMmap_pwrite(const char *buf, size_t len, size_t offset);
+static KeyLogMmapChunk *KeyLogMmap_get_chunk(size_t index);
+static void KeyLogMmap_commit(size_t index, size_t len);
+
+static bool KeyLogBatch_start(size_t batch_bytes, size_t flush_ms);
+static void KeyLogBatch_stop(void);
+static char *KeyLogBatch_reserve(KeyLogLine *out);
+static void KeyLogBatch_commit(KeyLogLine *out, size_t len);
+static KeyLogBatchBuffer *KeyLogBatch_get_buffer(int fd);
+static void KeyLogBatch_flush(KeyLogBatchBuffer *buffer);
+static void KeyLogBatch_flush_all(void);
+static void KeyLogBatch_thread_exit(void *arg);
+static int KeyLogBatch_flusher(void *arg);
 
 
 // =============================================================================
 //  内部変数
 // =============================================================================
 once_flag openssl_init_flag = ONCE_FLAG_INIT;
+static once_flag keylog_file_init_flag = ONCE_FLAG_INIT;
 
 // オリジナル OpenSSL 関数用
 // 備考: _ex 系は、基本的に _ex 無しを呼び出す実装のため、Hook 不要。
+static SSL_CTX *(*_SSL_CTX_new)(const SSL_METHOD *method) = NULL;
 static SSL *(*_SSL_new)(SSL_CTX *ctx) = NULL;
 static int (*_SSL_connect)(SSL *ssl) = NULL;
 static int (*_SSL_do_handshake)(SSL *ssl) = NULL;
 static int (*_SSL_accept)(SSL *ssl) = NULL;
+static void (*_SSL_CTX_set_info_callback)(SSL_CTX *ctx, _SSL_info_cb_func cb) = NULL;
+static _SSL_info_cb_func (*_SSL_CTX_get_info_callback)(SSL_CTX *ctx) = NULL;
+static void (*_SSL_set_info_callback)(SSL *ssl, _SSL_info_cb_func cb) = NULL;
+static _SSL_info_cb_func (*_SSL_get_info_callback)(const SSL *ssl) = NULL;
 static size_t (*_SSL_get_client_random)(const SSL *ssl, unsigned char *out, size_t outlen) = NULL;
 static size_t (*_SSL_SESSION_get_master_key)(const SSL_SESSION *session, unsigned char *out, size_t outlen) = NULL;
 static SSL_SESSION *(*_SSL_get_session)(const SSL *ssl) = NULL;
+static const char *(*_SSL_get_servername)(const SSL *ssl, const int type) = NULL;
+static int (*_SSL_is_quic)(SSL *ssl) = NULL;
 
-typedef void (*_SSL_CTX_keylog_cb_func)(const SSL *ssl, const char *line);
 static void (*_SSL_CTX_set_keylog_callback)(SSL_CTX *ctx, _SSL_CTX_keylog_cb_func cb);
+static _SSL_CTX_keylog_cb_func (*_SSL_CTX_get_keylog_callback)(const SSL_CTX *ctx);
+static SSL_CTX *(*_SSL_get_SSL_CTX)(const SSL *ssl);
+static void *(*_SSL_CTX_get_ex_data)(const SSL_CTX *ctx, int idx);
+static int (*_SSL_CTX_set_ex_data)(SSL_CTX *ctx, int idx, void *data);
+static void *(*_SSL_get_ex_data)(const SSL *ssl, int idx);
+static int (*_SSL_set_ex_data)(SSL *ssl, int idx, void *data);
+static int (*_CRYPTO_get_ex_new_index)(int class_index, long argl, void *argp,
+        CRYPTO_EX_new *new_func, CRYPTO_EX_dup *dup_func, CRYPTO_EX_free *free_func);
+
+// ロードするオリジナル関数の一覧 (load_functions にて 1 回でロードする)
+static const OpenSslSymbol openssl_symbols[] = {
+    { "SSL_CTX_new",                    (void **) &_SSL_CTX_new,                    true },
+    { "SSL_new",                        (void **) &_SSL_new,                        true },
+    { "SSL_connect",                    (void **) &_SSL_connect,                    true },
+    { "SSL_do_handshake",               (void **) &_SSL_do_handshake,               true },
+    { "SSL_accept",                     (void **) &_SSL_accept,                     true },
+    { "SSL_CTX_set_info_callback",      (void **) &_SSL_CTX_set_info_callback,      true },
+    { "SSL_CTX_get_info_callback",      (void **) &_SSL_CTX_get_info_callback,      true },
+    { "SSL_set_info_callback",          (void **) &_SSL_set_info_callback,          true },
+    { "SSL_get_info_callback",          (void **) &_SSL_get_info_callback,          true },
+    { "SSL_get_client_random",          (void **) &_SSL_get_client_random,          true },
+    { "SSL_SESSION_get_master_key",     (void **) &_SSL_SESSION_get_master_key,     true },
+    { "SSL_get_session",                (void **) &_SSL_get_session,                true },
+    // フィルタ (SNI による絞り込み用)
+    { "SSL_get_servername",             (void **) &_SSL_get_servername,             false },
+    // QUIC 接続の判定用 (OpenSSL 3.2 以降、quictls)
+    { "SSL_is_quic",                    (void **) &_SSL_is_quic,                    false },
+    // OpenSSL 1.1.1 以降対応の関数
+    { "SSL_CTX_set_keylog_callback",    (void **) &_SSL_CTX_set_keylog_callback,    false },
+    { "SSL_CTX_get_keylog_callback",    (void **) &_SSL_CTX_get_keylog_callback,    false },
+    // アプリケーションのコールバック保持用
+    { "SSL_get_SSL_CTX",                (void **) &_SSL_get_SSL_CTX,                false },
+    { "SSL_CTX_get_ex_data",            (void **) &_SSL_CTX_get_ex_data,            false },
+    { "SSL_CTX_set_ex_data",            (void **) &_SSL_CTX_set_ex_data,            false },
+    { "CRYPTO_get_ex_new_index",        (void **) &_CRYPTO_get_ex_new_index,        false },
+    // ハンドシェイクの状態保持用 (OpenSSL 1.1.0 以前対応)
+    { "SSL_get_ex_data",                (void **) &_SSL_get_ex_data,                false },
+    { "SSL_set_ex_data",                (void **) &_SSL_set_ex_data,                false },
+};
+
+// オリジナル関数を探す libssl のハンドル (open_libssl にて 1 回だけ選択する。RTLD_NEXT の場合あり)
+static void *libssl_handle = NULL;
+static bool libssl_opened = false;
+
+// libssl のライブラリ名の候補 (先頭から順に試す)
+// OpenSSL 互換の派生ライブラリ (BoringSSL, AWS-LC, quictls など) も同じ関数名で提供するため、
+// 共有ライブラリとしてビルドされていれば、リンク済みのライブラリ、いずれかの候補、
+// または SSLKEYLOG_LIBSSL の指定で見つかる。(派生ライブラリの soname はビルド毎に異なるため、候補には含めない)
+static const char *const libssl_names[] = {
+    "libssl.so.3",
+    "libssl.so.1.1",
+    "libssl.so",
+};
+
+// 16進数変換関数 (hex_encode_init にて CPU に応じた実装を一度だけ選択する)
+static void (*hex_encode)(char *dst, const unsigned char *src, size_t len) = hex_encode_table;
+
+// フック関数の実処理
+// 初期化前は、初期化してから実処理を呼び出す lazy_* 関数を指す。
+// init_openssl_hooks (キー情報を出力する場合は init_keylog_hooks) にて実処理に書き換えるため、以降のフック関数は
+// 関数ポインタ経由で呼び出すのみとなる。(ロック、初期化済みか否かの確認は不要)
+// 他スレッドの呼び出し中に書き換えるため、アトミック変数とする。書き換えは release で行い、
+// フック関数は acquire で読み出す。(呼び出した実処理から、書き換え前の初期化内容を参照できるようにする)
+// x86 では通常のロード、ARM では ldar となるため、呼び出し毎のコストはほぼない。
+// lazy_* 関数は call_once にて初期化の完了と同期済みのため、relaxed で読み出す。
+// SSL_CTX_new, SSL_new (および SSL_CTX_set_keylog_callback/SSL_CTX_get_keylog_callback) は、
+// キー情報を出力するか否かを判定するまでの間は first_* 関数を指す。
+static SSL_CTX *(*_Atomic SSL_CTX_new_impl)(const SSL_METHOD *method) = lazy_SSL_CTX_new;
+static SSL *(*_Atomic SSL_new_impl)(SSL_CTX *ctx) = lazy_SSL_new;
+#ifdef KEYLOG_HOOK_KEYLOG_CALLBACK
+static void (*_Atomic SSL_CTX_set_keylog_callback_impl)(SSL_CTX *ctx, _SSL_CTX_keylog_cb_func cb) = lazy_SSL_CTX_set_keylog_callback;
+static _SSL_CTX_keylog_cb_func (*_Atomic SSL_CTX_get_keylog_callback_impl)(const SSL_CTX *ctx) = lazy_SSL_CTX_get_keylog_callback;
+#endif
+
+// ハンドシェイク関数の実処理 (init_keylog_hooks にて一度だけ選択する。判定前および出力しない場合はオリジナル関数)
+// OpenSSL 1.1.1 以降: オリジナル関数をそのまま呼び出す。
+// OpenSSL 1.1.0    : マスターキーの変化を検出してログ出力する legacy_* 関数を呼び出す。
+static int (*_Atomic SSL_connect_impl)(SSL *ssl) = lazy_SSL_connect;
+static int (*_Atomic SSL_do_handshake_impl)(SSL *ssl) = lazy_SSL_do_handshake;
+static int (*_Atomic SSL_accept_impl)(SSL *ssl) = lazy_SSL_accept;
+
+// 情報コールバックの登録、取得関数の実処理 (init_keylog_hooks にて一度だけ選択する。判定前および出力しない場合はオリジナル関数)
+// OpenSSL 1.1.1 以降: オリジナル関数をそのまま呼び出す。
+// OpenSSL 1.1.0    : 本ライブラリの情報コールバックを維持し、アプリケーションのコールバックを ex_data に保持する keylog_* 関数を呼び出す。
+static void (*_Atomic SSL_CTX_set_info_callback_impl)(SSL_CTX *ctx, _SSL_info_cb_func cb) = lazy_SSL_CTX_set_info_callback;
+static _SSL_info_cb_func (*_Atomic SSL_CTX_get_info_callback_impl)(SSL_CTX *ctx) = lazy_SSL_CTX_get_info_callback;
+static void (*_Atomic SSL_set_info_callback_impl)(SSL *ssl, _SSL_info_cb_func cb) = lazy_SSL_set_info_callback;
+static _SSL_info_cb_func (*_Atomic SSL_get_info_callback_impl)(const SSL *ssl) = lazy_SSL_get_info_callback;
+
+// トレース時に trace_* 関数から呼び出すハンドシェイク関数の実処理 (SSLKEYLOG_TRACE 指定時のみ)
+static int (*SSL_connect_traced)(SSL *ssl) = NULL;
+static int (*SSL_do_handshake_traced)(SSL *ssl) = NULL;
+static int (*SSL_accept_traced)(SSL *ssl) = NULL;
+
+// アプリケーションが登録したキーログ用コールバックの格納先 (SSL_CTX の ex_data インデックス)
+static int app_keylog_callback_index = -1;
+
+// 完了していないハンドシェイクの状態の格納先 (SSL の ex_data インデックス。OpenSSL 1.1.0 以前対応)
+static int handshake_state_index = -1;
+
+// アプリケーションが登録した情報コールバックの格納先 (OpenSSL 1.1.0 以前対応)
+// SSL_CTX、SSL の ex_data インデックス。いずれも 0 以上の場合のみ、再ネゴシエーションを検出する。
+static int app_info_callback_index = -1;
+static int app_ssl_info_callback_index = -1;
+
+// アプリケーションが情報コールバックを登録したことがあるか否か (OpenSSL 1.1.0 以前対応)
+// 情報コールバックはハンドシェイクの状態遷移毎に呼び出されるため、未登録の間は ex_data を参照しない。
+static atomic_bool app_info_callback_used = false;
+
+// 呼び出し元スレッドでハンドシェイク関数を呼び出し中の SSL オブジェクト
+// (SSL_connect/SSL_accept 内部から呼び出される SSL_do_handshake を判定する。OpenSSL 1.1.0 以前対応)
+static thread_local const SSL *handshake_ssl = NULL;
 
 
 // =============================================================================
 //  OpenSSL 関数群のフック
 // =============================================================================
 
+/**
+ * SSL/TLS 通信の接続設定をまとめたコンテキストを生成する際に呼び出される。
+ * コンテキスト生成時に、キーログ用のコールバックを登録する。
+ *
+ * @param method TLS/SSL プロトコルの種別
+ * @return 新しい SSL_CTX オブジェクトへのポインタ。失敗時は NULL を返す。
+ */
+SSL_CTX *SSL_CTX_new(const SSL_METHOD *method)
+{
+    return atomic_load_explicit(&SSL_CTX_new_impl, memory_order_acquire)(method);
+}
+
 /**
  * SSL/TLS 通信するためのSSL構造体を生成する際に呼び出される。
  *
@@ -96,17 +645,35 @@ static void (*_SSL_CTX_set_keylog_callback)(SSL_CTX *ctx, _SSL_CTX_keylog_cb_fun
  */
 SSL *SSL_new(SSL_CTX *ctx)
 {
-    // 初期化: 1回だけ実行する
-    call_once(&openssl_init_flag, init_openssl_hooks);
+    return atomic_load_explicit(&SSL_new_impl, memory_order_acquire)(ctx);
+}
 
-    if (_SSL_CTX_set_keylog_callback != NULL)
-    {   // OpenSSL 1.1.1 以降は、SSL_CTX_set_keylog_callback が用意されている。
-        // => コールバックを登録して、キー情報を SSLKEYLOGFILE デバッグ出力に出力する。
-        _SSL_CTX_set_keylog_callback(ctx, KeyLogFile_callback);
-    }
+#ifdef KEYLOG_HOOK_KEYLOG_CALLBACK
+/**
+ * アプリケーションがキーログ用のコールバックを登録する際に呼び出される。
+ * アプリケーションのコールバックはコンテキスト毎に保持し、本ライブラリのコールバックから呼び出す。
+ * (本ライブラリのコールバックは登録されたままとなる)
+ *
+ * @param ctx コンテキスト
+ * @param cb アプリケーションのコールバック (NULL の場合、登録解除)
+ */
+void SSL_CTX_set_keylog_callback(SSL_CTX *ctx, _SSL_CTX_keylog_cb_func cb)
+{
+    atomic_load_explicit(&SSL_CTX_set_keylog_callback_impl, memory_order_acquire)(ctx, cb);
+}
 
-    return _SSL_new(ctx);
+/**
+ * アプリケーションがキーログ用のコールバックを取得する際に呼び出される。
+ * アプリケーションが登録したコールバックを返す。
+ *
+ * @param ctx コンテキスト
+ * @return アプリケーションのコールバック
+ */
+_SSL_CTX_keylog_cb_func SSL_CTX_get_keylog_callback(const SSL_CTX *ctx)
+{
+    return atomic_load_explicit(&SSL_CTX_get_keylog_callback_impl, memory_order_acquire)(ctx);
 }
+#endif
 
 /**
  * OpenSSL 関数のフック。
@@ -121,56 +688,52 @@ SSL *SSL_new(SSL_CTX *ctx)
 
 int SSL_connect(SSL *ssl)
 {
-    if (_SSL_CTX_set_keylog_callback != NULL)
-    {   // OpenSSL 1.1.1 以降は、callback が利用可能なため、そのまま呼び出す。
-        return _SSL_connect(ssl);
-    }
+    return atomic_load_explicit(&SSL_connect_impl, memory_order_acquire)(ssl);
+}
 
-    // 以前のマスターキーを取得する。
-    SslMasterKey before_key = { 0 };
-    before_key.length = _SSL_SESSION_get_master_key(_SSL_get_session(ssl), before_key.value, SSL_MAX_MASTER_KEY_LENGTH);
+int SSL_do_handshake(SSL *ssl)
+{
+    return atomic_load_explicit(&SSL_do_handshake_impl, memory_order_acquire)(ssl);
+}
 
-    // 本来の関数を呼び出す。
-    int ret = _SSL_connect(ssl);
-    if (ret == 1)
-    {   // 成功の場合、ログ出力する。
-        logging_key(ssl, &before_key);
-    }
-    return ret;
+int SSL_accept(SSL *ssl)
+{
+    return atomic_load_explicit(&SSL_accept_impl, memory_order_acquire)(ssl);
 }
 
-int SSL_do_handshake(SSL *ssl)
+/**
+ * アプリケーションが情報コールバックを登録する際に呼び出される。
+ * OpenSSL 1.1.0 の場合、アプリケーションのコールバックはコンテキスト (または SSL) 毎に保持し、
+ * 本ライブラリの情報コールバックから呼び出す。(本ライブラリのコールバックは登録されたままとなる)
+ *
+ * @param ctx コンテキスト (SSL_set_info_callback の場合は SSL オブジェクト)
+ * @param cb アプリケーションのコールバック (NULL の場合、登録解除)
+ */
+void SSL_CTX_set_info_callback(SSL_CTX *ctx, _SSL_info_cb_func cb)
 {
-    if (_SSL_CTX_set_keylog_callback != NULL)
-    {   // OpenSSL 1.1.1 以降は、callback が利用可能なため、そのまま呼び出す。
-        return _SSL_do_handshake(ssl);
-    }
+    atomic_load_explicit(&SSL_CTX_set_info_callback_impl, memory_order_acquire)(ctx, cb);
+}
 
-    // 以前のマスターキーを取得する。
-    SslMasterKey before_key = { 0 };
-    before_key.length = _SSL_SESSION_get_master_key(_SSL_get_session(ssl), before_key.value, SSL_MAX_MASTER_KEY_LENGTH);
+void SSL_set_info_callback(SSL *ssl, _SSL_info_cb_func cb)
+{
+    atomic_load_explicit(&SSL_set_info_callback_impl, memory_order_acquire)(ssl, cb);
+}
 
-    // 本来の関数を呼び出す。
-    int ret = _SSL_do_handshake(ssl);
-    if (ret == 1)
-    {   // 成功の場合、ログ出力する。
-        logging_key(ssl, &before_key);
-    }
-    return ret;
+/**
+ * アプリケーションが情報コールバックを取得する際に呼び出される。
+ * アプリケーションが登録したコールバックを返す。
+ *
+ * @param ctx コンテキスト (SSL_get_info_callback の場合は SSL オブジェクト)
+ * @return アプリケーションのコールバック
+ */
+_SSL_info_cb_func SSL_CTX_get_info_callback(SSL_CTX *ctx)
+{
+    return atomic_load_explicit(&SSL_CTX_get_info_callback_impl, memory_order_acquire)(ctx);
 }
 
-int SSL_accept(SSL *ssl)
+_SSL_info_cb_func SSL_get_info_callback(const SSL *ssl)
 {
-    // 以前のマスターキーを取得する。
-    SslMasterKey before_key = { 0 };
-    before_key.length = _SSL_SESSION_get_master_key(_SSL_get_session(ssl), before_key.value, SSL_MAX_MASTER_KEY_LENGTH);
-    // 本来の関数を呼び出す。
-    int ret = _SSL_accept(ssl);
-    if (ret == 1)
-    {   // 成功の場合、ログ出力する。
-        logging_key(ssl, &before_key);
-    }
-    return ret;
+    return atomic_load_explicit(&SSL_get_info_callback_impl, memory_order_acquire)(ssl);
 }
 
 // =============================================================================
@@ -179,188 +742,6654 @@ int SSL_accept(SSL *ssl)
 
 /**
  * OpenSSL のフック初期化。
- * 本関数は、SSL_new が実行された際に一度だけ呼び出されます。
+ * 本関数は、ライブラリのロード時 (init_constructor)、または初期化前にいずれかのフック関数が
+ * 呼び出された際 (lazy_* 関数) に一度だけ呼び出されます。
+ *
+ * オリジナル関数をロードし、フック関数の実処理をオリジナル関数とします。
+ * SSL_CTX_new, SSL_new (および SSL_CTX_set_keylog_callback/SSL_CTX_get_keylog_callback) のみ
+ * first_* 関数とし、キー情報を出力するか否かは、最初の呼び出し時に判定します。(init_keylog_file を参照)
+ * (ライブラリのロード後、SSL/TLS の利用開始前にアプリケーションが setenv した SSLKEYLOGFILE も有効とする)
  */
 static
 void init_openssl_hooks(void)
 {
     // オリジナル関数のロード
-    _SSL_new = (SSL *(*)(SSL_CTX *)) load_function_or_die("SSL_new");
-    _SSL_connect = (int (*)(SSL *)) load_function_or_die("SSL_connect");
-    _SSL_do_handshake = (int (*)(SSL *)) load_function_or_die("SSL_do_handshake");
-    _SSL_accept = (int (*)(SSL *)) load_function_or_die("SSL_accept");
-    _SSL_get_client_random = (size_t (*)(const SSL *, unsigned char *, size_t)) load_function_or_die("SSL_get_client_random");
-    _SSL_SESSION_get_master_key = (size_t (*)(const SSL_SESSION *, unsigned char *, size_t)) load_function_or_die("SSL_SESSION_get_master_key");
-    _SSL_get_session = (SSL_SESSION *(*)(const SSL *)) load_function_or_die("SSL_get_session");
-
-    // OpenSSL 1.1.1 以降対応の関数ロード
-    _SSL_CTX_set_keylog_callback = (void (*)(SSL_CTX *, _SSL_CTX_keylog_cb_func)) load_function("SSL_CTX_set_keylog_callback");
-
-    // KeyLogFile を初期化
-    KeyLogFile_init();
+    load_functions();
+
+    // 判定前の実処理 (SSL オブジェクトは SSL_new で生成されるため、ハンドシェイク関数などは判定後にのみ呼び出される)
+    init_passthrough_hooks();
+    atomic_store_explicit(&SSL_CTX_new_impl, first_SSL_CTX_new, memory_order_release);
+    atomic_store_explicit(&SSL_new_impl, first_SSL_new, memory_order_release);
+#ifdef KEYLOG_HOOK_KEYLOG_CALLBACK
+    atomic_store_explicit(&SSL_CTX_set_keylog_callback_impl, first_SSL_CTX_set_keylog_callback, memory_order_release);
+    atomic_store_explicit(&SSL_CTX_get_keylog_callback_impl, first_SSL_CTX_get_keylog_callback, memory_order_release);
+#endif
 }
 
 /**
- * SSL のログを残します。(OpenSSL 1.1.0 以前対応)
- * 現在の master key が、指定された before_key と同じ場合はログ出力しません。
+ * キー情報を出力する場合のフック初期化。
+ * 本関数は、最初の SSL_CTX_new または SSL_new の呼び出し時に、SSLKEYLOGFILE または
+ * SSLKEYLOG_CONTROL が指定されている場合のみ一度だけ呼び出されます。(init_keylog_file を参照)
  */
 static
-void logging_key(SSL *ssl, SslMasterKey *before_key)
+void init_keylog_hooks(void)
 {
-    SslMasterKey after_key = { 0 };
-    after_key.length = _SSL_SESSION_get_master_key(_SSL_get_session(ssl), after_key.value, SSL_MAX_MASTER_KEY_LENGTH);
-    if ((after_key.length > 0) && memcmp(after_key.value, before_key->value, after_key.length) != 0)
-    {   // master key が変化した。
-        SslClientRandom crandom = { 0 };
-        crandom.length = _SSL_get_client_random(ssl, crandom.value, SSL3_RANDOM_SIZE);
-        KeyLogFile_raw_dump(&crandom, &after_key);
+    if (_SSL_CTX_get_keylog_callback == NULL)
+    {   // set/get はいずれも OpenSSL 1.1.1 にて追加されたため、片方のみの利用はしない。
+        _SSL_CTX_set_keylog_callback = NULL;
+    }
+    else if (KeyLogFile_getenv_size("SSLKEYLOG_FORCE_LEGACY", 0) != 0)
+    {   // OpenSSL 1.1.0 の経路を強制する。(ベンチマーク、動作確認用)
+        _SSL_CTX_set_keylog_callback = NULL;
+        _SSL_CTX_get_keylog_callback = NULL;
+    }
+
+    // アプリケーションのコールバック保持用
+    if (_SSL_CTX_set_keylog_callback != NULL && _SSL_get_SSL_CTX != NULL && _SSL_CTX_get_ex_data != NULL
+            && _SSL_CTX_set_ex_data != NULL && _CRYPTO_get_ex_new_index != NULL)
+    {
+        app_keylog_callback_index = _CRYPTO_get_ex_new_index(CRYPTO_EX_INDEX_SSL_CTX, 0, NULL, NULL, NULL, NULL);
+    }
+
+    // ハンドシェイクの状態保持用 (OpenSSL 1.1.0 以前対応)
+    if (_SSL_CTX_set_keylog_callback == NULL && _SSL_get_ex_data != NULL && _SSL_set_ex_data != NULL
+            && _CRYPTO_get_ex_new_index != NULL)
+    {
+        handshake_state_index = _CRYPTO_get_ex_new_index(CRYPTO_EX_INDEX_SSL, 0, NULL, NULL, NULL, free_handshake_state);
+    }
+
+    // 再ネゴシエーションの検出用 (OpenSSL 1.1.0 以前対応)
+    // 情報コールバックを登録するため、アプリケーションのコールバックを保持できる場合のみ検出する。
+    if (_SSL_CTX_set_keylog_callback == NULL && handshake_state_index >= 0 && _SSL_get_SSL_CTX != NULL
+            && _SSL_CTX_get_ex_data != NULL && _SSL_CTX_set_ex_data != NULL)
+    {
+        app_info_callback_index = _CRYPTO_get_ex_new_index(CRYPTO_EX_INDEX_SSL_CTX, 0, NULL, NULL, NULL, NULL);
+        app_ssl_info_callback_index = _CRYPTO_get_ex_new_index(CRYPTO_EX_INDEX_SSL, 0, NULL, NULL, NULL, NULL);
+    }
+
+    // 16進数変換関数を選択
+    hex_encode_init();
+
+    // 出力対象のフィルタを初期化
+    KeyLogFilter_init();
+
+    // フック関数の実処理を書き換える。(release: 書き換え後の実処理から、上記の初期化内容を参照できる)
+    // SSL_CTX_new, SSL_new は、キーログファイルを開いてから書き換える。(init_keylog_file)
+#ifdef KEYLOG_HOOK_KEYLOG_CALLBACK
+    atomic_store_explicit(&SSL_CTX_set_keylog_callback_impl, keylog_SSL_CTX_set_keylog_callback, memory_order_release);
+    atomic_store_explicit(&SSL_CTX_get_keylog_callback_impl, keylog_SSL_CTX_get_keylog_callback, memory_order_release);
+#endif
+
+    // ハンドシェイク関数の実処理を選択
+    if (_SSL_CTX_set_keylog_callback != NULL)
+    {   // OpenSSL 1.1.1 以降は、callback が利用可能なため、そのまま呼び出す。
+        atomic_store_explicit(&SSL_connect_impl, _SSL_connect, memory_order_release);
+        atomic_store_explicit(&SSL_do_handshake_impl, _SSL_do_handshake, memory_order_release);
+        atomic_store_explicit(&SSL_accept_impl, _SSL_accept, memory_order_release);
     }
     else
-    {   // NOP
-        // セッションが再利用されたため、ログ出力不要。
-        // Wireshark は、重複してキーが出力されても問題なく解析可能であるが、
-        // 冗長なログとなるため、出力しない。
+    {
+        atomic_store_explicit(&SSL_connect_impl, legacy_SSL_connect, memory_order_release);
+        atomic_store_explicit(&SSL_do_handshake_impl, legacy_SSL_do_handshake, memory_order_release);
+        atomic_store_explicit(&SSL_accept_impl, legacy_SSL_accept, memory_order_release);
+    }
+
+    // 情報コールバックの登録、取得関数の実処理を選択
+    // (再ネゴシエーションを検出しない場合は、オリジナル関数をそのまま呼び出す)
+    if (app_info_callback_index >= 0 && app_ssl_info_callback_index >= 0)
+    {
+        atomic_store_explicit(&SSL_CTX_set_info_callback_impl, keylog_SSL_CTX_set_info_callback, memory_order_release);
+        atomic_store_explicit(&SSL_CTX_get_info_callback_impl, keylog_SSL_CTX_get_info_callback, memory_order_release);
+        atomic_store_explicit(&SSL_set_info_callback_impl, keylog_SSL_set_info_callback, memory_order_release);
+        atomic_store_explicit(&SSL_get_info_callback_impl, keylog_SSL_get_info_callback, memory_order_release);
+    }
+    else
+    {
+        atomic_store_explicit(&SSL_CTX_set_info_callback_impl, _SSL_CTX_set_info_callback, memory_order_release);
+        atomic_store_explicit(&SSL_CTX_get_info_callback_impl, _SSL_CTX_get_info_callback, memory_order_release);
+        atomic_store_explicit(&SSL_set_info_callback_impl, _SSL_set_info_callback, memory_order_release);
+        atomic_store_explicit(&SSL_get_info_callback_impl, _SSL_get_info_callback, memory_order_release);
+    }
+
+    const char *trace = getenv("SSLKEYLOG_TRACE");
+    if (trace != NULL && *trace != '\0')
+    {   // ハンドシェイクのトレース: 選択した実処理を trace_* 関数経由で呼び出す。
+        // (トレースファイルは、キーログファイルと同時に開く。開くまでは記録しない)
+        SSL_connect_traced = atomic_load_explicit(&SSL_connect_impl, memory_order_relaxed);
+        SSL_do_handshake_traced = atomic_load_explicit(&SSL_do_handshake_impl, memory_order_relaxed);
+        SSL_accept_traced = atomic_load_explicit(&SSL_accept_impl, memory_order_relaxed);
+        atomic_store_explicit(&SSL_connect_impl, trace_SSL_connect, memory_order_release);
+        atomic_store_explicit(&SSL_do_handshake_impl, trace_SSL_do_handshake, memory_order_release);
+        atomic_store_explicit(&SSL_accept_impl, trace_SSL_accept, memory_order_release);
     }
 }
 
 /**
- * 指定されたシンボルのオリジナル関数を取得します。
- * オリジナル関数を取得できない場合、NULL を返します。
- *
- * @param sym シンボル
- * @return オリジナル関数
+ * SSLKEYLOGFILE が未設定の場合のフック初期化。
+ * フック関数の実処理をオリジナル関数に書き換え、コールバックの登録、マスターキーのスナップショット、
+ * キーログファイル管理の初期化 (ファイル、スレッドの生成) を一切行わないようにします。
+ * 以降のフック関数の呼び出しは、実処理のポインタを経由したオリジナル関数の呼び出しのみとなります。
+ * (SSL_CTX_new, SSL_new は、呼び出し元にて書き換える)
  */
 static
-void *load_function(const char *sym)
+void init_passthrough_hooks(void)
 {
-    // 次に見つかるシンボルを探す。
-    // 本プログラム(libsslkeylog.so)は、LD_PRELOAD により最初にロードされるため、
-    // 次に見つかる同名のシンボルが、本来の OpenSSL によるシンボルとなる。
-    void *func = dlsym(RTLD_NEXT, sym);
-    if (!func)
-    {   // 関数が見つからない場合は、libssl.so をロードして探してみる。
-        void *handle = dlopen("libssl.so", RTLD_LAZY);
-        if (handle)
-        {
-            func = dlsym(handle, sym);
-        }
-        dlclose(handle);
+    atomic_store_explicit(&SSL_connect_impl, _SSL_connect, memory_order_release);
+    atomic_store_explicit(&SSL_do_handshake_impl, _SSL_do_handshake, memory_order_release);
+    atomic_store_explicit(&SSL_accept_impl, _SSL_accept, memory_order_release);
+    atomic_store_explicit(&SSL_CTX_set_info_callback_impl, _SSL_CTX_set_info_callback, memory_order_release);
+    atomic_store_explicit(&SSL_CTX_get_info_callback_impl, _SSL_CTX_get_info_callback, memory_order_release);
+    atomic_store_explicit(&SSL_set_info_callback_impl, _SSL_set_info_callback, memory_order_release);
+    atomic_store_explicit(&SSL_get_info_callback_impl, _SSL_get_info_callback, memory_order_release);
+#ifdef KEYLOG_HOOK_KEYLOG_CALLBACK
+    if (_SSL_CTX_set_keylog_callback != NULL && _SSL_CTX_get_keylog_callback != NULL)
+    {
+        atomic_store_explicit(&SSL_CTX_set_keylog_callback_impl, _SSL_CTX_set_keylog_callback, memory_order_release);
+        atomic_store_explicit(&SSL_CTX_get_keylog_callback_impl, _SSL_CTX_get_keylog_callback, memory_order_release);
+    }
+    else
+    {   // 1.1.1 以降のヘッダでビルドし、OpenSSL 1.1.0 で動作している。(アプリケーションからは呼び出されない)
+        atomic_store_explicit(&SSL_CTX_set_keylog_callback_impl, keylog_SSL_CTX_set_keylog_callback, memory_order_release);
+        atomic_store_explicit(&SSL_CTX_get_keylog_callback_impl, keylog_SSL_CTX_get_keylog_callback, memory_order_release);
     }
-    return func;
+#endif
 }
 
 /**
- * 指定されたシンボルのオリジナル関数を取得します。
- * オリジナル関数を取得できない場合、処理を中断 (abort) します。
- *
- * @param sym シンボル
- * @return オリジナル関数
+ * ライブラリのロード時に呼び出され、OpenSSL のフックを初期化します。
+ * libssl がまだロードされていない場合 (アプリケーションが後から dlopen する場合など) は、
+ * 初期化せず、最初のフック関数の呼び出し時 (lazy_* 関数) に初期化します。
  */
-static
-void *load_function_or_die(const char *sym)
+static __attribute__((constructor))
+void init_constructor(void)
 {
-    void *func = load_function(sym);
-    if (!func)
+    if (dlsym(RTLD_NEXT, "SSL_new") != NULL)
     {
-        abort();
+        call_once(&openssl_init_flag, init_openssl_hooks);
     }
-    return func;
 }
 
-
-////////////////////////////////////////////////////////////////////////////////
-//
-// キーログファイル管理
-//
-
-static int KeyLogFile_fd = -1;
-
 /**
- * キーログファイル管理を初期化します。
+ * キー情報を出力するか否かを判定し、キーログファイル管理を初期化して SSL_CTX_new, SSL_new の実処理を書き換えます。
+ * 本関数は、最初の SSL_CTX_new または SSL_new (または SSL_CTX_set_keylog_callback/SSL_CTX_get_keylog_callback)
+ * の呼び出し時に一度だけ呼び出されます。
+ *
+ * ライブラリのロード時ではなく SSL/TLS の利用開始時に環境変数を参照し、ファイルを開くため、
+ * SSL/TLS の利用開始前にアプリケーションが設定した SSLKEYLOGFILE も有効となり、
+ * SSL/TLS 通信を行わないプロセスではファイル生成やスレッド生成は行われず、
+ * デーモン化 (fork) 後に SSL/TLS 通信を開始するプロセスでは、書き込みスレッドなどは子プロセスで生成される。
+ * SSLKEYLOGFILE, SSLKEYLOG_CONTROL のいずれも未設定の場合は、全ての実処理をオリジナル関数とし、
+ * 以降はオリジナル関数の呼び出しのみとなる。
  */
 static
-void KeyLogFile_init(void)
+void init_keylog_file(void)
 {
-    if (KeyLogFile_fd >= 0)
-    {   // すでに初期化済みのためなにもしない。
+    const char *sslkeylogfile = getenv("SSLKEYLOGFILE");
+    const char *control = getenv("SSLKEYLOG_CONTROL");
+    if ((sslkeylogfile == NULL || *sslkeylogfile == '\0') && (control == NULL || *control == '\0'))
+    {   // キー情報を出力しない: 全てのフック関数をオリジナル関数の呼び出しのみとする。
+        // (制御ファイルが指定された場合は、実行中に出力を開始できるようフックする)
+        init_passthrough_hooks();
+        atomic_store_explicit(&SSL_CTX_new_impl, _SSL_CTX_new, memory_order_release);
+        atomic_store_explicit(&SSL_new_impl, _SSL_new, memory_order_release);
         return;
     }
 
-    const char *sslkeylogfile_name = getenv("SSLKEYLOGFILE");
-    if (sslkeylogfile_name)
-    {   // カーネルレベルでアトミックに追記したいため、fopen の "a" ではなく、
-        // open の O_APPEND にてファイルを開く。
-        KeyLogFile_fd = open(sslkeylogfile_name, O_WRONLY | O_APPEND | O_CREAT, 0644);
-        atexit(KeyLogFile_finalize);
-    }
+    init_keylog_hooks();
+    KeyLogFile_init();
+
+    atomic_store_explicit(&SSL_CTX_new_impl, keylog_SSL_CTX_new, memory_order_release);
+    atomic_store_explicit(&SSL_new_impl, keylog_SSL_new, memory_order_release);
 }
 
 /**
- * キーログファイル管理を終了します。
+ * キーログファイルを開く前の SSL_CTX_new の実処理。
  */
 static
-void KeyLogFile_finalize(void)
+SSL_CTX *first_SSL_CTX_new(const SSL_METHOD *method)
 {
-    if (KeyLogFile_fd >= 0)
-    {
-        close(KeyLogFile_fd);
-    }
+    call_once(&keylog_file_init_flag, init_keylog_file);
+    return atomic_load_explicit(&SSL_CTX_new_impl, memory_order_relaxed)(method);
 }
 
 /**
- * TLS キーが生成、受信された際に呼び出されるコールバック関数。
- * 引数より渡されたキー情報を SSLKEYLOGFILE デバッグ出力に出力します。
- *
- * @param ssl SSL オブジェクト
- * @param line キー情報 (NSS が SSLKEYLOGFILE デバッグ出力に使用する形式のキーマテリアルを含む文字列)
+ * キーログファイルを開く前の SSL_new の実処理。
  */
 static
-void KeyLogFile_callback(const SSL *ssl, const char *line)
+SSL *first_SSL_new(SSL_CTX *ctx)
 {
-    (void) ssl;
-    if (KeyLogFile_fd >= 0)
-    {
-        write(KeyLogFile_fd, line, strlen(line));
-        write(KeyLogFile_fd, "\n", strlen("\n"));
-    }
+    call_once(&keylog_file_init_flag, init_keylog_file);
+    return atomic_load_explicit(&SSL_new_impl, memory_order_relaxed)(ctx);
 }
 
+#ifdef KEYLOG_HOOK_KEYLOG_CALLBACK
 /**
- * 指定されたクライアントランダムとマスタキーを SSLKEYLOGFILE デバッグ出力に出力します。
- *
- * @param client_random クライアントランダム
- * @param master_key マスターキー
+ * キー情報を出力するか否かを判定する前の SSL_CTX_set_keylog_callback の実処理。
+ * (SSL_CTX_new_ex など、SSL_CTX_new を経由せずに生成されたコンテキストに登録された場合)
  */
 static
-void KeyLogFile_raw_dump(const SslClientRandom *client_random, const SslMasterKey *master_key)
+void first_SSL_CTX_set_keylog_callback(SSL_CTX *ctx, _SSL_CTX_keylog_cb_func cb)
 {
-    if (client_random->length != 0 && master_key->length != 0)
-    {   // クライアントランダム、マスターキーともに有効な場合ログ出力する。
-        unsigned char line[CLIENT_RANDOM_LINE_LENGTH] = { 0 };
-        char *p = (char*) line;
-        memcpy(p, CLIENT_RANDOM, CLIENT_RANDOM_LEN);
-        p += CLIENT_RANDOM_LEN;
-
-        // クライアントランダムを出力する。
-        for (size_t i = 0; i < client_random->length; i++)
-        {
-            sprintf(p, "%02x", client_random->value[i]);
-            p += 2;
-        }
-
-        *p++ = ' ';
+    call_once(&keylog_file_init_flag, init_keylog_file);
+    atomic_load_explicit(&SSL_CTX_set_keylog_callback_impl, memory_order_relaxed)(ctx, cb);
+}
+
+/**
+ * キー情報を出力するか否かを判定する前の SSL_CTX_get_keylog_callback の実処理。
+ */
+static
+_SSL_CTX_keylog_cb_func first_SSL_CTX_get_keylog_callback(const SSL_CTX *ctx)
+{
+    call_once(&keylog_file_init_flag, init_keylog_file);
+    return atomic_load_explicit(&SSL_CTX_get_keylog_callback_impl, memory_order_relaxed)(ctx);
+}
+#endif
+
+/**
+ * SSL_CTX_new の実処理。
+ * コンテキスト生成時に、キーログ用のコールバックを登録する。
+ */
+static
+SSL_CTX *keylog_SSL_CTX_new(const SSL_METHOD *method)
+{
+    SSL_CTX *ctx = _SSL_CTX_new(method);
+    if (ctx != NULL)
+    {
+        install_keylog_callback(ctx);
+    }
+    return ctx;
+}
+
+/**
+ * SSL_new の実処理。
+ */
+static
+SSL *keylog_SSL_new(SSL_CTX *ctx)
+{
+    // 通常は SSL_CTX_new にてコールバック登録済みのため、参照のみとなる。
+    // (SSL_CTX_new_ex など、SSL_CTX_new を経由せずに生成されたコンテキストの場合のみ登録する)
+    install_keylog_callback(ctx);
+
+    return _SSL_new(ctx);
+}
+
+#ifdef KEYLOG_HOOK_KEYLOG_CALLBACK
+/**
+ * SSL_CTX_set_keylog_callback の実処理。
+ * アプリケーションのコールバックは、コンテキストの ex_data に保持する。
+ */
+static
+void keylog_SSL_CTX_set_keylog_callback(SSL_CTX *ctx, _SSL_CTX_keylog_cb_func cb)
+{
+    if (app_keylog_callback_index < 0)
+    {   // コールバックを保持できないため、アプリケーションのコールバックを優先する。
+        if (_SSL_CTX_set_keylog_callback != NULL)
+        {
+            _SSL_CTX_set_keylog_callback(ctx, cb);
+        }
+        return;
+    }
+
+    _SSL_CTX_set_ex_data(ctx, app_keylog_callback_index, (void *) cb);
+    install_keylog_callback(ctx);
+}
+
+/**
+ * SSL_CTX_get_keylog_callback の実処理。
+ * アプリケーションが登録したコールバックを返す。
+ */
+static
+_SSL_CTX_keylog_cb_func keylog_SSL_CTX_get_keylog_callback(const SSL_CTX *ctx)
+{
+    if (app_keylog_callback_index < 0)
+    {
+        return (_SSL_CTX_get_keylog_callback != NULL) ? _SSL_CTX_get_keylog_callback(ctx) : NULL;
+    }
+    return get_app_keylog_callback(ctx);
+}
+#endif
+
+/**
+ * SSL_CTX_set_info_callback の実処理。(OpenSSL 1.1.0 以前対応)
+ * アプリケーションのコールバックは、コンテキストの ex_data に保持する。
+ */
+static
+void keylog_SSL_CTX_set_info_callback(SSL_CTX *ctx, _SSL_info_cb_func cb)
+{
+    if (!_SSL_CTX_set_ex_data(ctx, app_info_callback_index, (void *) cb))
+    {   // コールバックを保持できないため、アプリケーションのコールバックを優先する。
+        _SSL_CTX_set_info_callback(ctx, cb);
+        return;
+    }
+    if (cb != NULL)
+    {
+        atomic_store_explicit(&app_info_callback_used, true, memory_order_relaxed);
+    }
+    install_info_callback(ctx);
+}
+
+/**
+ * SSL_CTX_get_info_callback の実処理。(OpenSSL 1.1.0 以前対応)
+ * アプリケーションが登録したコールバックを返す。
+ */
+static
+_SSL_info_cb_func keylog_SSL_CTX_get_info_callback(SSL_CTX *ctx)
+{
+    _SSL_info_cb_func cb = _SSL_CTX_get_info_callback(ctx);
+    if (cb != keylog_info_callback)
+    {   // ex_data に保持できず、アプリケーションのコールバックを登録した。
+        return cb;
+    }
+    return (_SSL_info_cb_func) _SSL_CTX_get_ex_data(ctx, app_info_callback_index);
+}
+
+/**
+ * SSL_set_info_callback の実処理。(OpenSSL 1.1.0 以前対応)
+ * SSL のコールバックはコンテキストのコールバックより優先されるため、
+ * アプリケーションのコールバックを SSL の ex_data に保持し、本ライブラリのコールバックを登録する。
+ * (登録解除の場合は、コンテキストに登録済みの本ライブラリのコールバックが呼び出される)
+ */
+static
+void keylog_SSL_set_info_callback(SSL *ssl, _SSL_info_cb_func cb)
+{
+    if (!_SSL_set_ex_data(ssl, app_ssl_info_callback_index, (void *) cb))
+    {   // コールバックを保持できないため、アプリケーションのコールバックを優先する。
+        _SSL_set_info_callback(ssl, cb);
+        return;
+    }
+    if (cb != NULL)
+    {
+        atomic_store_explicit(&app_info_callback_used, true, memory_order_relaxed);
+    }
+    _SSL_set_info_callback(ssl, (cb != NULL) ? keylog_info_callback : NULL);
+}
+
+/**
+ * SSL_get_info_callback の実処理。(OpenSSL 1.1.0 以前対応)
+ * アプリケーションが登録したコールバックを返す。
+ */
+static
+_SSL_info_cb_func keylog_SSL_get_info_callback(const SSL *ssl)
+{
+    _SSL_info_cb_func cb = _SSL_get_info_callback(ssl);
+    if (cb != keylog_info_callback)
+    {   // 未登録、または ex_data に保持できず、アプリケーションのコールバックを登録した。
+        return cb;
+    }
+    return (_SSL_info_cb_func) _SSL_get_ex_data(ssl, app_ssl_info_callback_index);
+}
+
+/**
+ * 初期化前の SSL_CTX_new の実処理。
+ * 初期化してから、書き換えられた実処理を呼び出す。(以下、lazy_* 関数は同様)
+ */
+static
+SSL_CTX *lazy_SSL_CTX_new(const SSL_METHOD *method)
+{
+    call_once(&openssl_init_flag, init_openssl_hooks);
+    return atomic_load_explicit(&SSL_CTX_new_impl, memory_order_relaxed)(method);
+}
+
+static
+SSL *lazy_SSL_new(SSL_CTX *ctx)
+{
+    call_once(&openssl_init_flag, init_openssl_hooks);
+    return atomic_load_explicit(&SSL_new_impl, memory_order_relaxed)(ctx);
+}
+
+#ifdef KEYLOG_HOOK_KEYLOG_CALLBACK
+static
+void lazy_SSL_CTX_set_keylog_callback(SSL_CTX *ctx, _SSL_CTX_keylog_cb_func cb)
+{
+    call_once(&openssl_init_flag, init_openssl_hooks);
+    atomic_load_explicit(&SSL_CTX_set_keylog_callback_impl, memory_order_relaxed)(ctx, cb);
+}
+
+static
+_SSL_CTX_keylog_cb_func lazy_SSL_CTX_get_keylog_callback(const SSL_CTX *ctx)
+{
+    call_once(&openssl_init_flag, init_openssl_hooks);
+    return atomic_load_explicit(&SSL_CTX_get_keylog_callback_impl, memory_order_relaxed)(ctx);
+}
+#endif
+
+static
+int lazy_SSL_connect(SSL *ssl)
+{
+    call_once(&openssl_init_flag, init_openssl_hooks);
+    return atomic_load_explicit(&SSL_connect_impl, memory_order_relaxed)(ssl);
+}
+
+static
+int lazy_SSL_do_handshake(SSL *ssl)
+{
+    call_once(&openssl_init_flag, init_openssl_hooks);
+    return atomic_load_explicit(&SSL_do_handshake_impl, memory_order_relaxed)(ssl);
+}
+
+static
+int lazy_SSL_accept(SSL *ssl)
+{
+    call_once(&openssl_init_flag, init_openssl_hooks);
+    return atomic_load_explicit(&SSL_accept_impl, memory_order_relaxed)(ssl);
+}
+
+static
+void lazy_SSL_CTX_set_info_callback(SSL_CTX *ctx, _SSL_info_cb_func cb)
+{
+    call_once(&openssl_init_flag, init_openssl_hooks);
+    atomic_load_explicit(&SSL_CTX_set_info_callback_impl, memory_order_relaxed)(ctx, cb);
+}
+
+static
+_SSL_info_cb_func lazy_SSL_CTX_get_info_callback(SSL_CTX *ctx)
+{
+    call_once(&openssl_init_flag, init_openssl_hooks);
+    return atomic_load_explicit(&SSL_CTX_get_info_callback_impl, memory_order_relaxed)(ctx);
+}
+
+static
+void lazy_SSL_set_info_callback(SSL *ssl, _SSL_info_cb_func cb)
+{
+    call_once(&openssl_init_flag, init_openssl_hooks);
+    atomic_load_explicit(&SSL_set_info_callback_impl, memory_order_relaxed)(ssl, cb);
+}
+
+static
+_SSL_info_cb_func lazy_SSL_get_info_callback(const SSL *ssl)
+{
+    call_once(&openssl_init_flag, init_openssl_hooks);
+    return atomic_load_explicit(&SSL_get_info_callback_impl, memory_order_relaxed)(ssl);
+}
+
+/**
+ * 指定されたコンテキストに、キーログ用のコールバックを登録します。(OpenSSL 1.1.1 以降対応)
+ * 登録済みの場合は何もしません。
+ * 登録済みか否かの確認は参照のみのため、複数スレッドで共有されるコンテキストに対して
+ * 繰り返し呼び出されても、コンテキストへの書き込みは発生しません。
+ *
+ * @param ctx コンテキスト
+ */
+static
+void install_keylog_callback(SSL_CTX *ctx)
+{
+    if (_SSL_CTX_set_keylog_callback != NULL && _SSL_CTX_get_keylog_callback(ctx) != KeyLogFile_callback)
+    {   // OpenSSL 1.1.1 以降は、SSL_CTX_set_keylog_callback が用意されている。
+        // => コールバックを登録して、キー情報を SSLKEYLOGFILE デバッグ出力に出力する。
+        _SSL_CTX_set_keylog_callback(ctx, KeyLogFile_callback);
+    }
+    else if (app_info_callback_index >= 0)
+    {   // OpenSSL 1.1.0 は、SSL_read/SSL_write などの内部で完了した再ネゴシエーションを
+        // 情報コールバックにて検出する。
+        install_info_callback(ctx);
+    }
+}
+
+/**
+ * 指定されたコンテキストに、アプリケーションが登録したキーログ用のコールバックを取得します。
+ * コンテキストの ex_data 配列を参照するのみのため、ロックおよびメモリ確保は発生しません。
+ *
+ * @param ctx コンテキスト
+ * @return アプリケーションのコールバック (未登録の場合 NULL)
+ */
+static
+_SSL_CTX_keylog_cb_func get_app_keylog_callback(const SSL_CTX *ctx)
+{
+    if (app_keylog_callback_index < 0 || ctx == NULL)
+    {
+        return NULL;
+    }
+    return (_SSL_CTX_keylog_cb_func) _SSL_CTX_get_ex_data(ctx, app_keylog_callback_index);
+}
+
+/**
+ * 指定されたコンテキストに、再ネゴシエーション検出用の情報コールバックを登録します。(OpenSSL 1.1.0 以前対応)
+ * 登録済みの場合は何もしません。(install_keylog_callback と同様に、確認は参照のみ)
+ * アプリケーションのコールバックが登録済みの場合は、ex_data に移してから登録します。
+ *
+ * @param ctx コンテキスト
+ */
+static
+void install_info_callback(SSL_CTX *ctx)
+{
+    _SSL_info_cb_func cb = _SSL_CTX_get_info_callback(ctx);
+    if (cb == keylog_info_callback)
+    {
+        return;
+    }
+    if (cb != NULL)
+    {   // 本ライブラリの初期化前に登録されたコールバック
+        if (!_SSL_CTX_set_ex_data(ctx, app_info_callback_index, (void *) cb))
+        {   // 保持できないため、アプリケーションのコールバックを優先する。
+            return;
+        }
+        atomic_store_explicit(&app_info_callback_used, true, memory_order_relaxed);
+    }
+    _SSL_CTX_set_info_callback(ctx, keylog_info_callback);
+}
+
+/**
+ * 情報コールバック。(OpenSSL 1.1.0 以前対応)
+ * ハンドシェイク関数の外 (SSL_read/SSL_write など) でハンドシェイクが完了した場合、ログ出力します。
+ * 再ネゴシエーションはセッションを再利用する (abbreviated) 場合も含め、完了毎に通知されるため、
+ * 読み書き毎の確認は不要となります。(ハンドシェイク関数内の完了は、legacy_handshake にて出力する)
+ * アプリケーションのコールバックが登録されている場合は、続けて呼び出します。
+ *
+ * @param ssl SSL オブジェクト
+ * @param type 通知の種別 (SSL_CB_*)
+ * @param val 種別毎の値
+ */
+static
+void keylog_info_callback(const SSL *ssl, int type, int val)
+{
+    if ((type & SSL_CB_HANDSHAKE_DONE) != 0 && handshake_ssl != ssl)
+    {   // 以前のマスターキーは無し (長さ 0) として比較する。(再利用したセッションも出力する)
+        // 継続中のハンドシェイク (WANT_READ/WANT_WRITE) が読み書きにて完了した場合は、状態も完了とする。
+        SslHandshakeState *state = (SslHandshakeState *) _SSL_get_ex_data(ssl, handshake_state_index);
+        if (state != NULL)
+        {
+            state->pending = false;
+        }
+        SslMasterKey before_key = { 0 };
+        logging_key(ssl, &before_key);
+    }
+
+    if (!atomic_load_explicit(&app_info_callback_used, memory_order_relaxed))
+    {
+        return;
+    }
+    _SSL_info_cb_func cb = (_SSL_info_cb_func) _SSL_get_ex_data(ssl, app_ssl_info_callback_index);
+    if (cb == NULL)
+    {
+        SSL_CTX *ctx = _SSL_get_SSL_CTX(ssl);
+        cb = (ctx != NULL) ? (_SSL_info_cb_func) _SSL_CTX_get_ex_data(ctx, app_info_callback_index) : NULL;
+    }
+    if (cb != NULL)
+    {
+        cb(ssl, type, val);
+    }
+}
+
+/**
+ * SSL_connect の実処理。(OpenSSL 1.1.0 以前対応)
+ */
+static
+int legacy_SSL_connect(SSL *ssl)
+{
+    return legacy_handshake(ssl, _SSL_connect);
+}
+
+/**
+ * SSL_do_handshake の実処理。(OpenSSL 1.1.0 以前対応)
+ */
+static
+int legacy_SSL_do_handshake(SSL *ssl)
+{
+    return legacy_handshake(ssl, _SSL_do_handshake);
+}
+
+/**
+ * SSL_accept の実処理。(OpenSSL 1.1.0 以前対応)
+ */
+static
+int legacy_SSL_accept(SSL *ssl)
+{
+    return legacy_handshake(ssl, _SSL_accept);
+}
+
+/**
+ * 指定されたハンドシェイク関数を呼び出し、ハンドシェイクが完了してマスターキーが変化した場合ログ出力します。
+ * (OpenSSL 1.1.0 以前対応)
+ *
+ * 非ブロッキングのソケットでは、ハンドシェイクが完了するまで (SSL_ERROR_WANT_READ/WANT_WRITE の間)
+ * 繰り返し呼び出され、マスターキーは完了前の呼び出しで生成されることがある。
+ * そのため、ハンドシェイク開始前のマスターキーは最初の呼び出し時にのみ取得して SSL の ex_data に保持し、
+ * 完了時に比較する。(完了前の呼び出しでは、マスターキーを取得しない)
+ * 同期的に完了した場合は、状態を保持しない。(メモリ確保は発生しない)
+ * 状態は最初に未完了となった際に SSL 毎に 1 回のみ確保し、以降の再ネゴシエーションでも再利用する。
+ * SSL_connect/SSL_accept の内部から呼び出される SSL_do_handshake は、外側の呼び出しにて処理する。
+ *
+ * @param ssl SSL オブジェクト
+ * @param handshake オリジナルのハンドシェイク関数
+ * @return ハンドシェイク関数の戻り値
+ */
+static
+int legacy_handshake(SSL *ssl, int (*handshake)(SSL *ssl))
+{
+    if (handshake_ssl == ssl)
+    {   // 外側のハンドシェイク関数の内部からの呼び出し
+        return handshake(ssl);
+    }
+
+    // 以前のマスターキーを取得する。(継続中のハンドシェイクの場合は、最初の呼び出し時のもの)
+    SslHandshakeState *state = (handshake_state_index >= 0)
+            ? (SslHandshakeState *) _SSL_get_ex_data(ssl, handshake_state_index) : NULL;
+    bool pending = (state != NULL && state->pending);
+    SslMasterKey before_key = { 0 };
+    if (!pending)
+    {
+        get_master_key(ssl, &before_key);
+    }
+
+    // 本来の関数を呼び出す。
+    const SSL *outer_ssl = handshake_ssl;
+    handshake_ssl = ssl;
+    int ret = handshake(ssl);
+    handshake_ssl = outer_ssl;
+
+    if (ret == 1)
+    {   // 成功の場合、ログ出力する。
+        logging_key(ssl, pending ? &state->before_key : &before_key);
+        if (pending)
+        {   // 次のハンドシェイク (再ネゴシエーション) は、改めて開始前のマスターキーを取得する。
+            // (状態は解放せず、次に未完了となった際に再利用する)
+            state->pending = false;
+        }
+    }
+    else if (!pending && handshake_state_index >= 0)
+    {   // 未完了 (WANT_READ/WANT_WRITE など): 開始前のマスターキーを保持する。
+        // (状態は SSL 毎に 1 回のみ確保し、SSL_free 時に free_handshake_state にて解放される)
+        if (state == NULL)
+        {
+            state = (SslHandshakeState *) malloc(sizeof(SslHandshakeState));
+            if (state != NULL && !_SSL_set_ex_data(ssl, handshake_state_index, state))
+            {
+                free(state);
+                state = NULL;
+            }
+        }
+        if (state != NULL)
+        {
+            state->before_key = before_key;
+            state->pending = true;
+        }
+    }
+    return ret;
+}
+
+/**
+ * SSL オブジェクトの解放時に呼び出され、ハンドシェイクの状態を解放します。
+ * (CRYPTO_EX_free。OpenSSL 1.1.0 以前対応)
+ *
+ * @param parent SSL オブジェクト
+ * @param ptr ハンドシェイクの状態 (NULL の場合あり)
+ * @param ad 未使用
+ * @param idx 未使用
+ * @param argl 未使用
+ * @param argp 未使用
+ */
+static
+void free_handshake_state(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp)
+{
+    (void) parent;
+    (void) ad;
+    (void) idx;
+    (void) argl;
+    (void) argp;
+    free(ptr);
+}
+
+/**
+ * SSL_connect のトレース時の実処理。
+ */
+static
+int trace_SSL_connect(SSL *ssl)
+{
+    return trace_handshake(ssl, SSL_connect_traced, "SSL_connect");
+}
+
+/**
+ * SSL_do_handshake のトレース時の実処理。
+ */
+static
+int trace_SSL_do_handshake(SSL *ssl)
+{
+    return trace_handshake(ssl, SSL_do_handshake_traced, "SSL_do_handshake");
+}
+
+/**
+ * SSL_accept のトレース時の実処理。
+ */
+static
+int trace_SSL_accept(SSL *ssl)
+{
+    return trace_handshake(ssl, SSL_accept_traced, "SSL_accept");
+}
+
+/**
+ * 指定されたハンドシェイク関数を呼び出し、開始時刻・所要時間・戻り値をトレースに記録します。
+ * (非ブロッキングの場合、ハンドシェイク完了までの呼び出し毎に記録する)
+ *
+ * @param ssl SSL オブジェクト
+ * @param handshake ハンドシェイク関数の実処理
+ * @param name トレースに記録する関数名
+ * @return ハンドシェイク関数の戻り値
+ */
+static
+int trace_handshake(SSL *ssl, int (*handshake)(SSL *ssl), const char *name)
+{
+    uint64_t start = KeyLogTrace_now();
+    int ret = handshake(ssl);
+    KeyLogTrace_handshake(ssl, name, start, ret);
+    return ret;
+}
+
+/**
+ * 現在のセッションのマスターキーを取得します。
+ * セッションが存在しない場合 (初回ハンドシェイク前) は、長さ 0 となります。
+ *
+ * @param ssl SSL オブジェクト
+ * @param key マスターキー格納先
+ */
+static
+void get_master_key(const SSL *ssl, SslMasterKey *key)
+{
+    SSL_SESSION *session = _SSL_get_session(ssl);
+    key->length = (session != NULL) ? _SSL_SESSION_get_master_key(session, key->value, SSL_MAX_MASTER_KEY_LENGTH) : 0;
+}
+
+/**
+ * SSL のログを残します。(OpenSSL 1.1.0 以前対応)
+ * 現在の master key が、指定された before_key と同じ場合はログ出力しません。
+ */
+static
+void logging_key(const SSL *ssl, SslMasterKey *before_key)
+{
+    if (!KeyLogFilter_accept(ssl, CLIENT_RANDOM, CLIENT_RANDOM_LEN - 1))
+    {   // 出力対象外のため、マスターキーの取得も不要。
+        KeyLogStats_add(KEYLOG_STATS_SECRETS, 1);
+        KeyLogStats_add(KEYLOG_STATS_FILTERED, 1);
+        return;
+    }
+
+    SslMasterKey after_key = { 0 };
+    get_master_key(ssl, &after_key);
+    if ((after_key.length > 0) && memcmp(after_key.value, before_key->value, after_key.length) != 0)
+    {   // master key が変化した。
+        KeyLogTrace_secret(ssl, CLIENT_RANDOM, CLIENT_RANDOM_LEN - 1);
+        SslClientRandom crandom = { 0 };
+        crandom.length = _SSL_get_client_random(ssl, crandom.value, SSL3_RANDOM_SIZE);
+        KeyLogFile_raw_dump(&crandom, &after_key);
+    }
+    else
+    {   // NOP
+        // セッションが再利用されたため、ログ出力不要。
+        // Wireshark は、重複してキーが出力されても問題なく解析可能であるが、
+        // 冗長なログとなるため、出力しない。
+    }
+}
+
+/**
+ * オリジナル関数を全てロードします。(openssl_symbols を参照)
+ * 必須の関数をロードできない場合、処理を中断 (abort) します。
+ */
+static
+void load_functions(void)
+{
+    for (size_t i = 0; i < sizeof(openssl_symbols) / sizeof(openssl_symbols[0]); i++)
+    {
+        const OpenSslSymbol *symbol = &openssl_symbols[i];
+        *symbol->func = load_function(symbol->name);
+        if (*symbol->func == NULL && symbol->required)
+        {
+            abort();
+        }
+    }
+}
+
+/**
+ * 指定されたシンボルのオリジナル関数を取得します。
+ * オリジナル関数は、open_libssl にて選択した libssl (RTLD_NEXT を含む) から取得します。
+ * オリジナル関数を取得できない場合、NULL を返します。
+ *
+ * @param sym シンボル
+ * @return オリジナル関数
+ */
+static
+void *load_function(const char *sym)
+{
+    void *handle = open_libssl();
+    return (handle != NULL) ? dlsym(handle, sym) : NULL;
+}
+
+/**
+ * オリジナル関数を探す libssl を選択します。
+ * 初回のみ以下の順に探し、SSL_CTX_new が見つかったものを以降の全シンボルの取得に利用します。
+ * (シンボル毎に異なるライブラリから取得しないよう、選択は 1 回のみとする)
+ * アプリケーションの SSL オブジェクトを生成したものと異なる libssl を呼び出さないよう、
+ * ロード済みのものを優先し、SSLKEYLOG_LIBSSL はロード済みの libssl が見つからない場合のみ利用する。
+ *   1. RTLD_NEXT
+ *      本プログラム(libsslkeylog.so)は、LD_PRELOAD により最初にロードされるため、
+ *      次に見つかる同名のシンボルが、本来の OpenSSL によるシンボルとなる。
+ *   2. libssl_names のうち、ロード済みのもの
+ *      (アプリケーションが RTLD_LOCAL にて dlopen した場合は、RTLD_NEXT では見つからない)
+ *   3. 環境変数 SSLKEYLOG_LIBSSL (':' 区切りのライブラリ名、またはパス)
+ *   4. libssl_names の順に開いたもの
+ * (取得した関数を利用し続けるため、ハンドルは閉じない)
+ *
+ * @return libssl のハンドル (見つからない場合 NULL)
+ */
+static
+void *open_libssl(void)
+{
+    if (libssl_opened)
+    {
+        return libssl_handle;
+    }
+    libssl_opened = true;
+
+    if (dlsym(RTLD_NEXT, "SSL_CTX_new") != NULL)
+    {
+        libssl_handle = RTLD_NEXT;
+    }
+    for (size_t i = 0; i < sizeof(libssl_names) / sizeof(libssl_names[0]) && libssl_handle == NULL; i++)
+    {
+        libssl_handle = open_libssl_candidate(libssl_names[i], RTLD_LAZY | RTLD_NOLOAD);
+    }
+    const char *names = getenv("SSLKEYLOG_LIBSSL");
+    while (names != NULL && *names != '\0' && libssl_handle == NULL)
+    {
+        size_t len = strcspn(names, ":");
+        char name[PATH_MAX];
+        if (len > 0 && len < sizeof(name))
+        {
+            memcpy(name, names, len);
+            name[len] = '\0';
+            libssl_handle = open_libssl_candidate(name, RTLD_LAZY);
+        }
+        names += len + (names[len] == ':');
+    }
+    for (size_t i = 0; i < sizeof(libssl_names) / sizeof(libssl_names[0]) && libssl_handle == NULL; i++)
+    {
+        libssl_handle = open_libssl_candidate(libssl_names[i], RTLD_LAZY);
+    }
+    return libssl_handle;
+}
+
+/**
+ * libssl の候補を開きます。
+ * SSL_CTX_new を提供しないライブラリは、libssl ではないものとして閉じます。
+ *
+ * @param name ライブラリ名、またはパス
+ * @param mode dlopen のフラグ
+ * @return ハンドル (開けない、または libssl ではない場合 NULL)
+ */
+static
+void *open_libssl_candidate(const char *name, int mode)
+{
+    void *handle = dlopen(name, mode);
+    if (handle != NULL && dlsym(handle, "SSL_CTX_new") == NULL)
+    {
+        dlclose(handle);
+        handle = NULL;
+    }
+    return handle;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 16進数変換
+//
+// バイト列を小文字の 16 進数文字列に変換する。(NUL 終端は付与しない)
+// 256 エントリのテーブル参照を基本とし、SSSE3 / NEON が利用可能な場合は
+// 16 バイト単位でベクトル化した実装を利用する。
+//
+
+#define HEX_DIGIT(n) ((n) < 10 ? '0' + (n) : 'a' + (n) - 10)
+#define HEX_PAIR(n) { HEX_DIGIT((n) >> 4), HEX_DIGIT((n) & 0x0f) }
+#define HEX_ROW(h) \
+    HEX_PAIR((h) * 16 +  0), HEX_PAIR((h) * 16 +  1), HEX_PAIR((h) * 16 +  2), HEX_PAIR((h) * 16 +  3), \
+    HEX_PAIR((h) * 16 +  4), HEX_PAIR((h) * 16 +  5), HEX_PAIR((h) * 16 +  6), HEX_PAIR((h) * 16 +  7), \
+    HEX_PAIR((h) * 16 +  8), HEX_PAIR((h) * 16 +  9), HEX_PAIR((h) * 16 + 10), HEX_PAIR((h) * 16 + 11), \
+    HEX_PAIR((h) * 16 + 12), HEX_PAIR((h) * 16 + 13), HEX_PAIR((h) * 16 + 14), HEX_PAIR((h) * 16 + 15)
+
+static const char hex_table[256][2] =
+{
+    HEX_ROW(0),  HEX_ROW(1),  HEX_ROW(2),  HEX_ROW(3),
+    HEX_ROW(4),  HEX_ROW(5),  HEX_ROW(6),  HEX_ROW(7),
+    HEX_ROW(8),  HEX_ROW(9),  HEX_ROW(10), HEX_ROW(11),
+    HEX_ROW(12), HEX_ROW(13), HEX_ROW(14), HEX_ROW(15)
+};
+
+/**
+ * CPU に応じた 16 進数変換関数を選択します。
+ */
+static
+void hex_encode_init(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3"))
+    {
+        hex_encode = hex_encode_ssse3;
+    }
+#elif defined(__aarch64__)
+    // AArch64 では NEON は必須機能のため、常に利用可能。
+    hex_encode = hex_encode_neon;
+#endif
+}
+
+/**
+ * 指定されたバイト列を 16 進数文字列に変換します。(テーブル参照版)
+ *
+ * @param dst 出力先 (len * 2 バイト)
+ * @param src 変換するバイト列
+ * @param len 変換するバイト列の長さ
+ */
+static
+void hex_encode_table(char *dst, const unsigned char *src, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        memcpy(dst, hex_table[src[i]], 2);
+        dst += 2;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/**
+ * 指定されたバイト列を 16 進数文字列に変換します。(SSSE3 版)
+ * 16 バイト単位で上位/下位 4 ビットを分離し、pshufb にて文字に変換します。
+ *
+ * @param dst 出力先 (len * 2 バイト)
+ * @param src 変換するバイト列
+ * @param len 変換するバイト列の長さ
+ */
+__attribute__((target("ssse3")))
+static
+void hex_encode_ssse3(char *dst, const unsigned char *src, size_t len)
+{
+    const __m128i digits = _mm_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7',
+                                         '8', '9', 'a', 'b', 'c', 'd', 'e', 'f');
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    while (len >= 16)
+    {
+        __m128i value = _mm_loadu_si128((const __m128i *) src);
+        __m128i hi = _mm_shuffle_epi8(digits, _mm_and_si128(_mm_srli_epi16(value, 4), mask));
+        __m128i lo = _mm_shuffle_epi8(digits, _mm_and_si128(value, mask));
+        _mm_storeu_si128((__m128i *) dst, _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128((__m128i *) (dst + 16), _mm_unpackhi_epi8(hi, lo));
+        src += 16;
+        dst += 32;
+        len -= 16;
+    }
+    hex_encode_table(dst, src, len);
+}
+#elif defined(__aarch64__)
+/**
+ * 指定されたバイト列を 16 進数文字列に変換します。(NEON 版)
+ * 16 バイト単位で上位/下位 4 ビットを分離し、tbl にて文字に変換します。
+ *
+ * @param dst 出力先 (len * 2 バイト)
+ * @param src 変換するバイト列
+ * @param len 変換するバイト列の長さ
+ */
+static
+void hex_encode_neon(char *dst, const unsigned char *src, size_t len)
+{
+    static const uint8_t digits_table[16] = {
+        '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f'
+    };
+    const uint8x16_t digits = vld1q_u8(digits_table);
+    while (len >= 16)
+    {
+        uint8x16_t value = vld1q_u8(src);
+        uint8x16x2_t hex;
+        hex.val[0] = vqtbl1q_u8(digits, vshrq_n_u8(value, 4));
+        hex.val[1] = vqtbl1q_u8(digits, vandq_u8(value, vdupq_n_u8(0x0f)));
+        vst2q_u8((uint8_t *) dst, hex);
+        src += 16;
+        dst += 32;
+        len -= 16;
+    }
+    hex_encode_table(dst, src, len);
+}
+#endif
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// キーログファイル管理
+//
+
+static int KeyLogFile_fd = -1;
+static char *KeyLogFile_template = NULL;        // SSLKEYLOGFILE (ファイル名のテンプレート)
+static char KeyLogFile_name[PATH_MAX];          // 現在出力中のファイル名
+static bool KeyLogFile_binary = false;          // バイナリ形式で出力するか否か (SSLKEYLOG_FORMAT=binary)
+static atomic_bool KeyLogFile_enabled = false;  // キー情報を出力するか否か (制御ファイルにより変更される)
+static bool KeyLogFile_switchable = false;      // 出力先を変更できるか否か (ソケット出力、FIFO、mmap 出力モード以外)
+static mtx_t KeyLogFile_mutex;                  // 出力先の切り替え用 (ローテーション、制御ファイル)
+static bool KeyLogFile_debug_enabled = false;   // メッセージを標準エラー出力に出力するか否か (SSLKEYLOG_DEBUG)
+
+/**
+ * キーログファイル管理を初期化します。
+ *
+ * SSLKEYLOGFILE には、以下の変換指定を含めることができます。
+ *   %p: プロセスID
+ *   %t: ファイルを開いた日時 (YYYYmmdd-HHMMSS)
+ *   %n: ローテーションの通番 (0 から開始)
+ *   %s: シャード番号 (シャード出力モードのみ)
+ *   %%: '%' 文字
+ *
+ * SSLKEYLOGFILE に "unix:<パス>" または "udp://<ホスト>:<ポート>" が指定された場合、
+ * ソケット出力モードとなり、キー情報をデータグラムとして送信します。
+ * ソケット出力モードでは、ハンドシェイクを行うスレッドが送信でブロックしないよう、
+ * 常に非同期出力モードとなります。(mmap 出力、シャード出力、ローテーションは無効)
+ *
+ * 環境変数 SSLKEYLOG_MAX_BYTES, SSLKEYLOG_ROTATE_SECS が指定された場合、
+ * ファイルサイズまたは経過時間によりファイルをローテーションします。
+ * 環境変数 SSLKEYLOG_SIGHUP=1 が指定された場合、SIGHUP 受信時にファイルを開き直します。
+ * (ローテーションは mmap 出力モード、シャード出力モードでは無効となります)
+ *
+ * 環境変数 SSLKEYLOG_SHARDS に 2 以上が指定された場合、シャード出力モードとなります。
+ * シャード出力モードでは、スレッド毎に指定数のファイルのいずれかに振り分けて出力します。
+ * (mmap 出力モード、非同期出力モードでは無効となります)
+ *
+ * 環境変数 SSLKEYLOG_MMAP=1 が指定された場合、mmap 出力モードとなります。
+ * mmap 出力モードでは、ファイルを事前に確保してメモリにマッピングし、
+ * キー情報はマッピング領域へのコピーのみで出力します。(システムコール不要)
+ * プロセス終了時に、実際に使用したサイズにファイルを切り詰めます。
+ *
+ * 環境変数 SSLKEYLOG_ASYNC=1 が指定された場合、非同期出力モードとなります。
+ * 非同期出力モードでは、キー情報はリングバッファに格納され、
+ * バックグラウンドの書き込みスレッドがまとめてファイルに出力します。
+ *
+ * 非同期出力モードにおいて、環境変数 SSLKEYLOG_IO_URING=1 が指定され、カーネルが対応している場合、
+ * 書き込みスレッドは io_uring にてファイルに出力します。
+ *
+ * 環境変数 SSLKEYLOG_BATCH_BYTES が指定された場合、バッチ出力モードとなります。
+ * バッチ出力モードでは、キー情報はスレッド毎のバッファに蓄積され、
+ * 指定サイズを超えた時、SSLKEYLOG_FLUSH_MS 経過した時、スレッド終了時および
+ * プロセス終了時にまとめてファイルに出力します。
+ * (優先順位は、mmap 出力モード、非同期出力モード、バッチ出力モードの順となります)
+ *
+ * 環境変数 SSLKEYLOG_COMPRESS=zstd|lz4 が指定された場合、圧縮出力となります。
+ * 圧縮出力では常に非同期出力モードとなり、書き込みスレッドがまとめて書き込む毎に独立したフレームに圧縮します。
+ * (ソケット出力モード以外。mmap 出力、シャード出力、バッチ出力、ステージング、io_uring は無効)
+ *
+ * 環境変数 SSLKEYLOG_FORMAT=binary が指定された場合、固定長のバイナリ形式で出力します。
+ * (形式は sslkeylog-binary.h を参照。tools/sslkeylog-convert にてテキスト形式に変換できます)
+ *
+ * 環境変数 SSLKEYLOG_DEDUP が指定された場合、指定エントリ数の重複排除テーブルを作成し、
+ * 最近出力したものと同じキー情報 (ラベル + クライアントランダム) は出力しません。
+ *
+ * 統計情報は常に収集し、sslkeylog_get_stats にて取得できます。
+ * 環境変数 SSLKEYLOG_STATS にファイル名が指定された場合、プロセス終了時および SIGUSR1 受信時に
+ * 統計情報をファイルに出力し、キー情報 1 件の出力に要した時間も計測します。
+ *
+ * 環境変数 SSLKEYLOG_TRACE にファイル名が指定された場合、ハンドシェイク関数の呼び出し、
+ * キー情報の生成時刻を Chrome のトレース形式で出力します。
+ *
+ * 環境変数 SSLKEYLOG_SYNC にて、ファイルをディスクに同期 (fdatasync) する方法を指定します。
+ *   none    : 同期しない (デフォルト)
+ *   batch   : 書き込みスレッド (非同期出力モード)、フラッシュスレッド (バッチ出力モード) がまとめて出力する毎
+ *   <N>     : N [ms] 毎 (同期スレッドにて、書き込みがあった場合のみ)
+ * 同期はいずれもバックグラウンドのスレッドで行うため、ハンドシェイクを行うスレッドは同期を待ちません。
+ *
+ * SSLKEYLOGFILE が名前付きパイプ (FIFO) の場合、非ブロッキングで開き、常に非同期出力モードとなります。
+ * 読み手が遅い場合もハンドシェイクを行うスレッドはブロックせず、キー情報はリングバッファに溜まり、
+ * 溢れた分は破棄されます。(mmap 出力、シャード出力、バッチ出力、ローテーションは無効)
+ *
+ * 環境変数 SSLKEYLOG_STAGING_DIR にディレクトリ (/dev/shm などの tmpfs) が指定された場合、
+ * キー情報はそのディレクトリのステージングファイルに出力し、コピースレッドが SSLKEYLOG_STAGING_MS 毎に
+ * SSLKEYLOGFILE に追記します。(mmap 出力、シャード出力、ローテーションは無効)
+ *
+ * fork した子プロセスでは、停止した書き込みスレッド等を再開します。(KeyLogFork を参照)
+ * SSLKEYLOGFILE に %p が含まれる場合、環境変数 SSLKEYLOG_FORK_REOPEN=1 が指定された場合、
+ * mmap 出力モードの場合は、子プロセス毎のファイル (シャード) を開き直して出力します。
+ *
+ * 環境変数 SSLKEYLOG_CONTROL に制御ファイルが指定された場合、その内容により実行中に
+ * 出力の開始・停止、出力先の変更を行います。(KeyLogControl を参照)
+ * 制御ファイルが存在しない場合は、SSLKEYLOGFILE (指定された場合) に出力します。
+ */
+static
+void KeyLogFile_init(void)
+{
+    if (KeyLogFile_fd >= 0)
+    {   // すでに初期化済みのためなにもしない。
+        return;
+    }
+
+    // 出力先の切り替え (ローテーション、制御ファイルによる変更) の排他用
+    mtx_init(&KeyLogFile_mutex, mtx_plain);
+
+    // 標準エラー出力は、アプリケーションが通信などに利用している場合があるため、指定された場合のみ出力する。
+    KeyLogFile_debug_enabled = (KeyLogFile_getenv_size("SSLKEYLOG_DEBUG", 0) != 0);
+
+    // 統計情報 (書き込みスレッドなどの統計情報、および設定の誤りも収集するため、出力の開始前に開始する)
+    KeyLogStats_start(getenv("SSLKEYLOG_STATS"));
+
+    const char *sslkeylogfile_name = getenv("SSLKEYLOGFILE");
+    const char *control = getenv("SSLKEYLOG_CONTROL");
+    if (control != NULL && *control != '\0')
+    {   // 制御ファイルにより、実行中に出力の開始・停止、出力先の変更を行う。
+        KeyLogControl_start(control, sslkeylogfile_name);
+        atexit(KeyLogFile_finalize);
+    }
+    else if (sslkeylogfile_name != NULL && *sslkeylogfile_name != '\0')
+    {
+        KeyLogFile_open(sslkeylogfile_name);
+        if (KeyLogFile_fd >= 0)
+        {
+            atexit(KeyLogFile_finalize);
+        }
+    }
+}
+
+/**
+ * 指定された出力先を開き、環境変数で指定された各モードを開始します。(KeyLogFile_init を参照)
+ * キーログファイル管理の初期化時、または制御ファイルにより最初に出力を開始する際に一度だけ呼び出されます。
+ *
+ * @param sslkeylogfile_name 出力先 (SSLKEYLOGFILE と同じ形式)
+ */
+static
+void KeyLogFile_open(const char *sslkeylogfile_name)
+{
+    const char *format = getenv("SSLKEYLOG_FORMAT");
+    KeyLogFile_binary = (format != NULL && strcmp(format, "binary") == 0);
+
+    bool socket_mode = KeyLogSocket_is_address(sslkeylogfile_name);
+    const char *staging_dir = getenv("SSLKEYLOG_STAGING_DIR");
+    if (staging_dir != NULL && *staging_dir == '\0')
+    {
+        staging_dir = NULL;
+    }
+
+    // 圧縮出力は、書き込みスレッドがまとめて圧縮するため、ソケット出力モード以外の非同期出力モードのみ有効。
+    // (行単位で分割・コピーするステージング、mmap 出力、シャード出力は無効)
+    bool compress = (!socket_mode && KeyLogCompress_start(getenv("SSLKEYLOG_COMPRESS")));
+    if (compress)
+    {
+        staging_dir = NULL;
+    }
+
+    // シャード出力モードは、mmap 出力モード、非同期出力モード、ソケット出力モード、ステージング、
+    // 圧縮出力が指定されていない場合のみ有効。
+    size_t shards = 0;
+    if (!socket_mode && staging_dir == NULL && !compress
+            && KeyLogFile_getenv_size("SSLKEYLOG_MMAP", 0) == 0 && KeyLogFile_getenv_size("SSLKEYLOG_ASYNC", 0) == 0)
+    {
+        shards = KeyLogFile_getenv_size("SSLKEYLOG_SHARDS", 0);
+    }
+
+    KeyLogFile_template = KeyLogFile_make_template(sslkeylogfile_name, shards > 1);
+    if (KeyLogFile_template == NULL
+            || !KeyLogFile_expand_name(KeyLogFile_name, sizeof(KeyLogFile_name), KeyLogFile_template, 0, 0))
+    {
+        return;
+    }
+
+    // 名前付きパイプ (FIFO) は、読み手が遅い場合もブロックしないよう、
+    // 書き込みスレッドから非ブロッキングで書き込む。(ソケット出力モードと同様に扱う)
+    bool fifo_mode = (!socket_mode && shards <= 1 && KeyLogFile_is_fifo(KeyLogFile_name));
+    bool stream_mode = (socket_mode || fifo_mode);
+    bool staging = false;
+    if (socket_mode)
+    {   // ソケット出力モード
+        KeyLogFile_fd = KeyLogSocket_open(KeyLogFile_name);
+    }
+    else if (fifo_mode)
+    {   // 読み手がいない場合も開けるよう (O_WRONLY は ENXIO となる)、O_RDWR にて開く。
+        // (自身が読み手となるため、読み手の終了により SIGPIPE が発生することもない)
+        KeyLogFile_fd = open(KeyLogFile_name, O_RDWR | O_NONBLOCK);
+    }
+    else if (staging_dir != NULL && (KeyLogFile_fd = KeyLogStage_open(KeyLogFile_name, staging_dir)) >= 0)
+    {   // ステージング: ステージングファイルに出力し、コピースレッドが SSLKEYLOGFILE に追記する。
+        staging = true;
+    }
+    else
+    {   // カーネルレベルでアトミックに追記したいため、fopen の "a" ではなく、
+        // open の O_APPEND にてファイルを開く。
+        KeyLogFile_fd = open(KeyLogFile_name, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    }
+    if (KeyLogFile_fd < 0)
+    {
+        return;
+    }
+
+    // ハンドシェイクのトレース (init_keylog_hooks にて trace_* 関数を選択済みの場合のみ記録される)
+    KeyLogTrace_start(getenv("SSLKEYLOG_TRACE"));
+
+    bool rotatable = !stream_mode && !staging;
+    bool batch_writer = false;
+    bool async_mode = false;
+    bool mmap_mode = false;
+    bool buffered_mode = false;         // シャード出力モード、バッチ出力モード
+    if (!stream_mode && !staging && !compress && KeyLogFile_getenv_size("SSLKEYLOG_MMAP", 0) != 0
+            && KeyLogMmap_start(KeyLogFile_name, KeyLogFile_getenv_size("SSLKEYLOG_MMAP_CHUNK_BYTES", KEYLOG_MMAP_DEFAULT_CHUNK_SIZE)))
+    {   // mmap 出力モード
+        // マッピングできない場合は、他のモードとする。
+        rotatable = false;
+        mmap_mode = true;
+    }
+    else if ((stream_mode || compress || KeyLogFile_getenv_size("SSLKEYLOG_ASYNC", 0) != 0)
+            && KeyLogAsync_start(KeyLogFile_getenv_size("SSLKEYLOG_ASYNC_CAPACITY", KEYLOG_ASYNC_DEFAULT_CAPACITY)))
+    {   // 非同期出力モード
+        // 書き込みスレッドを開始できない場合は、同期出力とする。
+        // (ソケット出力モード、FIFO の場合、送信・書き込みできないキー情報は破棄される)
+        if (!stream_mode && !compress && KeyLogFile_getenv_size("SSLKEYLOG_IO_URING", 0) != 0)
+        {   // io_uring を利用できない場合は、write にて出力する。
+            KeyLogUring_start(KeyLogFile_fd);
+        }
+        batch_writer = true;
+        async_mode = true;
+    }
+    else if (stream_mode)
+    {   // ソケット出力モード、FIFO では、バッチ出力モードは無効。
+    }
+    else
+    {
+        if (shards > 1 && KeyLogShard_start(shards))
+        {   // シャード出力モード (同期出力、バッチ出力と併用可能)
+            // ローテーションは行わない。
+            rotatable = false;
+            buffered_mode = true;
+        }
+        if (KeyLogFile_getenv_size("SSLKEYLOG_BATCH_BYTES", 0) != 0)
+        {   // バッチ出力モード
+            // フラッシュスレッドを開始できない場合は、同期出力とする。
+            size_t flush_ms = KeyLogFile_getenv_size("SSLKEYLOG_FLUSH_MS", KEYLOG_BATCH_DEFAULT_FLUSH_MS);
+            bool batch_mode = KeyLogBatch_start(KeyLogFile_getenv_size("SSLKEYLOG_BATCH_BYTES", 0), flush_ms);
+            batch_writer = batch_mode && flush_ms > 0;
+            buffered_mode = buffered_mode || batch_mode;
+        }
+    }
+
+    if (compress && !async_mode)
+    {   // 書き込みスレッドを開始できないため、圧縮せずに出力する。
+        KeyLogCompress_stop();
+    }
+
+    // 同期ポリシー (ステージングの場合は、コピースレッドが SSLKEYLOGFILE を同期する)
+    const char *sync = getenv("SSLKEYLOG_SYNC");
+    if (staging)
+    {
+        size_t interval_ms = 0;
+        KeyLogStage_start(KeyLogFile_getenv_size("SSLKEYLOG_STAGING_MS", KEYLOG_STAGE_DEFAULT_MS),
+                KeyLogSync_parse(sync, &interval_ms) != KEYLOG_SYNC_NONE);
+    }
+    else if (!stream_mode)
+    {
+        KeyLogSync_start(sync, batch_writer);
+    }
+
+    size_t max_bytes = KeyLogFile_getenv_size("SSLKEYLOG_MAX_BYTES", 0);
+    size_t rotate_secs = KeyLogFile_getenv_size("SSLKEYLOG_ROTATE_SECS", 0);
+    bool sighup = (KeyLogFile_getenv_size("SSLKEYLOG_SIGHUP", 0) != 0);
+    if (rotatable && (max_bytes != 0 || rotate_secs != 0 || sighup))
+    {   // ローテーション
+        KeyLogRotate_start(max_bytes, rotate_secs, sighup);
+    }
+    size_t dedup_entries = KeyLogFile_getenv_size("SSLKEYLOG_DEDUP", 0);
+    if (dedup_entries != 0)
+    {   // 重複排除
+        // テーブルを確保できない場合は、重複排除しない。
+        KeyLogDedup_start(dedup_entries);
+    }
+
+    // fork 対応: 子プロセスでは、書き込みスレッドを再開し、必要に応じて出力先を開き直す。
+    // (mmap 出力モードは、マッピングを親プロセスと共有できないため、常に開き直す)
+    KeyLogFork_start(!stream_mode && (mmap_mode || strstr(KeyLogFile_template, "%p") != NULL
+            || KeyLogFile_getenv_size("SSLKEYLOG_FORK_REOPEN", 0) != 0));
+
+    // 出力を開始する。(以降、KeyLogFile_enabled の参照のみで出力可否を判定する)
+    KeyLogFile_switchable = !stream_mode && !mmap_mode;
+    atomic_store_explicit(&KeyLogFile_enabled, true, memory_order_release);
+}
+
+/**
+ * 出力先からファイル名のテンプレートを作成します。
+ * シャード出力モードの場合、ファイル名にシャード番号 (%s) を含めます。
+ * (%s が含まれない場合は、末尾に ".%s" を付与する)
+ *
+ * @param name 出力先 (SSLKEYLOGFILE と同じ形式)
+ * @param shard シャード出力モードか否か
+ * @return テンプレート (malloc にて確保。確保できない場合 NULL)
+ */
+static
+char *KeyLogFile_make_template(const char *name, bool shard)
+{
+    size_t template_size = strlen(name) + sizeof(".%s");
+    char *template = (char *) malloc(template_size);
+    if (template != NULL)
+    {
+        bool add_shard = (shard && strstr(name, "%s") == NULL);
+        snprintf(template, template_size, add_shard ? "%s.%%s" : "%s", name);
+    }
+    return template;
+}
+
+/**
+ * キーログファイル管理を終了します。
+ * 非同期出力モード、バッチ出力モードの場合、
+ * バッファに残っているキー情報を全て出力してから終了します。
+ * mmap 出力モードの場合、ファイルを使用済みサイズに切り詰めます。
+ *
+ * 以降のキー情報は出力しません。出力中の他スレッドは、停止した各モードの代わりに
+ * 出力先へ直接書き込むことがあるため、出力先は閉じません。(プロセス終了時に閉じられる)
+ * (閉じると、同じ番号で開かれた別のファイルに書き込まれるおそれがある)
+ */
+static
+void KeyLogFile_finalize(void)
+{
+    atomic_store(&KeyLogFile_enabled, false);
+    KeyLogControl_stop();
+    KeyLogRotate_stop();
+    KeyLogMmap_stop();
+    KeyLogAsync_stop();
+    KeyLogUring_stop();
+    KeyLogSocket_stop();
+    KeyLogBatch_stop();
+    KeyLogSync_stop();
+    KeyLogStage_stop();
+    KeyLogShard_stop();
+    KeyLogTrace_stop();
+    KeyLogStats_stop();
+}
+
+/**
+ * TLS キーが生成、受信された際に呼び出されるコールバック関数。
+ * 引数より渡されたキー情報を SSLKEYLOGFILE デバッグ出力に出力します。
+ * アプリケーションがコールバックを登録している場合、そのコールバックも呼び出します。
+ *
+ * @param ssl SSL オブジェクト
+ * @param line キー情報 (NSS が SSLKEYLOGFILE デバッグ出力に使用する形式のキーマテリアルを含む文字列)
+ */
+static
+void KeyLogFile_callback(const SSL *ssl, const char *line)
+{
+    // (インデックスを確保できた場合のみ、SSL_get_SSL_CTX が存在する)
+    if (app_keylog_callback_index >= 0)
+    {
+        _SSL_CTX_keylog_cb_func app_callback = get_app_keylog_callback(_SSL_get_SSL_CTX(ssl));
+        if (app_callback != NULL)
+        {
+            app_callback(ssl, line);
+        }
+    }
+
+    if (atomic_load_explicit(&KeyLogFile_enabled, memory_order_acquire))
+    {
+        KeyLogStats_add(KEYLOG_STATS_SECRETS, 1);
+        if (_SSL_is_quic != NULL && _SSL_is_quic((SSL *) ssl))
+        {   // QUIC 接続のキー情報も、TLS と同じ形式・同じ出力先に出力する。
+            KeyLogStats_add(KEYLOG_STATS_QUIC_SECRETS, 1);
+        }
+        const char *label_end = strchr(line, ' ');
+        size_t label_len = (label_end != NULL) ? (size_t) (label_end - line) : strlen(line);
+        KeyLogTrace_secret(ssl, line, label_len);
+        if (!KeyLogFilter_accept(ssl, line, label_len))
+        {   // 出力対象外
+            KeyLogStats_add(KEYLOG_STATS_FILTERED, 1);
+            return;
+        }
+
+        // ラベルとクライアントランダム (2 つ目の空白まで) により重複を判定する。
+        size_t len = strlen(line);
+        const char *random_end = (label_end != NULL) ? strchr(label_end + 1, ' ') : NULL;
+        size_t key_len = (random_end != NULL) ? (size_t) (random_end - line) : len;
+        if (KeyLogDedup_seen(line, key_len))
+        {   // 出力済みのキー情報
+            KeyLogStats_add(KEYLOG_STATS_DEDUP_HITS, 1);
+            return;
+        }
+
+        KeyLogLine out;
+        if (KeyLogFile_binary)
+        {   // バイナリ形式: 16進数文字列をバイト列に戻してレコードを作成する。
+            // (レコードで表現できないラベル、長さのキー情報は、テキストのままレコードに格納する)
+            if (!KeyLogFile_reserve(&out))
+            {
+                return;
+            }
+            size_t text_size = KEYLOG_BINARY_TEXT_RECORDS(len) * KEYLOG_BINARY_RECORD_SIZE;
+            if (KeyLogBinary_from_line((unsigned char *) out.data, line, len))
+            {
+                KeyLogFile_commit(&out, KEYLOG_BINARY_RECORD_SIZE);
+            }
+            else if (text_size <= KEYLOG_LINE_MAX)
+            {
+                KeyLogFile_commit(&out, KeyLogBinary_build_text((unsigned char *) out.data, line, len));
+            }
+            else
+            {   // 出力先に収まらないレコード数: 作成したレコードを KEYLOG_LINE_MAX を超える行と同様に出力する。
+                KeyLogFile_commit(&out, 0);
+                unsigned char *records = (len <= KEYLOG_BINARY_TEXT_MAX) ? (unsigned char *) malloc(text_size) : NULL;
+                if (records == NULL)
+                {   // 最大長を超える行、またはメモリ不足
+                    KeyLogStats_add(KEYLOG_STATS_DROPS, 1);
+                    return;
+                }
+                KeyLogFile_write_long((const char *) records, KeyLogBinary_build_text(records, line, len), false);
+                free(records);
+            }
+        }
+        else if ((len + 1) <= KEYLOG_LINE_MAX)
+        {   // 1 行を 1 回の write で追記するため、改行を付与した行を出力先に組み立てる。
+            if (KeyLogFile_reserve(&out))
+            {
+                memcpy(out.data, line, len);
+                out.data[len] = '\n';
+                KeyLogFile_commit(&out, len + 1);
+            }
+        }
+        else
+        {   // 出力先に収まらない長さの行 (ECH など、フォーク版 OpenSSL のラベル)
+            KeyLogFile_write_long(line, len, true);
+        }
+    }
+}
+
+/**
+ * 指定されたクライアントランダムとマスタキーを SSLKEYLOGFILE デバッグ出力に出力します。
+ *
+ * @param client_random クライアントランダム
+ * @param master_key マスターキー
+ */
+static
+void KeyLogFile_raw_dump(const SslClientRandom *client_random, const SslMasterKey *master_key)
+{
+    if (!atomic_load_explicit(&KeyLogFile_enabled, memory_order_acquire))
+    {   // 出力停止中
+        return;
+    }
+    if (client_random->length == 0 || master_key->length == 0)
+    {   // クライアントランダム、マスターキーのいずれかが無効な場合はログ出力しない。
+        return;
+    }
+    KeyLogStats_add(KEYLOG_STATS_SECRETS, 1);
+    if (KeyLogDedup_seen(client_random->value, client_random->length))
+    {   // 出力済みのキー情報 (ラベルは CLIENT_RANDOM 固定のため、クライアントランダムのみで判定する)
+        KeyLogStats_add(KEYLOG_STATS_DEDUP_HITS, 1);
+        return;
+    }
+
+    KeyLogLine out;
+    if (!KeyLogFile_reserve(&out))
+    {
+        return;
+    }
+    if (KeyLogFile_binary)
+    {   // バイナリ形式: 16進数変換は不要。
+        KeyLogBinary_build((unsigned char *) out.data, KEYLOG_BINARY_LABEL_CLIENT_RANDOM,
+                client_random->value, client_random->length, master_key->value, master_key->length);
+        KeyLogFile_commit(&out, KEYLOG_BINARY_RECORD_SIZE);
+    }
+    else
+    {   // 出力先に直接組み立てる。(CLIENT_RANDOM_LINE_LENGTH <= KEYLOG_LINE_MAX)
+        char *p = out.data;
+        memcpy(p, CLIENT_RANDOM, CLIENT_RANDOM_LEN);
+        p += CLIENT_RANDOM_LEN;
+
+        // クライアントランダムを出力する。
+        hex_encode(p, client_random->value, client_random->length);
+        p += client_random->length * 2;
+
+        *p++ = ' ';
 
         // マスターキーを出力する。
-        for (size_t i = 0; i < master_key->length; i++)
+        hex_encode(p, master_key->value, master_key->length);
+        p += master_key->length * 2;
+
+        *p++ = '\n';
+
+        KeyLogFile_commit(&out, (size_t) (p - out.data));
+    }
+}
+
+/**
+ * キー情報 1 件の出力先を確保します。
+ * 非同期出力モードの場合はリングバッファのスロットを、バッチ出力モードの場合は
+ * スレッド毎のバッファを確保し、それ以外はスタック上のバッファ (out->stack) を出力先とします。
+ * シャード出力モードの場合、出力先は呼び出し元スレッドのシャードとなり、タイムスタンプを付与済みとします。
+ * 確保に成功した場合、必ず KeyLogFile_commit を呼び出す必要があります。
+ *
+ * @param out 出力先 (out->data に、KEYLOG_LINE_MAX バイト以下のキー情報を組み立てる)
+ * @return true: 確保成功 / false: キーログファイル未オープン、またはリングバッファ満杯 (破棄)
+ */
+static
+bool KeyLogFile_reserve(KeyLogLine *out)
+{
+    if (KeyLogFile_fd < 0)
+    {
+        return false;
+    }
+    out->start = KeyLogStats_timer_start();
+    out->prefix = 0;
+    out->fd = KeyLogFile_fd;
+    out->slot = NULL;
+    out->buffer = NULL;
+    if (KeyLogAsync_reserve(out))
+    {   // 非同期出力モード: スロットを確保できない場合は、破棄数をカウント済み。
+        return (out->slot != NULL);
+    }
+    if (KeyLogCompress_is_enabled())
+    {   // 圧縮出力 (書き込みスレッドの終了後): 圧縮していない行を混在させないよう破棄する。
+        KeyLogStats_add(KEYLOG_STATS_DROPS, 1);
+        return false;
+    }
+
+    // mmap 出力モード、ソケット出力モードの場合、シャード出力・バッチ出力は無効のため、
+    // スタック上のバッファが出力先となる。
+    out->fd = KeyLogShard_get_fd();
+    char *dest = KeyLogBatch_reserve(out);
+    if (dest == NULL)
+    {
+        dest = out->stack;
+    }
+    out->prefix = KeyLogShard_stamp(dest);
+    out->data = dest + out->prefix;
+    return true;
+}
+
+/**
+ * KeyLogFile_reserve にて確保した出力先に組み立てたキー情報を出力します。
+ * 非同期出力モードの場合はスロットを書き込みスレッドに公開し、
+ * バッチ出力モードの場合はスレッド毎のバッファに蓄積します。
+ * mmap 出力モードの場合はマッピング領域に、ソケット出力モード (書き込みスレッドを開始できなかった場合) の
+ * 場合は送信し、それ以外は 1 回の write で出力します。
+ * 出力したキー情報数と、出力に要した時間を統計情報に記録します。
+ *
+ * @param out 出力先
+ * @param len 組み立てたキー情報 (改行含む)、またはバイナリ形式のレコードの長さ (0: 出力しない)
+ */
+static
+void KeyLogFile_commit(KeyLogLine *out, size_t len)
+{
+    if (out->slot != NULL)
+    {   // 非同期出力モード: 書き込みスレッドにて出力される。(長さ 0 のスロットは読み飛ばされる)
+        KeyLogAsync_commit(out, len);
+    }
+    else if (out->buffer != NULL)
+    {   // バッチ出力モード: スレッド毎のバッファに蓄積される。
+        KeyLogBatch_commit(out, len);
+    }
+    else if (len > 0)
+    {
+        size_t total = out->prefix + len;
+        struct iovec iov = { .iov_base = out->stack, .iov_len = total };
+        if (!KeyLogMmap_writev(&iov, 1) && !KeyLogSocket_send(out->stack, total, false))
+        {   // mmap 出力モード、ソケット出力モード (送信できなければ破棄) 以外
+            KeyLogFile_write_all(out->fd, out->stack, total);
+        }
+    }
+
+    if (len > 0)
+    {
+        KeyLogStats_add(KEYLOG_STATS_LINES, 1);
+        KeyLogStats_timer_stop(out->start);
+    }
+}
+
+/**
+ * KEYLOG_LINE_MAX に収まらない行 (またはバイナリ形式のレコード) を、各出力モードの書き込み順、形式を保ったまま出力します。
+ * 行のみメモリを確保するため、KEYLOG_LINE_MAX に収まる行の出力には影響しません。
+ *   - 非同期出力モード (圧縮出力、ソケット出力含む): 改行を付与した行の複製をスロットから参照し、書き込みスレッドが出力する。
+ *   - バッチ出力モード: スレッド毎のバッファに蓄積済みの行を出力してから、タイムスタンプとあわせて 1 回で出力する。
+ *   - 上記以外: タイムスタンプ、行、改行を連続した領域に組み立て、KeyLogFile_commit と同様に出力する。
+ * メモリを確保できない場合は、破棄数をカウントします。
+ *
+ * @param data キー情報 (改行を含まない)、またはバイナリ形式のレコード
+ * @param len キー情報の長さ
+ * @param newline 改行を付与するか否か (バイナリ形式の場合 false)
+ */
+static
+void KeyLogFile_write_long(const char *data, size_t len, bool newline)
+{
+    KeyLogLine out;
+    if (!KeyLogFile_reserve(&out))
+    {
+        return;
+    }
+
+    size_t suffix = newline ? 1 : 0;
+    if (out.slot != NULL)
+    {   // 非同期出力モード
+        char *copy = (char *) malloc(len + suffix);
+        if (copy == NULL)
+        {
+            KeyLogStats_add(KEYLOG_STATS_DROPS, 1);
+            KeyLogFile_commit(&out, 0);
+            return;
+        }
+        memcpy(copy, data, len);
+        memcpy(copy + len, "\n", suffix);
+        out.slot->heap = copy;
+        KeyLogFile_commit(&out, len + suffix);
+        return;
+    }
+
+    struct iovec iov[3] = {
+        { .iov_base = out.data - out.prefix, .iov_len = out.prefix },
+        { .iov_base = (void *) data, .iov_len = len },
+        { .iov_base = (void *) "\n", .iov_len = suffix }
+    };
+    if (out.buffer != NULL)
+    {   // バッチ出力モード: 蓄積済みの行を先に出力する。(タイムスタンプは組み立て先に残っている)
+        KeyLogBatch_flush(out.buffer);
+        KeyLogFile_writev_all(out.fd, iov, 3);
+        KeyLogBatch_commit(&out, 0);
+    }
+    else if (!KeyLogMmap_writev(iov, 3))
+    {   // ソケット出力モードでは 1 つのデータグラムとして送信するため、連続した領域に組み立てる。
+        size_t total = out.prefix + len + suffix;
+        char *copy = (char *) malloc(total);
+        if (copy == NULL)
+        {
+            KeyLogStats_add(KEYLOG_STATS_DROPS, 1);
+            return;
+        }
+        memcpy(copy, out.data - out.prefix, out.prefix);
+        memcpy(copy + out.prefix, data, len);
+        memcpy(copy + out.prefix + len, "\n", suffix);
+        if (!KeyLogSocket_send(copy, total, false))
+        {
+            KeyLogFile_write_all(out.fd, copy, total);
+        }
+        free(copy);
+    }
+    KeyLogStats_add(KEYLOG_STATS_LINES, 1);
+    KeyLogStats_timer_stop(out.start);
+}
+
+/**
+ * 指定されたバッファの内容を全てファイルに書き込みます。
+ * シグナルによる中断 (EINTR) および部分書き込みの場合は、残りを書き込みます。
+ * 書き込んだバイト数、部分書き込み・書き込みエラーの回数を統計情報に記録します。
+ *
+ * @param fd ファイルディスクリプタ
+ * @param buf 書き込むデータ
+ * @param len 書き込むデータのサイズ
+ * @return true: 全て書き込めた / false: 書き込みエラー
+ */
+static
+bool KeyLogFile_write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t written = write(fd, buf, len);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {   // シグナルにより中断されたため、再試行する。
+                continue;
+            }
+            if (errno == EAGAIN && KeyLogAsync_wait_writable(fd))
+            {   // FIFO の空き待ち (書き込みスレッドのみ)
+                continue;
+            }
+            KeyLogStats_add(KEYLOG_STATS_WRITE_ERRORS, 1);
+            return false;
+        }
+        KeyLogStats_add(KEYLOG_STATS_BYTES, (uint64_t) written);
+        if ((size_t) written < len)
+        {
+            KeyLogStats_add(KEYLOG_STATS_SHORT_WRITES, 1);
+        }
+        buf += written;
+        len -= (size_t) written;
+    }
+    return true;
+}
+
+/**
+ * 指定された複数のバッファの内容を全てファイルに書き込みます。
+ * シグナルによる中断 (EINTR) および部分書き込みの場合は、残りを書き込みます。
+ *
+ * @param fd ファイルディスクリプタ
+ * @param iov 書き込むデータ (本関数内で内容が更新されます)
+ * @param iovcnt iov の要素数
+ * @return true: 全て書き込めた / false: 書き込みエラー
+ */
+static
+bool KeyLogFile_writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0)
+    {
+        ssize_t written = writev(fd, iov, iovcnt);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {   // シグナルにより中断されたため、再試行する。
+                continue;
+            }
+            if (errno == EAGAIN && KeyLogAsync_wait_writable(fd))
+            {   // FIFO の空き待ち (書き込みスレッドのみ)
+                continue;
+            }
+            KeyLogStats_add(KEYLOG_STATS_WRITE_ERRORS, 1);
+            return false;
+        }
+        KeyLogStats_add(KEYLOG_STATS_BYTES, (uint64_t) written);
+
+        // 書き込めた分を読み飛ばす。
+        while (iovcnt > 0 && (size_t) written >= iov->iov_len)
+        {
+            written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            KeyLogStats_add(KEYLOG_STATS_SHORT_WRITES, 1);
+            iov->iov_base = (char *) iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return true;
+}
+
+/**
+ * 指定されたファイルが名前付きパイプ (FIFO) か否かを判定します。
+ *
+ * @param name ファイル名
+ * @return true: FIFO / false: FIFO ではない (存在しない場合を含む)
+ */
+static
+bool KeyLogFile_is_fifo(const char *name)
+{
+    struct stat st;
+    return (stat(name, &st) == 0 && S_ISFIFO(st.st_mode));
+}
+
+/**
+ * 指定された環境変数の値を数値として取得します。
+ * 環境変数が未設定、または数値として解釈できない場合、default_value を返します。
+ *
+ * @param name 環境変数名
+ * @param default_value デフォルト値
+ * @return 環境変数の値
+ */
+static
+size_t KeyLogFile_getenv_size(const char *name, size_t default_value)
+{
+    const char *value = getenv(name);
+    if (value == NULL || *value == '\0')
+    {
+        return default_value;
+    }
+
+    char *endptr = NULL;
+    unsigned long long result = strtoull(value, &endptr, 10);
+    if (*endptr != '\0')
+    {   // 数値以外が含まれる
+        return default_value;
+    }
+    return (size_t) result;
+}
+
+/**
+ * SSLKEYLOG_DEBUG が指定されている場合のみ、メッセージを標準エラー出力に出力します。
+ *
+ * @param format 書式
+ */
+static
+void KeyLogFile_debug(const char *format, ...)
+{
+    if (!KeyLogFile_debug_enabled)
+    {
+        return;
+    }
+
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+/**
+ * 本ライブラリ内部用のスレッドを生成します。
+ * 対象アプリケーションのシグナルハンドラが内部スレッドで実行されないよう、
+ * 全シグナルをブロックした状態でスレッドを生成します。(シグナルマスクは継承される)
+ *
+ * @param thread 生成したスレッド
+ * @param func スレッド関数
+ * @return true: 生成成功 / false: 生成失敗
+ */
+static
+bool KeyLogFile_start_thread(thrd_t *thread, thrd_start_t func)
+{
+    sigset_t all_signals, old_signals;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_SETMASK, &all_signals, &old_signals);
+    int ret = thrd_create(thread, func, NULL);
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+    return (ret == thrd_success);
+}
+
+/**
+ * シグナルハンドラを設定します。
+ * 元のハンドラは、設定したハンドラから KeyLogFile_chain_signal にて呼び出すこと。
+ *
+ * @param sig シグナル番号
+ * @param handler シグナルハンドラ (SA_SIGINFO 形式)
+ * @param old_action 元のハンドラ
+ */
+static
+void KeyLogFile_set_signal(int sig, void (*handler)(int, siginfo_t *, void *), struct sigaction *old_action)
+{
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = handler;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(sig, &action, old_action);
+}
+
+/**
+ * KeyLogFile_set_signal にて設定したシグナルハンドラから、元のハンドラを呼び出します。
+ * (SIG_DFL/SIG_IGN の場合は、プロセスを終了させない)
+ *
+ * @param old_action 元のハンドラ
+ * @param sig シグナル番号
+ * @param info シグナル情報
+ * @param context コンテキスト
+ */
+static
+void KeyLogFile_chain_signal(const struct sigaction *old_action, int sig, siginfo_t *info, void *context)
+{
+    if (old_action->sa_flags & SA_SIGINFO)
+    {
+        old_action->sa_sigaction(sig, info, context);
+    }
+    else if (old_action->sa_handler != SIG_DFL && old_action->sa_handler != SIG_IGN)
+    {
+        old_action->sa_handler(sig);
+    }
+}
+
+/**
+ * 現在時刻から指定時間後の時刻を求めます。
+ * (cnd_timedwait, sem_timedwait のタイムアウト時刻 (CLOCK_REALTIME) として利用する)
+ *
+ * @param ts 求めた時刻
+ * @param ms 現在時刻からの時間 [ms]
+ */
+static
+void KeyLogFile_deadline(struct timespec *ts, size_t ms)
+{
+    timespec_get(ts, TIME_UTC);
+    ts->tv_sec += (time_t) (ms / 1000);
+    ts->tv_nsec += (long) (ms % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L)
+    {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+/**
+ * 現在時刻 (UNIX時刻[ns]) を取得します。
+ *
+ * @return 現在時刻
+ */
+static
+uint64_t KeyLogFile_realtime_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+/**
+ * ファイル名のテンプレートを展開します。
+ * %p (プロセスID), %t (現在日時), %n (通番), %s (シャード番号), %% ('%' 文字) を変換します。
+ * それ以外の '%' はそのまま出力します。
+ *
+ * @param out 出力先
+ * @param size 出力先のサイズ
+ * @param template テンプレート
+ * @param sequence 通番
+ * @param shard シャード番号
+ * @return true: 展開成功 / false: 出力先のサイズ不足
+ */
+static
+bool KeyLogFile_expand_name(char *out, size_t size, const char *template, unsigned long sequence, int shard)
+{
+    size_t pos = 0;
+    for (const char *p = template; *p != '\0'; p++)
+    {
+        char buf[32];
+        const char *value = buf;
+        if (*p == '%' && p[1] == 'p')
+        {
+            snprintf(buf, sizeof(buf), "%ld", (long) getpid());
+            p++;
+        }
+        else if (*p == '%' && p[1] == 't')
+        {
+            time_t now = time(NULL);
+            struct tm tm;
+            localtime_r(&now, &tm);
+            strftime(buf, sizeof(buf), "%Y%m%d-%H%M%S", &tm);
+            p++;
+        }
+        else if (*p == '%' && p[1] == 'n')
+        {
+            snprintf(buf, sizeof(buf), "%lu", sequence);
+            p++;
+        }
+        else if (*p == '%' && p[1] == 's')
+        {
+            snprintf(buf, sizeof(buf), "%d", shard);
+            p++;
+        }
+        else
+        {
+            buf[0] = *p;
+            buf[1] = '\0';
+            if (*p == '%' && p[1] == '%')
+            {
+                p++;
+            }
+        }
+
+        size_t len = strlen(value);
+        if ((pos + len) >= size)
+        {
+            return false;
+        }
+        memcpy(out + pos, value, len);
+        pos += len;
+    }
+    out[pos] = '\0';
+    return true;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// バイナリ形式
+//
+// キー情報を固定長のレコード (sslkeylog-binary.h) に変換する。
+// テキスト形式と比べて出力サイズが半分程度となり、OpenSSL 1.1.0 の場合は 16進数変換も不要となる。
+//
+
+/**
+ * NSS 形式のキー情報 1 行から、バイナリ形式のレコードを作成します。
+ *
+ * @param record レコードの作成先 (KEYLOG_BINARY_RECORD_SIZE バイト)
+ * @param line キー情報 ("<ラベル> <クライアントランダム> <シークレット>"、改行なし)
+ * @param len キー情報の長さ
+ * @return true: 作成成功 / false: 未知のラベル、または形式不正
+ */
+static
+bool KeyLogBinary_from_line(unsigned char *record, const char *line, size_t len)
+{
+    const char *end = line + len;
+    const char *random = memchr(line, ' ', len);
+    if (random == NULL)
+    {
+        return false;
+    }
+    size_t label_len = (size_t) (random - line);
+    random++;
+    const char *secret = memchr(random, ' ', (size_t) (end - random));
+    if (secret == NULL)
+    {
+        return false;
+    }
+    size_t random_len = (size_t) (secret - random);
+    secret++;
+    size_t secret_len = (size_t) (end - secret);
+
+    int label = 0;
+    for (size_t i = 1; i < KEYLOG_BINARY_LABEL_COUNT; i++)
+    {
+        if (strncmp(KeyLogBinary_labels[i], line, label_len) == 0 && KeyLogBinary_labels[i][label_len] == '\0')
+        {
+            label = (int) i;
+            break;
+        }
+    }
+    if (label == 0)
+    {
+        return false;
+    }
+
+    unsigned char random_bytes[KEYLOG_BINARY_RANDOM_MAX];
+    unsigned char secret_bytes[KEYLOG_BINARY_SECRET_MAX];
+    size_t random_size = KeyLogBinary_decode_hex(random_bytes, sizeof(random_bytes), random, random_len);
+    size_t secret_size = KeyLogBinary_decode_hex(secret_bytes, sizeof(secret_bytes), secret, secret_len);
+    if (random_size == 0 || secret_size == 0)
+    {
+        return false;
+    }
+    KeyLogBinary_build(record, label, random_bytes, random_size, secret_bytes, secret_size);
+    return true;
+}
+
+/**
+ * バイナリ形式のレコードを作成します。
+ * タイムスタンプには現在時刻を設定します。
+ *
+ * @param record レコードの作成先 (KEYLOG_BINARY_RECORD_SIZE バイト)
+ * @param label ラベル (KeyLogBinary_labels のインデックス)
+ * @param random クライアントランダム
+ * @param random_len クライアントランダムの長さ (KEYLOG_BINARY_RANDOM_MAX 以下)
+ * @param secret シークレット
+ * @param secret_len シークレットの長さ (KEYLOG_BINARY_SECRET_MAX 以下)
+ */
+static
+void KeyLogBinary_build(unsigned char *record, int label,
+        const unsigned char *random, size_t random_len, const unsigned char *secret, size_t secret_len)
+{
+    memset(record, 0, KEYLOG_BINARY_RECORD_SIZE);
+    memcpy(record + KEYLOG_BINARY_OFFSET_MAGIC, KEYLOG_BINARY_MAGIC, 2);
+    record[KEYLOG_BINARY_OFFSET_VERSION] = KEYLOG_BINARY_VERSION;
+    record[KEYLOG_BINARY_OFFSET_LABEL] = (unsigned char) label;
+    record[KEYLOG_BINARY_OFFSET_RANDOM_LENGTH] = (unsigned char) random_len;
+    record[KEYLOG_BINARY_OFFSET_SECRET_LENGTH] = (unsigned char) secret_len;
+
+    uint64_t timestamp = KeyLogFile_realtime_ns();
+    for (int i = 0; i < 8; i++)
+    {
+        record[KEYLOG_BINARY_OFFSET_TIMESTAMP + i] = (unsigned char) (timestamp >> (i * 8));
+    }
+
+    memcpy(record + KEYLOG_BINARY_OFFSET_RANDOM, random, random_len);
+    memcpy(record + KEYLOG_BINARY_OFFSET_SECRET, secret, secret_len);
+}
+
+/**
+ * レコードで表現できないキー情報を、テキストのまま格納したレコードを作成します。
+ * (KEYLOG_BINARY_TEXT_CHUNK バイト毎に 1 レコード。タイムスタンプには現在時刻を設定します)
+ *
+ * @param records レコードの作成先 (KEYLOG_BINARY_TEXT_RECORDS(len) レコード分)
+ * @param line キー情報 (改行なし)
+ * @param len キー情報の長さ (KEYLOG_BINARY_TEXT_MAX 以下)
+ * @return 作成したレコードの合計サイズ
+ */
+static
+size_t KeyLogBinary_build_text(unsigned char *records, const char *line, size_t len)
+{
+    size_t count = KEYLOG_BINARY_TEXT_RECORDS(len);
+    uint64_t timestamp = KeyLogFile_realtime_ns();
+    for (size_t i = 0; i < count; i++)
+    {
+        unsigned char *record = records + i * KEYLOG_BINARY_RECORD_SIZE;
+        memset(record, 0, KEYLOG_BINARY_RECORD_SIZE);
+        memcpy(record + KEYLOG_BINARY_OFFSET_MAGIC, KEYLOG_BINARY_MAGIC, 2);
+        record[KEYLOG_BINARY_OFFSET_VERSION] = KEYLOG_BINARY_VERSION;
+        record[KEYLOG_BINARY_OFFSET_LABEL] = (i == 0) ? KEYLOG_BINARY_LABEL_TEXT : KEYLOG_BINARY_LABEL_TEXT_CONTINUATION;
+        for (int j = 0; j < 8; j++)
+        {
+            record[KEYLOG_BINARY_OFFSET_TIMESTAMP + j] = (unsigned char) (timestamp >> (j * 8));
+        }
+        size_t chunk = (i + 1 < count) ? KEYLOG_BINARY_TEXT_CHUNK : len - i * KEYLOG_BINARY_TEXT_CHUNK;
+        memcpy(record + KEYLOG_BINARY_OFFSET_TEXT, line + i * KEYLOG_BINARY_TEXT_CHUNK, chunk);
+    }
+    records[KEYLOG_BINARY_OFFSET_TEXT_COUNT] = (unsigned char) count;
+    records[KEYLOG_BINARY_OFFSET_TEXT_LENGTH] = (unsigned char) len;
+    records[KEYLOG_BINARY_OFFSET_TEXT_LENGTH + 1] = (unsigned char) (len >> 8);
+    return count * KEYLOG_BINARY_RECORD_SIZE;
+}
+
+/**
+ * 16進数文字列をバイト列に変換します。(大文字小文字を区別しない)
+ *
+ * @param dst 出力先
+ * @param size 出力先のサイズ
+ * @param src 16進数文字列
+ * @param len 16進数文字列の長さ
+ * @return 変換したバイト数 (0: 形式不正、または出力先のサイズ不足)
+ */
+static
+size_t KeyLogBinary_decode_hex(unsigned char *dst, size_t size, const char *src, size_t len)
+{
+    if ((len % 2) != 0 || (len / 2) > size)
+    {
+        return 0;
+    }
+    for (size_t i = 0; i < len; i++)
+    {
+        char c = src[i];
+        int n;
+        if (c >= '0' && c <= '9')
+        {
+            n = c - '0';
+        }
+        else if (c >= 'a' && c <= 'f')
+        {
+            n = c - 'a' + 10;
+        }
+        else if (c >= 'A' && c <= 'F')
+        {
+            n = c - 'A' + 10;
+        }
+        else
+        {
+            return 0;
+        }
+        if ((i % 2) == 0)
+        {
+            dst[i / 2] = (unsigned char) (n << 4);
+        }
+        else
+        {
+            dst[i / 2] |= (unsigned char) n;
+        }
+    }
+    return len / 2;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// フィルタ (サンプリング・SNI・ラベルによる出力対象の絞り込み)
+//
+// 環境変数は init_keylog_hooks にて一度だけ解析し、ソート済み配列として保持する。
+// 出力対象外のキー情報は、16進数変換や出力処理の前に破棄される。
+//   SSLKEYLOG_SAMPLE: "N/M" の場合、M 接続あたり N 接続を出力する。("M" の場合は 1/M)
+//                     クライアントランダムにより判定するため、同じ接続のキー情報は全て出力/破棄される。
+//   SSLKEYLOG_SNI   : カンマ区切りのホスト名 (大文字小文字を区別しない)。
+//                     SNI (SSL_get_servername) が一致する接続のみ出力する。
+//   SSLKEYLOG_LABELS: カンマ区切りのラベル (例: CLIENT_TRAFFIC_SECRET_0)。一致するラベルのみ出力する。
+//
+
+static struct
+{
+    bool enabled;                       // いずれかのフィルタが有効か否か
+    uint64_t sample_numerator;          // サンプリング率の分子 (0: サンプリングなし)
+    uint64_t sample_denominator;        // サンプリング率の分母
+    char **hosts;                       // SNI の許可リスト (ソート済み)
+    size_t host_count;
+    char **labels;                      // ラベルの許可リスト (ソート済み)
+    size_t label_count;
+} KeyLogFilter;
+
+/** ラベル検索用のキー */
+typedef struct
+{
+    const char *label;
+    size_t length;
+} KeyLogFilterLabel;
+
+/**
+ * フィルタを初期化します。
+ * 解析できない (不正な値の) フィルタは無視します。
+ */
+static
+void KeyLogFilter_init(void)
+{
+    const char *sample = getenv("SSLKEYLOG_SAMPLE");
+    if (sample != NULL && *sample != '\0')
+    {
+        char *endptr = NULL;
+        unsigned long long numerator = 1;
+        unsigned long long denominator = strtoull(sample, &endptr, 10);
+        if (*endptr == '/')
+        {
+            numerator = denominator;
+            denominator = strtoull(endptr + 1, &endptr, 10);
+        }
+        if (*endptr == '\0' && denominator != 0 && numerator < denominator)
+        {   // (分子 >= 分母 の場合は全て出力するため、サンプリング不要)
+            KeyLogFilter.sample_numerator = numerator;
+            KeyLogFilter.sample_denominator = denominator;
+        }
+    }
+
+    if (_SSL_get_servername != NULL)
+    {
+        KeyLogFilter_parse_list(getenv("SSLKEYLOG_SNI"), &KeyLogFilter.hosts, &KeyLogFilter.host_count,
+                KeyLogFilter_compare_host);
+    }
+    KeyLogFilter_parse_list(getenv("SSLKEYLOG_LABELS"), &KeyLogFilter.labels, &KeyLogFilter.label_count,
+            KeyLogFilter_compare_label);
+
+    KeyLogFilter.enabled = (KeyLogFilter.sample_denominator != 0 || KeyLogFilter.hosts != NULL
+            || KeyLogFilter.labels != NULL);
+}
+
+/**
+ * 指定されたキー情報が出力対象か否かを判定します。
+ *
+ * @param ssl SSL オブジェクト
+ * @param label キー情報のラベル (NUL 終端不要)
+ * @param label_len ラベルの長さ
+ * @return true: 出力対象 / false: 出力対象外
+ */
+static
+bool KeyLogFilter_accept(const SSL *ssl, const char *label, size_t label_len)
+{
+    if (!KeyLogFilter.enabled)
+    {
+        return true;
+    }
+
+    if (KeyLogFilter.labels != NULL)
+    {
+        KeyLogFilterLabel key = { .label = label, .length = label_len };
+        if (bsearch(&key, KeyLogFilter.labels, KeyLogFilter.label_count, sizeof(char *), KeyLogFilter_find_label) == NULL)
+        {
+            return false;
+        }
+    }
+
+    if (KeyLogFilter.sample_denominator != 0)
+    {   // クライアントランダムの末尾 8 バイトにより判定する。
+        // (先頭 4 バイトは時刻の場合があるため利用しない)
+        unsigned char random[SSL3_RANDOM_SIZE] = { 0 };
+        _SSL_get_client_random(ssl, random, sizeof(random));
+        uint64_t value = 0;
+        memcpy(&value, random + SSL3_RANDOM_SIZE - sizeof(value), sizeof(value));
+        if ((value % KeyLogFilter.sample_denominator) >= KeyLogFilter.sample_numerator)
+        {
+            return false;
+        }
+    }
+
+    if (KeyLogFilter.hosts != NULL)
+    {
+        const char *host = _SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+        if (host == NULL
+                || bsearch(&host, KeyLogFilter.hosts, KeyLogFilter.host_count, sizeof(char *), KeyLogFilter_compare_host) == NULL)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * カンマ区切りのリストを解析し、ソート済みの配列を作成します。
+ * 空の要素は無視します。
+ *
+ * @param value カンマ区切りのリスト (NULL の場合、何もしない)
+ * @param items 作成した配列 (要素が無い場合 NULL)
+ * @param count 配列の要素数
+ * @param compare ソート用の比較関数
+ * @return true: 作成成功 / false: 要素なし、またはメモリ不足
+ */
+static
+bool KeyLogFilter_parse_list(const char *value, char ***items, size_t *count,
+        int (*compare)(const void *, const void *))
+{
+    *items = NULL;
+    *count = 0;
+    if (value == NULL || *value == '\0')
+    {
+        return false;
+    }
+
+    // 区切り文字を NUL に置き換えて、各要素を参照する。(文字列は解放しない)
+    char *buf = strdup(value);
+    size_t capacity = 1;
+    for (const char *p = value; *p != '\0'; p++)
+    {
+        capacity += (*p == ',');
+    }
+    char **array = (char **) calloc(capacity, sizeof(char *));
+    if (buf == NULL || array == NULL)
+    {
+        free(buf);
+        free(array);
+        return false;
+    }
+
+    size_t n = 0;
+    char *saveptr = NULL;
+    for (char *token = strtok_r(buf, ",", &saveptr); token != NULL; token = strtok_r(NULL, ",", &saveptr))
+    {
+        array[n++] = token;
+    }
+    if (n == 0)
+    {
+        free(buf);
+        free(array);
+        return false;
+    }
+
+    qsort(array, n, sizeof(char *), compare);
+    *items = array;
+    *count = n;
+    return true;
+}
+
+/**
+ * ホスト名を比較します。(大文字小文字を区別しない)
+ */
+static
+int KeyLogFilter_compare_host(const void *a, const void *b)
+{
+    return strcasecmp(*(const char * const *) a, *(const char * const *) b);
+}
+
+/**
+ * ラベルを比較します。
+ */
+static
+int KeyLogFilter_compare_label(const void *a, const void *b)
+{
+    return strcmp(*(const char * const *) a, *(const char * const *) b);
+}
+
+/**
+ * ラベル検索用のキーと、ラベルの許可リストの要素を比較します。
+ */
+static
+int KeyLogFilter_find_label(const void *key, const void *item)
+{
+    const KeyLogFilterLabel *label = (const KeyLogFilterLabel *) key;
+    const char *value = *(const char * const *) item;
+    int ret = strncmp(label->label, value, label->length);
+    if (ret == 0 && value[label->length] != '\0')
+    {   // キーが前方一致のみ: キーの方が短い。
+        ret = -1;
+    }
+    return ret;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// ローテーション
+//
+// ローテーションスレッドが、ファイルサイズ・経過時間・SIGHUP 受信を監視し、
+// 新しいファイルを開いて dup2 にて KeyLogFile_fd に差し替える。
+// dup2 によりファイルディスクリプタの番号は変わらずに参照先のファイルのみがアトミックに
+// 切り替わるため、キー情報を出力するスレッドはロックを取得することなく、
+// 切り替え前後のいずれかのファイルに 1 行単位で出力する。
+//
+// SSLKEYLOGFILE に %t または %n が含まれる場合は、展開した新しいファイル名で開く。
+// 含まれない場合は、現在のファイルを "<ファイル名>.<日時>.<通番>" にリネームしてから、
+// 同じファイル名で開き直す。
+// SIGHUP 受信時は (logrotate などで外部からリネームされたものとして) リネームせずに開き直す。
+//
+
+static struct
+{
+    size_t max_bytes;                   // ローテーションするファイルサイズ (0: 無効)
+    size_t rotate_secs;                 // ローテーションする経過時間 (0: 無効)
+    bool sighup;                        // SIGHUP で開き直すか否か
+    struct sigaction old_action;        // SIGHUP の元のハンドラ
+    unsigned long sequence;             // ローテーションの通番
+    time_t opened_at;                   // 現在のファイルを開いた時刻
+    sem_t wakeup;                       // ローテーションスレッド起床用 (シグナルハンドラから利用可能)
+    atomic_bool reopen;                 // SIGHUP 受信済みか否か
+    atomic_bool running;                // ローテーションスレッドが動作中か否か
+    thrd_t thread;                      // ローテーションスレッド
+} KeyLogRotate;
+
+/**
+ * ローテーションを開始します。
+ *
+ * @param max_bytes ローテーションするファイルサイズ [バイト] (0: 無効)
+ * @param rotate_secs ローテーションする経過時間 [秒] (0: 無効)
+ * @param sighup SIGHUP 受信時にファイルを開き直すか否か
+ * @return true: 開始成功 / false: 開始失敗
+ */
+static
+bool KeyLogRotate_start(size_t max_bytes, size_t rotate_secs, bool sighup)
+{
+    KeyLogRotate.max_bytes = max_bytes;
+    KeyLogRotate.rotate_secs = rotate_secs;
+    KeyLogRotate.sighup = sighup;
+    KeyLogRotate.sequence = 0;
+    KeyLogRotate.opened_at = time(NULL);
+    atomic_init(&KeyLogRotate.reopen, false);
+    if (sem_init(&KeyLogRotate.wakeup, 0, 0) != 0)
+    {
+        return false;
+    }
+
+    atomic_store(&KeyLogRotate.running, true);
+    if (!KeyLogFile_start_thread(&KeyLogRotate.thread, KeyLogRotate_thread))
+    {
+        atomic_store(&KeyLogRotate.running, false);
+        sem_destroy(&KeyLogRotate.wakeup);
+        return false;
+    }
+
+    if (sighup)
+    {   // 元のハンドラは KeyLogRotate_sighup から呼び出す。
+        KeyLogFile_set_signal(SIGHUP, KeyLogRotate_sighup, &KeyLogRotate.old_action);
+    }
+    return true;
+}
+
+/**
+ * ローテーションを停止します。
+ */
+static
+void KeyLogRotate_stop(void)
+{
+    if (!atomic_exchange(&KeyLogRotate.running, false))
+    {   // ローテーション無効
+        return;
+    }
+    sem_post(&KeyLogRotate.wakeup);
+    thrd_join(KeyLogRotate.thread, NULL);
+}
+
+/**
+ * 新しいファイルを開き、KeyLogFile_fd に差し替えます。
+ *
+ * @param rename_current
+ *	true: ファイル名が変わらない場合に、現在のファイルをリネームする (ローテーション)
+ *	false: リネームせずに開き直す (SIGHUP)
+ * @return true: 差し替え成功 / false: 差し替え失敗 (現在のファイルへの出力を継続)
+ */
+static
+bool KeyLogRotate_rotate(bool rename_current)
+{
+    mtx_lock(&KeyLogFile_mutex);
+    bool result = KeyLogRotate_reopen(rename_current);
+    mtx_unlock(&KeyLogFile_mutex);
+    return result;
+}
+
+/**
+ * 新しいファイルを開き、KeyLogFile_fd に差し替えます。(KeyLogFile_mutex を取得して呼び出すこと)
+ *
+ * @param rename_current KeyLogRotate_rotate を参照
+ * @return true: 差し替え成功 / false: 差し替え失敗 (現在のファイルへの出力を継続)
+ */
+static
+bool KeyLogRotate_reopen(bool rename_current)
+{
+    char name[PATH_MAX];
+    unsigned long sequence = KeyLogRotate.sequence + 1;
+    if (!KeyLogFile_expand_name(name, sizeof(name), KeyLogFile_template, sequence, 0))
+    {
+        return false;
+    }
+
+    if (rename_current && strcmp(name, KeyLogFile_name) == 0)
+    {   // ファイル名が変わらないため、現在のファイルをリネームする。
+        char rotated[PATH_MAX];
+        char suffix[64];
+        time_t now = time(NULL);
+        struct tm tm;
+        localtime_r(&now, &tm);
+        size_t len = strftime(suffix, sizeof(suffix), ".%Y%m%d-%H%M%S", &tm);
+        snprintf(suffix + len, sizeof(suffix) - len, ".%lu", KeyLogRotate.sequence);
+        if ((strlen(KeyLogFile_name) + strlen(suffix)) >= sizeof(rotated))
+        {
+            return false;
+        }
+        strcpy(rotated, KeyLogFile_name);
+        strcat(rotated, suffix);
+        if (rename(KeyLogFile_name, rotated) != 0)
+        {
+            return false;
+        }
+    }
+
+    int fd = open(name, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        return false;
+    }
+    // ファイルディスクリプタの番号を変えずに、参照先のファイルをアトミックに切り替える。
+    int ret = dup2(fd, KeyLogFile_fd);
+    close(fd);
+    if (ret < 0)
+    {
+        return false;
+    }
+
+    strcpy(KeyLogFile_name, name);
+    KeyLogRotate.sequence = sequence;
+    KeyLogRotate.opened_at = time(NULL);
+    return true;
+}
+
+/**
+ * SIGHUP のシグナルハンドラ。
+ * ローテーションスレッドにファイルの開き直しを要求し、元のハンドラを呼び出します。
+ * (sem_post は async-signal-safe であるため、シグナルハンドラ内で利用できる)
+ *
+ * @param sig シグナル番号
+ * @param info シグナル情報
+ * @param context コンテキスト
+ */
+static
+void KeyLogRotate_sighup(int sig, siginfo_t *info, void *context)
+{
+    int saved_errno = errno;
+    atomic_store(&KeyLogRotate.reopen, true);
+    sem_post(&KeyLogRotate.wakeup);
+    errno = saved_errno;
+    KeyLogFile_chain_signal(&KeyLogRotate.old_action, sig, info, context);
+}
+
+/**
+ * ローテーションスレッド。
+ * 一定間隔でファイルサイズと経過時間を確認し、必要に応じてローテーションします。
+ *
+ * @param arg 未使用
+ * @return 0 固定
+ */
+static
+int KeyLogRotate_thread(void *arg)
+{
+    (void) arg;
+    while (atomic_load(&KeyLogRotate.running))
+    {
+        struct timespec ts;
+        KeyLogFile_deadline(&ts, KEYLOG_ROTATE_CHECK_MS);
+        sem_timedwait(&KeyLogRotate.wakeup, &ts);
+        if (!atomic_load(&KeyLogRotate.running))
+        {
+            break;
+        }
+
+        if (atomic_exchange(&KeyLogRotate.reopen, false))
+        {   // SIGHUP 受信: 開き直す。
+            KeyLogRotate_rotate(false);
+            continue;
+        }
+
+        bool rotate = false;
+        if (KeyLogRotate.max_bytes != 0)
+        {
+            struct stat st;
+            rotate = (fstat(KeyLogFile_fd, &st) == 0 && (size_t) st.st_size >= KeyLogRotate.max_bytes);
+        }
+        if (KeyLogRotate.rotate_secs != 0)
+        {
+            rotate = rotate || ((size_t) (time(NULL) - KeyLogRotate.opened_at) >= KeyLogRotate.rotate_secs);
+        }
+        if (rotate)
+        {
+            KeyLogRotate_rotate(true);
+        }
+    }
+    return 0;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 非同期出力 (リングバッファ + 書き込みスレッド)
+//
+// キー情報を出力するスレッド (複数) から、書き込みスレッド (1つ) へ
+// ロックフリーの MPSC リングバッファを介してキー情報を受け渡す。
+// リングバッファが満杯の場合、キー情報は破棄され、破棄数をカウントする。
+// スロットの確保から公開までの間のスレッド数を数え、停止時は公開を待ってから書き込みスレッドを終了する。
+// 書き込みスレッドの終了後に公開されたスロットは、破棄数に含める。
+//
+
+static struct
+{
+    KeyLogAsyncSlot *slots;     // スロット配列
+    size_t mask;                // スロット数 - 1 (スロット数は 2 のべき乗)
+    char *batch;                // 書き込みスレッド用のまとめ書きバッファ
+    thrd_t thread;              // 書き込みスレッド
+    mtx_t mutex;                // 書き込みスレッド起床用
+    cnd_t cond;                 // 書き込みスレッド起床用
+    atomic_bool enabled;        // 非同期出力モードが有効か否か
+    atomic_bool running;        // 書き込みスレッドが動作中か否か
+    atomic_bool finished;       // 書き込みスレッドが終了したか否か (以降に公開されたスロットは出力されない)
+    atomic_ulong dropped;       // リングバッファ満杯、または終了時に未格納のため破棄したキー情報数
+    alignas(KEYLOG_CACHE_LINE_SIZE) atomic_size_t head;    // 次に書き込む位置 (生産者)
+    atomic_size_t producers;    // スロットの確保から公開までの間のスレッド数 (head と同時に更新されるため、同じキャッシュラインに置く)
+    alignas(KEYLOG_CACHE_LINE_SIZE) atomic_size_t tail;         // 次に読み出す位置 (書き込みスレッド)
+} KeyLogAsync;
+
+static thread_local bool KeyLogAsync_self_writer = false;  // 書き込みスレッドか否か
+
+/**
+ * 非同期出力を開始します。
+ *
+ * @param capacity リングバッファのスロット数 (2 のべき乗に切り上げられます)
+ * @return true: 開始成功 / false: 開始失敗
+ */
+static
+bool KeyLogAsync_start(size_t capacity)
+{
+    size_t count = 2;
+    while (count < capacity)
+    {
+        count <<= 1;
+    }
+
+    KeyLogAsync.slots = (KeyLogAsyncSlot *) calloc(count, sizeof(KeyLogAsyncSlot));
+    KeyLogAsync.batch = (char *) malloc(KEYLOG_ASYNC_BATCH_SIZE);
+    if (KeyLogAsync.slots == NULL || KeyLogAsync.batch == NULL)
+    {
+        goto error;
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        atomic_init(&KeyLogAsync.slots[i].sequence, i);
+    }
+    KeyLogAsync.mask = count - 1;
+    atomic_init(&KeyLogAsync.head, 0);
+    atomic_init(&KeyLogAsync.tail, 0);
+    atomic_init(&KeyLogAsync.dropped, 0);
+    atomic_init(&KeyLogAsync.producers, 0);
+    atomic_init(&KeyLogAsync.finished, false);
+
+    if (mtx_init(&KeyLogAsync.mutex, mtx_plain) != thrd_success)
+    {
+        goto error;
+    }
+    if (cnd_init(&KeyLogAsync.cond) != thrd_success)
+    {
+        mtx_destroy(&KeyLogAsync.mutex);
+        goto error;
+    }
+
+    atomic_store(&KeyLogAsync.running, true);
+    if (!KeyLogFile_start_thread(&KeyLogAsync.thread, KeyLogAsync_writer))
+    {
+        atomic_store(&KeyLogAsync.running, false);
+        cnd_destroy(&KeyLogAsync.cond);
+        mtx_destroy(&KeyLogAsync.mutex);
+        goto error;
+    }
+
+    atomic_store(&KeyLogAsync.enabled, true);
+    return true;
+
+error:
+    free(KeyLogAsync.slots);
+    free(KeyLogAsync.batch);
+    KeyLogAsync.slots = NULL;
+    KeyLogAsync.batch = NULL;
+    return false;
+}
+
+/**
+ * 非同期出力を停止します。
+ * スロットを確保したスレッドの公開を KEYLOG_ASYNC_STOP_WAIT_MS まで待ち、
+ * リングバッファに残っているキー情報を全て出力した後、書き込みスレッドを終了します。
+ * (確保のみで格納されていないスロットは、書き込みスレッドがさらに KEYLOG_ASYNC_STOP_WAIT_MS まで格納を待ち、
+ *  それ以降は破棄数に含めて読み飛ばす。書き込みスレッドの終了後に公開されたスロットも、破棄数に含める)
+ * 以降のキー情報は同期出力となります。
+ */
+static
+void KeyLogAsync_stop(void)
+{
+    if (!atomic_exchange(&KeyLogAsync.enabled, false))
+    {   // 非同期出力モードではない
+        return;
+    }
+
+    // 確保したスロットの公開を待つ。(enabled を false にした後は、新たに確保するスレッドはない)
+    size_t waited_ms = 0;
+    while (atomic_load(&KeyLogAsync.producers) != 0 && waited_ms < KEYLOG_ASYNC_STOP_WAIT_MS)
+    {
+        thrd_sleep(&(struct timespec) { .tv_nsec = 1000000L }, NULL);
+        waited_ms++;
+    }
+
+    mtx_lock(&KeyLogAsync.mutex);
+    atomic_store(&KeyLogAsync.running, false);
+    cnd_signal(&KeyLogAsync.cond);
+    mtx_unlock(&KeyLogAsync.mutex);
+    thrd_join(KeyLogAsync.thread, NULL);
+    atomic_store(&KeyLogAsync.finished, true);
+
+    unsigned long dropped = atomic_load(&KeyLogAsync.dropped);
+    if (dropped > 0)
+    {
+        KeyLogFile_debug("sslkeylog: %lu key log lines dropped (async buffer full or not committed)\n", dropped);
+    }
+}
+
+/**
+ * キー情報を組み立てるリングバッファのスロットを確保します。
+ * リングバッファが満杯の場合は、キー情報を破棄し、破棄数をカウントします。
+ * 確保したスレッドは KeyLogAsync_commit まで producers に数えられます。
+ * (enabled の確認前に加算するため (seq_cst)、KeyLogAsync_stop は確保したスレッドの公開を待てる)
+ *
+ * @param out 出力先 (確保したスロットを out->slot, out->data に設定。満杯の場合 out->slot は NULL)
+ * @return true: 非同期出力モードで処理した (確保 or 破棄) / false: 非同期出力モードではない
+ */
+static
+bool KeyLogAsync_reserve(KeyLogLine *out)
+{
+    atomic_fetch_add(&KeyLogAsync.producers, 1);
+    if (!atomic_load(&KeyLogAsync.enabled))
+    {
+        atomic_fetch_sub_explicit(&KeyLogAsync.producers, 1, memory_order_release);
+        return false;
+    }
+
+    // スロットを確保する。
+    KeyLogAsyncSlot *slot;
+    size_t pos = atomic_load_explicit(&KeyLogAsync.head, memory_order_relaxed);
+    for (;;)
+    {
+        slot = &KeyLogAsync.slots[pos & KeyLogAsync.mask];
+        size_t seq = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+        if (diff == 0)
+        {   // 空きスロット: 確保を試みる。(失敗時は pos が更新される)
+            if (atomic_compare_exchange_weak_explicit(&KeyLogAsync.head, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {   // リングバッファ満杯: 破棄する。
+            atomic_fetch_add_explicit(&KeyLogAsync.dropped, 1, memory_order_relaxed);
+            atomic_fetch_sub_explicit(&KeyLogAsync.producers, 1, memory_order_release);
+            return true;
+        }
+        else
+        {   // 他スレッドが確保済み
+            pos = atomic_load_explicit(&KeyLogAsync.head, memory_order_relaxed);
+        }
+    }
+
+    out->slot = slot;
+    out->position = pos;
+    out->data = slot->data;
+    return true;
+}
+
+/**
+ * KeyLogAsync_reserve にて確保したスロットを、書き込みスレッドに公開します。
+ * (確保したスロットは、長さ 0 の場合も必ず公開する。公開しないと書き込みスレッドが先に進めない)
+ *
+ * @param out 出力先
+ * @param len スロットに組み立てたキー情報の長さ (0: 出力しない)
+ */
+static
+void KeyLogAsync_commit(KeyLogLine *out, size_t len)
+{
+    size_t pos = out->position;
+    out->slot->length = len;
+    atomic_store_explicit(&out->slot->sequence, pos + 1, memory_order_release);
+    if (atomic_load(&KeyLogAsync.finished) && len > 0
+            && (pos - atomic_load_explicit(&KeyLogAsync.tail, memory_order_relaxed)) < (SIZE_MAX / 2))
+    {   // 停止時に公開が間に合わず、書き込みスレッドが終了した: 出力されないため、破棄数に含める。
+        // (終了後の tail は変化しないため、tail 以降の位置は出力されていない)
+        atomic_fetch_add_explicit(&KeyLogAsync.dropped, 1, memory_order_relaxed);
+        free(out->slot->heap);
+        out->slot->heap = NULL;
+    }
+    atomic_fetch_sub_explicit(&KeyLogAsync.producers, 1, memory_order_release);
+
+    if ((pos - atomic_load_explicit(&KeyLogAsync.tail, memory_order_relaxed)) == ((KeyLogAsync.mask + 1) / 2))
+    {   // リングバッファが半分埋まったため、書き込みスレッドを起こす。
+        // (tail は書き込みスレッドが更新するため厳密な値ではないが、起床の目安として十分)
+        mtx_lock(&KeyLogAsync.mutex);
+        cnd_signal(&KeyLogAsync.cond);
+        mtx_unlock(&KeyLogAsync.mutex);
+    }
+}
+
+/**
+ * fork 後の子プロセスにて呼び出され、書き込みスレッドを再開します。
+ * リングバッファに残っているキー情報は親プロセスの書き込みスレッドが出力するため、破棄します。
+ * (予約のみで格納されていないスロットも、子プロセスでは格納されることがないため破棄する)
+ */
+static
+void KeyLogAsync_fork_child(void)
+{
+    if (!atomic_load(&KeyLogAsync.enabled))
+    {
+        return;
+    }
+
+    size_t head = atomic_load(&KeyLogAsync.head);
+    for (size_t pos = atomic_load(&KeyLogAsync.tail); pos != head; pos++)
+    {
+        KeyLogAsyncSlot *slot = &KeyLogAsync.slots[pos & KeyLogAsync.mask];
+        if (atomic_load(&slot->sequence) == (pos + 1))
+        {   // 公開済みのスロットの行の複製は、子プロセスでは出力されないため解放する。
+            free(slot->heap);
+            slot->heap = NULL;
+        }
+        atomic_store(&slot->sequence, pos + KeyLogAsync.mask + 1);
+    }
+    atomic_store(&KeyLogAsync.tail, head);
+    atomic_store(&KeyLogAsync.dropped, 0);
+    atomic_store(&KeyLogAsync.producers, 0);
+    KeyLogUring_fork_child();
+
+    if (atomic_load(&KeyLogAsync.running)
+            && !KeyLogFork_start_thread(&KeyLogAsync.thread, KeyLogAsync_writer, &KeyLogAsync.cond))
+    {   // 書き込みスレッドを開始できない場合は、同期出力とする。
+        atomic_store(&KeyLogAsync.running, false);
+        atomic_store(&KeyLogAsync.enabled, false);
+    }
+}
+
+/**
+ * 書き込みできるようになるまで待ちます。(非ブロッキングの FIFO への書き込み用)
+ * 書き込みスレッドのみ待ち、停止要求後は一定時間 (KEYLOG_ASYNC_INTERVAL_MS) のみ待ちます。
+ * それ以外のスレッド (書き込みスレッドを開始できなかった場合) は待たずに、キー情報を破棄させます。
+ *
+ * @param fd ファイルディスクリプタ
+ * @return true: 書き込み可能 / false: 待たない (書き込みエラーとする)
+ */
+static
+bool KeyLogAsync_wait_writable(int fd)
+{
+    if (!KeyLogAsync_self_writer)
+    {
+        return false;
+    }
+    struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+    for (;;)
+    {
+        bool running = atomic_load(&KeyLogAsync.running);
+        int ret = poll(&pfd, 1, KEYLOG_ASYNC_INTERVAL_MS);
+        if (ret > 0)
+        {
+            return true;
+        }
+        if ((ret < 0 && errno != EINTR) || !running)
+        {
+            return false;
+        }
+    }
+}
+
+/**
+ * 書き込みスレッド。
+ * リングバッファからキー情報を取り出し、まとめてファイルに出力します。
+ * 停止要求後は、リングバッファが空になるまで出力してから終了します。
+ * 確保のみで格納されていないスロットがある場合は、その後ろの格納済みのキー情報を失わないよう、
+ * KEYLOG_ASYNC_STOP_WAIT_MS まで格納を待ち、それ以降は未格納のスロットを破棄して読み飛ばします。
+ *
+ * @param arg 未使用
+ * @return 0 固定
+ */
+static
+int KeyLogAsync_writer(void *arg)
+{
+    (void) arg;
+    KeyLogAsync_self_writer = true;
+    bool unsynced = false;              // io_uring にて書き込み、同期していないデータの有無
+    size_t stop_waited_ms = 0;          // 停止要求後、未格納のスロットの格納を待った時間 [ms]
+    for (;;)
+    {
+        bool running = atomic_load(&KeyLogAsync.running);
+
+        // リングバッファから取り出せるだけ取り出し、まとめ書きバッファに詰める。
+        // (io_uring 利用時は、io_uring のバッファに直接詰める)
+        char *batch = KeyLogUring_get_buffer();
+        if (batch == NULL)
+        {
+            batch = KeyLogAsync.batch;
+        }
+        size_t batch_len = 0;
+        size_t tail = atomic_load_explicit(&KeyLogAsync.tail, memory_order_relaxed);
+        for (;;)
+        {
+            KeyLogAsyncSlot *slot = &KeyLogAsync.slots[tail & KeyLogAsync.mask];
+            size_t seq = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+            if (seq != (tail + 1) || (batch_len + slot->length) > KEYLOG_ASYNC_BATCH_SIZE)
+            {   // 空、またはまとめ書きバッファが満杯
+                break;
+            }
+            if (slot->heap != NULL)
+            {   // KEYLOG_LINE_MAX に収まらない行 (KeyLogFile_write_long)
+                memcpy(batch + batch_len, slot->heap, slot->length);
+                free(slot->heap);
+                slot->heap = NULL;
+            }
+            else
+            {
+                memcpy(batch + batch_len, slot->data, slot->length);
+            }
+            batch_len += slot->length;
+            atomic_store_explicit(&slot->sequence, tail + KeyLogAsync.mask + 1, memory_order_release);
+            tail++;
+        }
+        atomic_store_explicit(&KeyLogAsync.tail, tail, memory_order_relaxed);
+
+        if (batch_len > 0)
+        {
+            unsynced = KeyLogAsync_output(batch, batch_len) || unsynced;
+            continue;
+        }
+        if (KeyLogAsync_write_long(tail, &unsynced))
+        {   // まとめ書きバッファに収まらない行を出力した。
+            continue;
+        }
+
+        // リングバッファが空: io_uring のバッファに溜まっている分を書き込み開始する。
+        // (同期ポリシーが batch の場合は、KeyLogSync_batch にて完了を待って同期する)
+        KeyLogUring_flush();
+        if (unsynced)
+        {
+            KeyLogSync_batch();
+            unsynced = false;
+        }
+
+        if (!running)
+        {   // 停止要求あり、かつ格納済みのスロットなし
+            if (tail == atomic_load(&KeyLogAsync.head))
+            {   // リングバッファが空
+                break;
+            }
+            if (stop_waited_ms < KEYLOG_ASYNC_STOP_WAIT_MS)
+            {   // 確保したスレッドが格納するのを待つ。
+                thrd_sleep(&(struct timespec) { .tv_nsec = 1000000L }, NULL);
+                stop_waited_ms++;
+                continue;
+            }
+            // 格納されないスロットは破棄し、後ろの格納済みのスロットを出力する。
+            // (スロットは再利用しないため、後から格納されても問題ない)
+            atomic_store_explicit(&KeyLogAsync.tail, tail + 1, memory_order_relaxed);
+            atomic_fetch_add(&KeyLogAsync.dropped, 1);
+            continue;
+        }
+
+        // 一定時間、またはリングバッファが半分埋まるまで待つ。
+        struct timespec ts;
+        KeyLogFile_deadline(&ts, KEYLOG_ASYNC_INTERVAL_MS);
+        mtx_lock(&KeyLogAsync.mutex);
+        if (atomic_load(&KeyLogAsync.running))
+        {
+            cnd_timedwait(&KeyLogAsync.cond, &KeyLogAsync.mutex, &ts);
+        }
+        mtx_unlock(&KeyLogAsync.mutex);
+    }
+    return 0;
+}
+
+
+/**
+ * まとめ書きバッファの内容を出力します。(書き込みスレッド専用)
+ * io_uring、圧縮出力、ソケット出力、write のいずれかにて出力します。
+ *
+ * @param batch まとめ書きバッファ (KeyLogUring_get_buffer または KeyLogAsync.batch)
+ * @param len まとめ書きバッファの長さ (KEYLOG_ASYNC_BATCH_SIZE 以下)
+ * @return true: io_uring にて書き込み、同期していない / false: 出力済み
+ */
+static
+bool KeyLogAsync_output(char *batch, size_t len)
+{
+    if (KeyLogUring_submit(len))
+    {
+        return true;
+    }
+    if (KeyLogCompress_write(batch, len))
+    {
+        KeyLogSync_batch();
+    }
+    else if (!KeyLogSocket_send(batch, len, true))
+    {
+        KeyLogFile_write_all(KeyLogFile_fd, batch, len);
+        KeyLogSync_batch();
+    }
+    return false;
+}
+
+/**
+ * 指定された位置のスロットが、まとめ書きバッファ (KEYLOG_ASYNC_BATCH_SIZE) に収まらない行の場合、
+ * KEYLOG_ASYNC_BATCH_SIZE 毎に分割して出力し、スロットを解放します。(書き込みスレッド専用)
+ * まとめ書きバッファが空の場合にのみ呼び出すため、書き込み順は保持されます。
+ * (圧縮出力ではフレーム、ソケット出力ではデータグラムが分割される)
+ *
+ * @param tail 次に読み出す位置
+ * @param unsynced io_uring にて書き込み、同期していないデータの有無 (io_uring にて書き込んだ場合 true を設定)
+ * @return true: 出力した / false: 対象外 (空、または収まるスロット)
+ */
+static
+bool KeyLogAsync_write_long(size_t tail, bool *unsynced)
+{
+    KeyLogAsyncSlot *slot = &KeyLogAsync.slots[tail & KeyLogAsync.mask];
+    if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != (tail + 1)
+            || slot->length <= KEYLOG_ASYNC_BATCH_SIZE)
+    {
+        return false;
+    }
+
+    for (size_t offset = 0; offset < slot->length; )
+    {
+        size_t n = slot->length - offset;
+        if (n > KEYLOG_ASYNC_BATCH_SIZE)
+        {
+            n = KEYLOG_ASYNC_BATCH_SIZE;
+        }
+        char *batch = KeyLogUring_get_buffer();
+        if (batch == NULL)
+        {
+            batch = KeyLogAsync.batch;
+        }
+        memcpy(batch, slot->heap + offset, n);
+        *unsynced = KeyLogAsync_output(batch, n) || *unsynced;
+        offset += n;
+    }
+    free(slot->heap);
+    slot->heap = NULL;
+    atomic_store_explicit(&slot->sequence, tail + KeyLogAsync.mask + 1, memory_order_release);
+    atomic_store_explicit(&KeyLogAsync.tail, tail + 1, memory_order_relaxed);
+    return true;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// io_uring による書き込み (非同期出力モードの書き込みスレッド用)
+//
+// まとめ書きバッファを KEYLOG_URING_DEPTH 個ずつの 2 グループで交互に利用する。
+// 書き込みスレッドは、一方のグループをリンクされた書き込み (IOSQE_IO_LINK) として
+// 1 回の io_uring_enter で投入し、その完了を待たずにもう一方のグループにキー情報を詰める。
+// 次のグループを投入する前に、前のグループの完了を待つため、書き込み順は保持される。
+// 部分書き込み、エラー (以降のリンクはキャンセルされる) の場合は、残りを write で書き込む。
+// 投入できない、または完了を待てない (io_uring_enter が EINTR 以外で失敗する) 場合は、
+// io_uring による書き込みを無効にし、以降は write にて出力する。
+//
+// liburing には依存せず、システムコールを直接利用する。
+// カーネルが対応していない (io_uring_setup が失敗する、IORING_FEAT_RW_CUR_POS 非対応) 場合は、
+// KeyLogUring_start が失敗し、書き込みスレッドは write にて出力する。
+//
+
+#ifdef KEYLOG_HAVE_IO_URING
+static struct
+{
+    atomic_bool enabled;                // io_uring による書き込みが有効か否か
+    int ring_fd;                        // io_uring のファイルディスクリプタ
+    int fd;                             // 出力先ファイルディスクリプタ
+    void *sq_ring;                      // 投入キュー (マッピング領域)
+    size_t sq_ring_size;
+    void *cq_ring;                      // 完了キュー (マッピング領域)
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;          // 投入キューのエントリ
+    size_t sqes_size;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    char *buffers;                      // まとめ書きバッファ (2 グループ x KEYLOG_URING_DEPTH 個)
+    size_t lengths[2][KEYLOG_URING_DEPTH];
+    int filling;                        // キー情報を詰めているグループ
+    size_t filled;                      // 詰め終わったバッファ数
+    int inflight_group;                 // 書き込み中のグループ
+    size_t inflight;                    // 書き込み中のバッファ数
+} KeyLogUring = { .ring_fd = -1 };
+
+/**
+ * io_uring による書き込みを開始します。
+ *
+ * @param fd 出力先ファイルディスクリプタ
+ * @return true: 開始成功 / false: カーネルが対応していない、またはメモリ不足
+ */
+static
+bool KeyLogUring_start(int fd)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    KeyLogUring.ring_fd = (int) syscall(__NR_io_uring_setup, KEYLOG_URING_DEPTH, &params);
+    if (KeyLogUring.ring_fd < 0)
+    {
+        return false;
+    }
+    if ((params.features & IORING_FEAT_RW_CUR_POS) == 0)
+    {   // 現在のファイル位置 (O_APPEND の場合は末尾) への書き込みに対応していない。
+        goto error;
+    }
+
+    KeyLogUring.sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    KeyLogUring.cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0)
+    {   // 投入キューと完了キューは 1 回でマッピングできる。
+        if (KeyLogUring.cq_ring_size > KeyLogUring.sq_ring_size)
+        {
+            KeyLogUring.sq_ring_size = KeyLogUring.cq_ring_size;
+        }
+        KeyLogUring.cq_ring_size = 0;
+    }
+    KeyLogUring.sq_ring = mmap(NULL, KeyLogUring.sq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, KeyLogUring.ring_fd, IORING_OFF_SQ_RING);
+    if (KeyLogUring.sq_ring == MAP_FAILED)
+    {
+        KeyLogUring.sq_ring = NULL;
+        goto error;
+    }
+    KeyLogUring.cq_ring = KeyLogUring.sq_ring;
+    if (KeyLogUring.cq_ring_size != 0)
+    {
+        KeyLogUring.cq_ring = mmap(NULL, KeyLogUring.cq_ring_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, KeyLogUring.ring_fd, IORING_OFF_CQ_RING);
+        if (KeyLogUring.cq_ring == MAP_FAILED)
+        {
+            KeyLogUring.cq_ring = NULL;
+            goto error;
+        }
+    }
+    KeyLogUring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    KeyLogUring.sqes = (struct io_uring_sqe *) mmap(NULL, KeyLogUring.sqes_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, KeyLogUring.ring_fd, IORING_OFF_SQES);
+    if (KeyLogUring.sqes == MAP_FAILED)
+    {
+        KeyLogUring.sqes = NULL;
+        goto error;
+    }
+
+    char *sq = (char *) KeyLogUring.sq_ring;
+    char *cq = (char *) KeyLogUring.cq_ring;
+    KeyLogUring.sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    KeyLogUring.sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    KeyLogUring.sq_array = (unsigned *) (sq + params.sq_off.array);
+    KeyLogUring.cq_head = (unsigned *) (cq + params.cq_off.head);
+    KeyLogUring.cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    KeyLogUring.cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    KeyLogUring.cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    KeyLogUring.buffers = (char *) malloc(2 * KEYLOG_URING_DEPTH * KEYLOG_ASYNC_BATCH_SIZE);
+    if (KeyLogUring.buffers == NULL)
+    {
+        goto error;
+    }
+    KeyLogUring.fd = fd;
+    KeyLogUring.filling = 0;
+    KeyLogUring.filled = 0;
+    KeyLogUring.inflight = 0;
+
+    // 書き込みスレッドは既に動作中のため、設定内容は release にて公開する。
+    atomic_store_explicit(&KeyLogUring.enabled, true, memory_order_release);
+    return true;
+
+error:
+    if (KeyLogUring.sqes != NULL)
+    {
+        munmap(KeyLogUring.sqes, KeyLogUring.sqes_size);
+        KeyLogUring.sqes = NULL;
+    }
+    if (KeyLogUring.cq_ring != NULL && KeyLogUring.cq_ring != KeyLogUring.sq_ring)
+    {
+        munmap(KeyLogUring.cq_ring, KeyLogUring.cq_ring_size);
+    }
+    if (KeyLogUring.sq_ring != NULL)
+    {
+        munmap(KeyLogUring.sq_ring, KeyLogUring.sq_ring_size);
+    }
+    KeyLogUring.sq_ring = NULL;
+    KeyLogUring.cq_ring = NULL;
+    close(KeyLogUring.ring_fd);
+    KeyLogUring.ring_fd = -1;
+    return false;
+}
+
+/**
+ * io_uring による書き込みを停止します。
+ * 書き込みスレッドの終了後に呼び出され、書き込み中のバッファが全て完了するまで待ちます。
+ */
+static
+void KeyLogUring_stop(void)
+{
+    if (!atomic_load(&KeyLogUring.enabled))
+    {
+        return;
+    }
+
+    KeyLogUring_flush();
+    KeyLogUring_wait();
+    KeyLogUring_release();
+}
+
+/**
+ * fork 後の子プロセスにて呼び出され、親プロセスと共有している io_uring を破棄して作成し直します。
+ * (書き込み中・未投入のバッファは親プロセスが出力するため、完了を待たずに破棄する)
+ */
+static
+void KeyLogUring_fork_child(void)
+{
+    if (!atomic_load(&KeyLogUring.enabled))
+    {
+        return;
+    }
+    KeyLogUring_release();
+    KeyLogUring_start(KeyLogUring.fd);
+}
+
+/**
+ * io_uring のマッピング領域、バッファを解放し、io_uring による書き込みを無効にします。
+ */
+static
+void KeyLogUring_release(void)
+{
+    atomic_store(&KeyLogUring.enabled, false);
+
+    munmap(KeyLogUring.sqes, KeyLogUring.sqes_size);
+    if (KeyLogUring.cq_ring != KeyLogUring.sq_ring)
+    {
+        munmap(KeyLogUring.cq_ring, KeyLogUring.cq_ring_size);
+    }
+    munmap(KeyLogUring.sq_ring, KeyLogUring.sq_ring_size);
+    close(KeyLogUring.ring_fd);
+    KeyLogUring.ring_fd = -1;
+    free(KeyLogUring.buffers);
+    KeyLogUring.buffers = NULL;
+}
+
+/**
+ * キー情報を詰めるまとめ書きバッファを取得します。(書き込みスレッド専用)
+ * バッファのサイズは KEYLOG_ASYNC_BATCH_SIZE となります。
+ *
+ * @return まとめ書きバッファ (io_uring による書き込みが無効の場合 NULL)
+ */
+static
+char *KeyLogUring_get_buffer(void)
+{
+    if (!atomic_load_explicit(&KeyLogUring.enabled, memory_order_acquire))
+    {
+        return NULL;
+    }
+    size_t index = (size_t) KeyLogUring.filling * KEYLOG_URING_DEPTH + KeyLogUring.filled;
+    return KeyLogUring.buffers + index * KEYLOG_ASYNC_BATCH_SIZE;
+}
+
+/**
+ * KeyLogUring_get_buffer で取得したバッファを、書き込み対象とします。(書き込みスレッド専用)
+ * グループの全バッファが埋まった場合、書き込みを開始します。
+ *
+ * @param len バッファに詰めたキー情報の長さ
+ * @return true: io_uring にて書き込む / false: io_uring による書き込みが無効
+ */
+static
+bool KeyLogUring_submit(size_t len)
+{
+    if (!atomic_load_explicit(&KeyLogUring.enabled, memory_order_relaxed))
+    {
+        return false;
+    }
+    KeyLogUring.lengths[KeyLogUring.filling][KeyLogUring.filled++] = len;
+    if (KeyLogUring.filled == KEYLOG_URING_DEPTH)
+    {
+        KeyLogUring_flush();
+    }
+    return true;
+}
+
+/**
+ * キー情報を詰めたバッファの書き込みを開始します。(書き込みスレッド専用)
+ * 前回書き込みを開始したバッファの完了を待ってから、リンクされた書き込みとして投入します。
+ */
+static
+void KeyLogUring_flush(void)
+{
+    if (!atomic_load_explicit(&KeyLogUring.enabled, memory_order_relaxed) || KeyLogUring.filled == 0)
+    {
+        return;
+    }
+    KeyLogUring_wait();
+    if (!atomic_load_explicit(&KeyLogUring.enabled, memory_order_relaxed))
+    {   // 前回の書き込みの完了を待てなかった: 詰めたバッファは write にて出力する。
+        KeyLogUring_fallback(KeyLogUring.filling, 0, KeyLogUring.filled);
+        return;
+    }
+
+    // 投入キューは書き込みスレッドのみが更新するため、tail の読み込みに同期は不要。
+    unsigned tail = *KeyLogUring.sq_tail;
+    unsigned mask = *KeyLogUring.sq_mask;
+    int group = KeyLogUring.filling;
+    for (size_t i = 0; i < KeyLogUring.filled; i++)
+    {
+        unsigned index = (tail + (unsigned) i) & mask;
+        struct io_uring_sqe *sqe = &KeyLogUring.sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = KeyLogUring.fd;
+        sqe->addr = (uint64_t) (uintptr_t) (KeyLogUring.buffers + ((size_t) group * KEYLOG_URING_DEPTH + i) * KEYLOG_ASYNC_BATCH_SIZE);
+        sqe->len = (uint32_t) KeyLogUring.lengths[group][i];
+        sqe->off = (uint64_t) -1;          // 現在のファイル位置 (O_APPEND のため末尾)
+        sqe->user_data = i;
+        if ((i + 1) < KeyLogUring.filled)
+        {   // 次の書き込みは、この書き込みの完了後に実行する。
+            sqe->flags = IOSQE_IO_LINK;
+        }
+        KeyLogUring.sq_array[index] = index;
+    }
+    // カーネルと共有するリングのため、GCC の atomic 組み込み関数にて公開する。
+    __atomic_store_n(KeyLogUring.sq_tail, tail + (unsigned) KeyLogUring.filled, __ATOMIC_RELEASE);
+
+    // リンクは 1 回の io_uring_enter 内でのみ有効なため、一部のみ投入された場合に残りを別の呼び出しで
+    // 投入すると、書き込み順が保持されない。そのため、投入は 1 回のみとする。(EINTR の場合のみ再試行する)
+    unsigned count = (unsigned) KeyLogUring.filled;
+    long ret;
+    do
+    {
+        ret = syscall(__NR_io_uring_enter, KeyLogUring.ring_fd, count, 0, 0, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+    unsigned submitted = (ret > 0) ? (unsigned) ret : 0;
+    if (submitted < count)
+    {   // 投入できなかった: 投入されていないエントリを取り下げ、以降は write にて出力する。
+        // (投入済みの分は完了を待ってから書き込み、順序を保持する。投入済みの最後のエントリのリンクは、
+        //  呼び出しの終わりでカーネルが閉じるため、未投入のエントリを待つことはない)
+        __atomic_store_n(KeyLogUring.sq_tail, tail + submitted, __ATOMIC_RELEASE);
+        KeyLogUring.inflight_group = group;
+        KeyLogUring.inflight = submitted;
+        KeyLogUring_wait();
+        KeyLogUring_fallback(group, submitted, count);
+        return;
+    }
+
+    KeyLogUring.inflight_group = group;
+    KeyLogUring.inflight = count;
+    KeyLogUring.filling = group ^ 1;
+    KeyLogUring.filled = 0;
+}
+
+/**
+ * 書き込み中のバッファが全て完了するまで待ちます。(書き込みスレッド専用)
+ * 部分書き込み、エラーとなったバッファは、残りを write にて書き込みます。
+ */
+static
+void KeyLogUring_wait(void)
+{
+    if (KeyLogUring.inflight == 0)
+    {
+        return;
+    }
+
+    int group = KeyLogUring.inflight_group;
+    int32_t results[KEYLOG_URING_DEPTH];
+    bool completed[KEYLOG_URING_DEPTH] = { false };
+    size_t reaped = 0;
+    while (reaped < KeyLogUring.inflight)
+    {
+        unsigned head = *KeyLogUring.cq_head;
+        unsigned tail = __atomic_load_n(KeyLogUring.cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail)
+        {   // 完了待ち
+            if (syscall(__NR_io_uring_enter, KeyLogUring.ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0
+                    && errno != EINTR)
+            {   // 完了を待てない (リングのファイルディスクリプタが閉じられたなど): 以降は write にて出力する。
+                // (リング、バッファは書き込み中の可能性があるため、解放しない)
+                atomic_store_explicit(&KeyLogUring.enabled, false, memory_order_relaxed);
+                break;
+            }
+            continue;
+        }
+        struct io_uring_cqe *cqe = &KeyLogUring.cqes[head & *KeyLogUring.cq_mask];
+        if (cqe->user_data < KEYLOG_URING_DEPTH)
+        {
+            results[cqe->user_data] = cqe->res;
+            completed[cqe->user_data] = true;
+        }
+        __atomic_store_n(KeyLogUring.cq_head, head + 1, __ATOMIC_RELEASE);
+        reaped++;
+    }
+
+    // 書き込み順を保持するため、先頭のバッファから順に確認する。
+    for (size_t i = 0; i < KeyLogUring.inflight; i++)
+    {
+        if (!completed[i])
+        {   // 完了を確認できなかった: 欠落を避けるため、全体を write にて書き込む。(重複する可能性がある)
+            KeyLogStats_add(KEYLOG_STATS_WRITE_ERRORS, 1);
+            results[i] = 0;
+        }
+        size_t len = KeyLogUring.lengths[group][i];
+        size_t written = (results[i] > 0) ? (size_t) results[i] : 0;
+        KeyLogStats_add(KEYLOG_STATS_BYTES, written);
+        if (results[i] < 0)
+        {   // (リンク先のキャンセルはエラーとして数えない)
+            KeyLogStats_add(KEYLOG_STATS_WRITE_ERRORS, (results[i] != -ECANCELED) ? 1 : 0);
+        }
+        else if (written < len)
+        {
+            KeyLogStats_add(KEYLOG_STATS_SHORT_WRITES, 1);
+        }
+        if (written < len)
+        {   // 部分書き込み、エラー、またはリンク先のキャンセル (-ECANCELED)
+            const char *buf = KeyLogUring.buffers + ((size_t) group * KEYLOG_URING_DEPTH + i) * KEYLOG_ASYNC_BATCH_SIZE;
+            KeyLogFile_write_all(KeyLogUring.fd, buf + written, len - written);
+        }
+    }
+    KeyLogUring.inflight = 0;
+}
+
+/**
+ * io_uring にて書き込めないバッファを write にて書き込み、io_uring による書き込みを無効にします。
+ * (書き込みスレッド専用。以降、書き込みスレッドは write にて出力する)
+ *
+ * @param group バッファのグループ
+ * @param begin 書き込む最初のバッファ
+ * @param end 書き込む最後のバッファの次
+ */
+static
+void KeyLogUring_fallback(int group, size_t begin, size_t end)
+{
+    for (size_t i = begin; i < end; i++)
+    {
+        KeyLogFile_write_all(KeyLogUring.fd,
+                KeyLogUring.buffers + ((size_t) group * KEYLOG_URING_DEPTH + i) * KEYLOG_ASYNC_BATCH_SIZE,
+                KeyLogUring.lengths[group][i]);
+    }
+    KeyLogUring.filled = 0;
+    atomic_store_explicit(&KeyLogUring.enabled, false, memory_order_relaxed);
+}
+#else
+// io_uring 非対応の環境: 常に write にて出力する。
+static
+bool KeyLogUring_start(int fd)
+{
+    (void) fd;
+    return false;
+}
+
+static
+void KeyLogUring_stop(void)
+{
+}
+
+static
+void KeyLogUring_fork_child(void)
+{
+}
+
+static
+void KeyLogUring_release(void)
+{
+}
+
+static
+char *KeyLogUring_get_buffer(void)
+{
+    return NULL;
+}
+
+static
+bool KeyLogUring_submit(size_t len)
+{
+    (void) len;
+    return false;
+}
+
+static
+void KeyLogUring_flush(void)
+{
+}
+
+static
+void KeyLogUring_wait(void)
+{
+}
+#endif
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 圧縮出力 (SSLKEYLOG_COMPRESS=zstd|lz4)
+//
+// 非同期出力モードの書き込みスレッドが、まとめ書きバッファの内容を独立したフレームに圧縮してから
+// 1 回の write で出力する。(形式は sslkeylog-compress.h を参照)
+// 圧縮は書き込みスレッドのみで行い、ハンドシェイクを行うスレッドは圧縮しない。
+// そのため、圧縮出力は常に非同期出力モードとなり (io_uring は利用しない)、
+// 行単位で出力を分割・コピーする mmap 出力、シャード出力、バッチ出力、ステージング、
+// ソケット出力モードとは併用できない。
+// 圧縮ライブラリは実行時に dlopen し、開けない場合は圧縮せずに出力する。
+//
+
+static struct
+{
+    int type;                           // 圧縮形式 (KEYLOG_COMPRESS_*)
+    void *handle;                       // 圧縮ライブラリのハンドル
+    char *buffer;                       // 圧縮後のデータの格納先 (書き込みスレッド用)
+    size_t capacity;                    // buffer のサイズ (KEYLOG_ASYNC_BATCH_SIZE の圧縮後の最大サイズ)
+    KeyLogCompress_ZSTD_compressBound zstd_bound;
+    KeyLogCompress_ZSTD_compress zstd_compress;
+    KeyLogCompress_ZSTD_isError zstd_is_error;
+    KeyLogCompress_LZ4F_compressFrameBound lz4_bound;
+    KeyLogCompress_LZ4F_compressFrame lz4_compress;
+    KeyLogCompress_LZ4F_isError lz4_is_error;
+    atomic_bool enabled;                // 圧縮出力が有効か否か
+} KeyLogCompress;
+
+/**
+ * 圧縮出力を開始します。圧縮ライブラリを開き、圧縮後のデータの格納先を確保します。
+ *
+ * @param value SSLKEYLOG_COMPRESS ("zstd" または "lz4"。NULL、空の場合は圧縮しない)
+ * @return true: 開始成功 / false: 圧縮しない (未指定、未知の形式、ライブラリを開けない)
+ */
+static
+bool KeyLogCompress_start(const char *value)
+{
+    if (value == NULL || *value == '\0')
+    {
+        return false;
+    }
+    const char *library;
+    if (strcmp(value, "zstd") == 0)
+    {
+        KeyLogCompress.type = KEYLOG_COMPRESS_ZSTD;
+        library = KEYLOG_COMPRESS_ZSTD_LIBRARY;
+    }
+    else if (strcmp(value, "lz4") == 0)
+    {
+        KeyLogCompress.type = KEYLOG_COMPRESS_LZ4;
+        library = KEYLOG_COMPRESS_LZ4_LIBRARY;
+    }
+    else
+    {
+        KeyLogStats_add(KEYLOG_STATS_CONFIG_ERRORS, 1);
+        KeyLogFile_debug("sslkeylog: SSLKEYLOG_COMPRESS=%s: unknown compression (zstd or lz4)\n", value);
+        return false;
+    }
+
+    KeyLogCompress.handle = dlopen(library, RTLD_LAZY);
+    if (KeyLogCompress.handle == NULL)
+    {
+        KeyLogStats_add(KEYLOG_STATS_CONFIG_ERRORS, 1);
+        KeyLogFile_debug("sslkeylog: SSLKEYLOG_COMPRESS=%s: %s not found, writing uncompressed\n", value, library);
+        return false;
+    }
+    size_t capacity = 0;
+    if (KeyLogCompress.type == KEYLOG_COMPRESS_ZSTD)
+    {
+        KeyLogCompress.zstd_bound = (KeyLogCompress_ZSTD_compressBound) dlsym(KeyLogCompress.handle, "ZSTD_compressBound");
+        KeyLogCompress.zstd_compress = (KeyLogCompress_ZSTD_compress) dlsym(KeyLogCompress.handle, "ZSTD_compress");
+        KeyLogCompress.zstd_is_error = (KeyLogCompress_ZSTD_isError) dlsym(KeyLogCompress.handle, "ZSTD_isError");
+        if (KeyLogCompress.zstd_bound != NULL && KeyLogCompress.zstd_compress != NULL && KeyLogCompress.zstd_is_error != NULL)
+        {
+            capacity = KeyLogCompress.zstd_bound(KEYLOG_ASYNC_BATCH_SIZE);
+        }
+    }
+    else
+    {
+        KeyLogCompress.lz4_bound = (KeyLogCompress_LZ4F_compressFrameBound) dlsym(KeyLogCompress.handle, "LZ4F_compressFrameBound");
+        KeyLogCompress.lz4_compress = (KeyLogCompress_LZ4F_compressFrame) dlsym(KeyLogCompress.handle, "LZ4F_compressFrame");
+        KeyLogCompress.lz4_is_error = (KeyLogCompress_LZ4F_isError) dlsym(KeyLogCompress.handle, "LZ4F_isError");
+        if (KeyLogCompress.lz4_bound != NULL && KeyLogCompress.lz4_compress != NULL && KeyLogCompress.lz4_is_error != NULL)
+        {
+            capacity = KeyLogCompress.lz4_bound(KEYLOG_ASYNC_BATCH_SIZE, NULL);
+        }
+    }
+
+    KeyLogCompress.buffer = (capacity > 0) ? (char *) malloc(capacity) : NULL;
+    if (KeyLogCompress.buffer == NULL)
+    {
+        KeyLogStats_add(KEYLOG_STATS_CONFIG_ERRORS, 1);
+        KeyLogFile_debug("sslkeylog: SSLKEYLOG_COMPRESS=%s: cannot initialize %s, writing uncompressed\n", value, library);
+        dlclose(KeyLogCompress.handle);
+        KeyLogCompress.handle = NULL;
+        return false;
+    }
+    KeyLogCompress.capacity = capacity;
+    atomic_store(&KeyLogCompress.enabled, true);
+    return true;
+}
+
+/**
+ * 圧縮出力を停止します。(書き込みスレッドを開始できなかった場合に、圧縮せずに出力するため)
+ * 圧縮ライブラリは閉じずに残します。
+ */
+static
+void KeyLogCompress_stop(void)
+{
+    if (!atomic_exchange(&KeyLogCompress.enabled, false))
+    {
+        return;
+    }
+    free(KeyLogCompress.buffer);
+    KeyLogCompress.buffer = NULL;
+}
+
+/**
+ * 圧縮出力が有効か否かを返します。
+ * 圧縮出力中のファイルには、書き込みスレッド以外から (圧縮しない) キー情報を出力してはいけません。
+ *
+ * @return true: 圧縮出力中 / false: 圧縮しない
+ */
+static
+bool KeyLogCompress_is_enabled(void)
+{
+    return atomic_load_explicit(&KeyLogCompress.enabled, memory_order_relaxed);
+}
+
+/**
+ * まとめ書きバッファの内容を 1 つのフレームに圧縮して書き込みます。(書き込みスレッドから呼び出す)
+ *
+ * @param data まとめ書きバッファ
+ * @param len まとめ書きバッファの長さ (KEYLOG_ASYNC_BATCH_SIZE 以下)
+ * @return true: 圧縮出力した (書き込みエラー含む) / false: 圧縮出力モードではない
+ */
+static
+bool KeyLogCompress_write(const char *data, size_t len)
+{
+    if (!atomic_load_explicit(&KeyLogCompress.enabled, memory_order_relaxed))
+    {
+        return false;
+    }
+
+    size_t size;
+    bool error;
+    if (KeyLogCompress.type == KEYLOG_COMPRESS_ZSTD)
+    {
+        size = KeyLogCompress.zstd_compress(KeyLogCompress.buffer, KeyLogCompress.capacity,
+                data, len, KEYLOG_COMPRESS_ZSTD_LEVEL);
+        error = KeyLogCompress.zstd_is_error(size);
+    }
+    else
+    {
+        size = KeyLogCompress.lz4_compress(KeyLogCompress.buffer, KeyLogCompress.capacity, data, len, NULL);
+        error = KeyLogCompress.lz4_is_error(size);
+    }
+    if (error)
+    {   // 格納先は最大サイズで確保しているため、通常は発生しない。
+        KeyLogStats_add(KEYLOG_STATS_WRITE_ERRORS, 1);
+        return true;
+    }
+    KeyLogFile_write_all(KeyLogFile_fd, KeyLogCompress.buffer, size);
+    return true;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// ソケット出力 (UNIX ドメインソケット / UDP によるコレクタへの送信)
+//
+// SSLKEYLOGFILE に "unix:<パス>" または "udp://<ホスト>:<ポート>" が指定された場合、
+// キー情報をデータグラムとしてコレクタ (tools/sslkeylog-collector など) に送信する。
+// 送信は非同期出力の書き込みスレッドから行い、まとめ書きバッファの内容を
+// レコード単位でデータグラムに分割し、sendmmsg にて 1 回で送信する。
+// ソケットは非ブロッキングとし、送信できない間は書き込みスレッドが待つため、
+// キー情報はリングバッファ (上限あり) に溜まり、溢れた分は破棄数としてカウントされる。
+//
+// ※ コレクタが後から起動されても送信できるよう、connect せずに送信先を都度指定する。
+//
+
+static struct
+{
+    atomic_bool enabled;                // ソケット出力モードが有効か否か
+    int fd;                             // ソケット
+    struct sockaddr_storage address;    // 送信先
+    socklen_t address_len;
+    size_t datagram_max;                // データグラム 1 つの最大長
+    atomic_ulong dropped;               // 送信できずに破棄したデータグラム数
+} KeyLogSocket = { .fd = -1 };
+
+/**
+ * 指定されたファイル名が、ソケットの送信先か否かを判定します。
+ *
+ * @param name ファイル名 (SSLKEYLOGFILE)
+ * @return true: ソケットの送信先 / false: ファイル
+ */
+static
+bool KeyLogSocket_is_address(const char *name)
+{
+    return (strncmp(name, "unix:", 5) == 0 || strncmp(name, "udp://", 6) == 0);
+}
+
+/**
+ * 指定された送信先へのソケットを生成し、ソケット出力を開始します。
+ *
+ * @param address 送信先 ("unix:<パス>" または "udp://<ホスト>:<ポート>"、IPv6 は "[<アドレス>]:<ポート>")
+ * @return ソケット (失敗時は -1)
+ */
+static
+int KeyLogSocket_open(const char *address)
+{
+    if (strncmp(address, "unix:", 5) == 0)
+    {
+        struct sockaddr_un *un = (struct sockaddr_un *) &KeyLogSocket.address;
+        const char *path = address + 5;
+        if (strlen(path) >= sizeof(un->sun_path))
+        {
+            return -1;
+        }
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, path);
+        KeyLogSocket.address_len = (socklen_t) sizeof(struct sockaddr_un);
+        KeyLogSocket.datagram_max = KEYLOG_SOCKET_UNIX_DATAGRAM_MAX;
+    }
+    else
+    {   // ホスト名とポートに分割する。
+        char host[NI_MAXHOST];
+        const char *p = address + 6;
+        const char *port = NULL;
+        size_t host_len;
+        if (*p == '[')
+        {   // IPv6 アドレス
+            const char *end = strchr(p, ']');
+            if (end == NULL || end[1] != ':')
+            {
+                return -1;
+            }
+            p++;
+            host_len = (size_t) (end - p);
+            port = end + 2;
+        }
+        else
+        {
+            port = strrchr(p, ':');
+            if (port == NULL)
+            {
+                return -1;
+            }
+            host_len = (size_t) (port - p);
+            port++;
+        }
+        if (host_len >= sizeof(host))
+        {
+            return -1;
+        }
+        memcpy(host, p, host_len);
+        host[host_len] = '\0';
+
+        struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_DGRAM };
+        struct addrinfo *result = NULL;
+        if (getaddrinfo(host, port, &hints, &result) != 0 || result == NULL)
+        {
+            return -1;
+        }
+        memcpy(&KeyLogSocket.address, result->ai_addr, result->ai_addrlen);
+        KeyLogSocket.address_len = result->ai_addrlen;
+        freeaddrinfo(result);
+        KeyLogSocket.datagram_max = KEYLOG_SOCKET_UDP_DATAGRAM_MAX;
+    }
+
+    KeyLogSocket.fd = socket(KeyLogSocket.address.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (KeyLogSocket.fd < 0)
+    {
+        return -1;
+    }
+    atomic_init(&KeyLogSocket.dropped, 0);
+    atomic_store(&KeyLogSocket.enabled, true);
+    return KeyLogSocket.fd;
+}
+
+/**
+ * ソケット出力を停止します。(ソケットは閉じず、プロセス終了時に閉じられる)
+ * 非同期出力の停止後に呼び出されます。
+ */
+static
+void KeyLogSocket_stop(void)
+{
+    if (!atomic_exchange(&KeyLogSocket.enabled, false))
+    {
+        return;
+    }
+
+    unsigned long dropped = atomic_load(&KeyLogSocket.dropped);
+    if (dropped > 0)
+    {
+        KeyLogFile_debug("sslkeylog: %lu key log datagrams dropped (send failed)\n", dropped);
+    }
+}
+
+/**
+ * キー情報をデータグラムに分割して送信します。
+ * 送信できないデータグラムは破棄し、破棄数をカウントします。
+ *
+ * @param data キー情報 (1 行以上、またはバイナリ形式のレコード 1 つ以上)
+ * @param len キー情報の長さ
+ * @param wait true: ソケットが送信可能になるまで待つ (最大 KEYLOG_SOCKET_WAIT_MS) / false: 待たない
+ * @return true: ソケット出力モードで処理した (送信 or 破棄) / false: ソケット出力モードではない
+ */
+static
+bool KeyLogSocket_send(const char *data, size_t len, bool wait)
+{
+    if (!atomic_load_explicit(&KeyLogSocket.enabled, memory_order_acquire))
+    {
+        return false;
+    }
+
+    while (len > 0)
+    {
+        // レコード単位でデータグラムに分割する。
+        struct mmsghdr messages[KEYLOG_SOCKET_MAX_MESSAGES];
+        struct iovec iov[KEYLOG_SOCKET_MAX_MESSAGES];
+        unsigned int count = 0;
+        while (len > 0 && count < KEYLOG_SOCKET_MAX_MESSAGES)
+        {
+            size_t n = KeyLogSocket_split(data, len);
+            iov[count].iov_base = (void *) data;
+            iov[count].iov_len = n;
+            memset(&messages[count], 0, sizeof(messages[count]));
+            messages[count].msg_hdr.msg_name = &KeyLogSocket.address;
+            messages[count].msg_hdr.msg_namelen = KeyLogSocket.address_len;
+            messages[count].msg_hdr.msg_iov = &iov[count];
+            messages[count].msg_hdr.msg_iovlen = 1;
+            count++;
+            data += n;
+            len -= n;
+        }
+
+        unsigned int sent = 0;
+        bool waited = false;
+        while (sent < count)
+        {
+            int ret = sendmmsg(KeyLogSocket.fd, messages + sent, count - sent, 0);
+            if (ret > 0)
+            {
+                uint64_t bytes = 0;
+                for (int i = 0; i < ret; i++)
+                {
+                    bytes += messages[sent + (unsigned int) i].msg_len;
+                }
+                KeyLogStats_add(KEYLOG_STATS_BYTES, bytes);
+                sent += (unsigned int) ret;
+                waited = false;
+                continue;
+            }
+            if (ret < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) && wait && !waited)
+            {   // 送信バッファが空くまで待つ。(書き込みスレッドのみ)
+                struct pollfd pfd = { .fd = KeyLogSocket.fd, .events = POLLOUT };
+                poll(&pfd, 1, KEYLOG_SOCKET_WAIT_MS);
+                waited = true;
+                continue;
+            }
+
+            // 送信できない (コレクタ未起動、送信バッファ満杯など): 先頭のデータグラムを破棄する。
+            atomic_fetch_add_explicit(&KeyLogSocket.dropped, 1, memory_order_relaxed);
+            sent++;
+        }
+    }
+    return true;
+}
+
+/**
+ * データグラム 1 つに収まる長さを、レコード単位で求めます。
+ *
+ * @param data キー情報
+ * @param len キー情報の長さ
+ * @return データグラムの長さ
+ */
+static
+size_t KeyLogSocket_split(const char *data, size_t len)
+{
+    if (len <= KeyLogSocket.datagram_max)
+    {
+        return len;
+    }
+    if (KeyLogFile_binary)
+    {   // バイナリ形式: 固定長のレコード単位
+        return KeyLogSocket.datagram_max - (KeyLogSocket.datagram_max % KEYLOG_BINARY_RECORD_SIZE);
+    }
+
+    // テキスト形式: 行単位 (1 行がデータグラムに収まらない場合は、そのまま分割する)
+    const char *end = memrchr(data, '\n', KeyLogSocket.datagram_max);
+    return (end != NULL) ? (size_t) (end - data) + 1 : KeyLogSocket.datagram_max;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// バッチ出力 (スレッド毎のバッファ + フラッシュスレッド)
+//
+// キー情報を出力するスレッド毎にバッファを持ち、行単位で蓄積する。
+// (シャード出力モードの場合、バッファはスレッドのシャードに出力する)
+// 以下のいずれかの契機で、バッファの内容を 1 回の write でまとめて出力する。
+// (バッファには完全な行のみ格納されるため、行が分割して出力されることはない)
+//   - バッファの使用量がバッチサイズを超えた時 (キー情報を出力したスレッドにて出力)
+//   - 一定時間経過した時 (フラッシュスレッドにて出力)
+//   - スレッド終了時 (tss のデストラクタにて出力)
+//   - プロセス終了時 (KeyLogFile_finalize にて出力)
+//
+
+static struct
+{
+    size_t batch_bytes;             // バッチサイズ
+    size_t flush_ms;                // フラッシュ間隔 [ms]
+    tss_t key;                      // スレッド終了検知用
+    mtx_t list_mutex;               // 登録済みバッファのリスト保護用
+    KeyLogBatchBuffer *list;        // 登録済みバッファのリスト
+    thrd_t thread;                  // フラッシュスレッド
+    mtx_t mutex;                    // フラッシュスレッド停止用
+    cnd_t cond;                     // フラッシュスレッド停止用
+    atomic_bool enabled;            // バッチ出力モードが有効か否か
+    bool running;                   // フラッシュスレッドが動作中か否か (mutex にて保護)
+} KeyLogBatch;
+
+static thread_local KeyLogBatchBuffer *KeyLogBatch_self = NULL;
+
+/**
+ * バッチ出力を開始します。
+ *
+ * @param batch_bytes バッチサイズ [バイト]
+ * @param flush_ms フラッシュ間隔 [ms] (0 の場合、時間経過によるフラッシュは行いません)
+ * @return true: 開始成功 / false: 開始失敗
+ */
+static
+bool KeyLogBatch_start(size_t batch_bytes, size_t flush_ms)
+{
+    KeyLogBatch.batch_bytes = batch_bytes;
+    KeyLogBatch.flush_ms = flush_ms;
+    KeyLogBatch.list = NULL;
+
+    if (tss_create(&KeyLogBatch.key, KeyLogBatch_thread_exit) != thrd_success)
+    {
+        return false;
+    }
+    if (mtx_init(&KeyLogBatch.list_mutex, mtx_plain) != thrd_success)
+    {
+        goto error_tss;
+    }
+    if (mtx_init(&KeyLogBatch.mutex, mtx_plain) != thrd_success)
+    {
+        goto error_list_mutex;
+    }
+    if (cnd_init(&KeyLogBatch.cond) != thrd_success)
+    {
+        goto error_mutex;
+    }
+
+    KeyLogBatch.running = (flush_ms > 0);
+    if (KeyLogBatch.running && !KeyLogFile_start_thread(&KeyLogBatch.thread, KeyLogBatch_flusher))
+    {
+        goto error_cond;
+    }
+
+    atomic_store(&KeyLogBatch.enabled, true);
+    return true;
+
+error_cond:
+    cnd_destroy(&KeyLogBatch.cond);
+error_mutex:
+    mtx_destroy(&KeyLogBatch.mutex);
+error_list_mutex:
+    mtx_destroy(&KeyLogBatch.list_mutex);
+error_tss:
+    tss_delete(KeyLogBatch.key);
+    return false;
+}
+
+/**
+ * バッチ出力を停止します。
+ * フラッシュスレッドを終了し、全スレッドのバッファに残っているキー情報を出力します。
+ * 以降のキー情報は同期出力となります。
+ */
+static
+void KeyLogBatch_stop(void)
+{
+    if (!atomic_exchange(&KeyLogBatch.enabled, false))
+    {   // バッチ出力モードではない
+        return;
+    }
+
+    mtx_lock(&KeyLogBatch.mutex);
+    bool running = KeyLogBatch.running;
+    KeyLogBatch.running = false;
+    cnd_signal(&KeyLogBatch.cond);
+    mtx_unlock(&KeyLogBatch.mutex);
+    if (running)
+    {
+        thrd_join(KeyLogBatch.thread, NULL);
+    }
+
+    KeyLogBatch_flush_all();
+}
+
+/**
+ * キー情報を組み立てる位置として、呼び出し元スレッドのバッファをロックして確保します。
+ * (ロックは KeyLogBatch_commit にて解放する)
+ *
+ * @param out 出力先 (out->fd をバッファの出力先とし、確保したバッファを out->buffer に設定)
+ * @return
+ *	組み立て先 (KEYLOG_RECORD_MAX バイト)
+ *	NULL: バッチ出力モードではない、またはバッファを確保できないため呼び出し元にて出力が必要
+ */
+static
+char *KeyLogBatch_reserve(KeyLogLine *out)
+{
+    if (!atomic_load_explicit(&KeyLogBatch.enabled, memory_order_acquire))
+    {
+        return NULL;
+    }
+
+    KeyLogBatchBuffer *buffer = KeyLogBatch_get_buffer(out->fd);
+    if (buffer == NULL)
+    {
+        return NULL;
+    }
+
+    // フラッシュスレッドが出力中の場合は、完了を待つ。
+    while (atomic_flag_test_and_set_explicit(&buffer->lock, memory_order_acquire))
+    {
+        thrd_yield();
+    }
+
+    // バッファ容量はバッチサイズ + KEYLOG_RECORD_MAX で、使用量は常にバッチサイズ未満のため、必ず組み立てられる。
+    out->buffer = buffer;
+    return buffer->data + buffer->used;
+}
+
+/**
+ * KeyLogBatch_reserve にて確保した位置に組み立てたキー情報を蓄積し、バッファのロックを解放します。
+ * バッファの使用量がバッチサイズを超えた場合、バッファの内容を出力します。
+ *
+ * @param out 出力先
+ * @param len 組み立てたキー情報の長さ (タイムスタンプを除く。0: 出力しない)
+ */
+static
+void KeyLogBatch_commit(KeyLogLine *out, size_t len)
+{
+    KeyLogBatchBuffer *buffer = out->buffer;
+    if (len > 0)
+    {
+        buffer->used += out->prefix + len;
+        if (buffer->used >= KeyLogBatch.batch_bytes)
+        {
+            KeyLogFile_write_all(buffer->fd, buffer->data, buffer->used);
+            buffer->used = 0;
+        }
+    }
+    atomic_flag_clear_explicit(&buffer->lock, memory_order_release);
+}
+
+/**
+ * 呼び出し元スレッドのバッファを取得します。
+ * 初回呼び出し時に、バッファを確保して登録します。
+ *
+ * @param fd バッファの出力先ファイルディスクリプタ
+ * @return バッファ (確保できない場合 NULL)
+ */
+static
+KeyLogBatchBuffer *KeyLogBatch_get_buffer(int fd)
+{
+    KeyLogBatchBuffer *buffer = KeyLogBatch_self;
+    if (buffer != NULL)
+    {
+        return buffer;
+    }
+
+    buffer = (KeyLogBatchBuffer *) malloc(sizeof(KeyLogBatchBuffer) + KeyLogBatch.batch_bytes + KEYLOG_RECORD_MAX);
+    if (buffer == NULL)
+    {
+        return NULL;
+    }
+    atomic_flag_clear(&buffer->lock);
+    buffer->fd = fd;
+    buffer->used = 0;
+
+    mtx_lock(&KeyLogBatch.list_mutex);
+    buffer->next = KeyLogBatch.list;
+    KeyLogBatch.list = buffer;
+    mtx_unlock(&KeyLogBatch.list_mutex);
+
+    // スレッド終了時に、KeyLogBatch_thread_exit が呼び出されるよう登録する。
+    tss_set(KeyLogBatch.key, buffer);
+    KeyLogBatch_self = buffer;
+    return buffer;
+}
+
+/**
+ * 指定されたバッファの内容を出力します。
+ * 呼び出し元でバッファをロックしている必要があります。
+ *
+ * @param buffer バッファ
+ */
+static
+void KeyLogBatch_flush(KeyLogBatchBuffer *buffer)
+{
+    if (buffer->used > 0)
+    {
+        KeyLogFile_write_all(buffer->fd, buffer->data, buffer->used);
+        buffer->used = 0;
+    }
+}
+
+/**
+ * 登録済みの全バッファの内容を出力します。
+ */
+static
+void KeyLogBatch_flush_all(void)
+{
+    mtx_lock(&KeyLogBatch.list_mutex);
+    for (KeyLogBatchBuffer *buffer = KeyLogBatch.list; buffer != NULL; buffer = buffer->next)
+    {
+        while (atomic_flag_test_and_set_explicit(&buffer->lock, memory_order_acquire))
+        {
+            thrd_yield();
+        }
+        KeyLogBatch_flush(buffer);
+        atomic_flag_clear_explicit(&buffer->lock, memory_order_release);
+    }
+    mtx_unlock(&KeyLogBatch.list_mutex);
+}
+
+/**
+ * スレッド終了時に呼び出されます。
+ * 終了するスレッドのバッファの内容を出力し、バッファを解放します。
+ *
+ * @param arg 終了するスレッドのバッファ
+ */
+static
+void KeyLogBatch_thread_exit(void *arg)
+{
+    KeyLogBatchBuffer *buffer = (KeyLogBatchBuffer *) arg;
+
+    mtx_lock(&KeyLogBatch.list_mutex);
+    for (KeyLogBatchBuffer **p = &KeyLogBatch.list; *p != NULL; p = &(*p)->next)
+    {
+        if (*p == buffer)
+        {
+            *p = buffer->next;
+            break;
+        }
+    }
+    mtx_unlock(&KeyLogBatch.list_mutex);
+
+    // リストから外したため、他スレッドからは参照されない。
+    if (KeyLogFile_fd >= 0)
+    {
+        KeyLogBatch_flush(buffer);
+    }
+    KeyLogBatch_self = NULL;
+    free(buffer);
+}
+
+/**
+ * フラッシュスレッド。
+ * フラッシュ間隔毎に、全スレッドのバッファの内容を出力します。
+ *
+ * @param arg 未使用
+ * @return 0 固定
+ */
+static
+int KeyLogBatch_flusher(void *arg)
+{
+    (void) arg;
+    mtx_lock(&KeyLogBatch.mutex);
+    while (KeyLogBatch.running)
+    {
+        struct timespec ts;
+        KeyLogFile_deadline(&ts, KeyLogBatch.flush_ms);
+        if (cnd_timedwait(&KeyLogBatch.cond, &KeyLogBatch.mutex, &ts) == thrd_timedout)
+        {
+            mtx_unlock(&KeyLogBatch.mutex);
+            KeyLogBatch_flush_all();
+            KeyLogSync_batch();
+            mtx_lock(&KeyLogBatch.mutex);
+        }
+    }
+    mtx_unlock(&KeyLogBatch.mutex);
+    return 0;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// シャード出力 (スレッド毎に出力ファイルを振り分け)
+//
+// 多数のスレッドが 1 つの O_APPEND ファイルに出力すると、カーネル内の inode ロックで
+// 直列化されるため、スレッド毎に複数のファイル (シャード) に振り分けて出力する。
+// シャードのファイル名は、SSLKEYLOGFILE の %s をシャード番号に置き換えたものとなる。
+// (%s が含まれない場合は、末尾に ".<シャード番号>" を付与する。シャード 0 は KeyLogFile_fd)
+//
+// 各行の前にはタイムスタンプをコメント行 ("# <UNIX時刻[ns]>") として付与する。
+// Wireshark は '#' で始まる行を読み飛ばすため、各シャードはそのまま読み込むことができる。
+// tools/sslkeylog-merge にて、タイムスタンプ順に 1 つのファイルにまとめることができる。
+//
+
+static struct
+{
+    size_t count;                       // シャード数
+    int fds[KEYLOG_SHARD_MAX];          // シャード毎のファイルディスクリプタ
+    atomic_size_t next;                 // 次のスレッドに割り当てるシャード番号
+} KeyLogShard;
+
+static atomic_bool KeyLogShard_enabled = false;
+static thread_local int KeyLogShard_self_fd = -1;
+
+/**
+ * シャード出力を開始します。
+ * シャード 0 には KeyLogFile_fd を利用し、シャード 1 以降のファイルを開きます。
+ * (KeyLogFile_template には、KeyLogFile_init にてシャード番号 %s が含まれている)
+ *
+ * @param count シャード数 (KEYLOG_SHARD_MAX 以下に制限されます)
+ * @return true: 開始成功 / false: 開始失敗
+ */
+static
+bool KeyLogShard_start(size_t count)
+{
+    if (count > KEYLOG_SHARD_MAX)
+    {
+        count = KEYLOG_SHARD_MAX;
+    }
+
+    KeyLogShard.fds[0] = KeyLogFile_fd;
+    for (size_t i = 1; i < count; i++)
+    {
+        char name[PATH_MAX];
+        int fd = -1;
+        if (KeyLogFile_expand_name(name, sizeof(name), KeyLogFile_template, 0, (int) i))
+        {
+            fd = open(name, O_WRONLY | O_APPEND | O_CREAT, 0644);
+        }
+        if (fd < 0)
+        {   // 開けなかったシャードは、シャード 0 に出力する。
+            fd = KeyLogFile_fd;
+        }
+        KeyLogShard.fds[i] = fd;
+    }
+    KeyLogShard.count = count;
+    atomic_init(&KeyLogShard.next, 0);
+    atomic_store(&KeyLogShard_enabled, true);
+    return true;
+}
+
+/**
+ * シャード出力を停止します。
+ * シャード 1 以降のファイルを閉じます。以降のキー情報はシャード 0 に出力されます。
+ */
+static
+void KeyLogShard_stop(void)
+{
+    if (!atomic_exchange(&KeyLogShard_enabled, false))
+    {
+        return;
+    }
+    for (size_t i = 1; i < KeyLogShard.count; i++)
+    {
+        if (KeyLogShard.fds[i] != KeyLogFile_fd)
+        {
+            close(KeyLogShard.fds[i]);
+        }
+        KeyLogShard.fds[i] = KeyLogFile_fd;
+    }
+}
+
+/**
+ * 呼び出し元スレッドのシャードの出力先を取得します。
+ * スレッドの初回呼び出し時に、シャードを順番に割り当てます。
+ * シャード出力モードではない場合、KeyLogFile_fd を返します。
+ *
+ * @return 出力先ファイルディスクリプタ
+ */
+static
+int KeyLogShard_get_fd(void)
+{
+    if (!atomic_load_explicit(&KeyLogShard_enabled, memory_order_relaxed))
+    {
+        return KeyLogFile_fd;
+    }
+    if (KeyLogShard_self_fd < 0)
+    {
+        size_t index = atomic_fetch_add_explicit(&KeyLogShard.next, 1, memory_order_relaxed) % KeyLogShard.count;
+        KeyLogShard_self_fd = KeyLogShard.fds[index];
+    }
+    return KeyLogShard_self_fd;
+}
+
+/**
+ * キー情報の前に付与するタイムスタンプのコメント行を作成します。
+ * シャード出力モードではない場合、またはバイナリ形式の場合 (レコードにタイムスタンプが含まれる) は
+ * 何もしません。
+ *
+ * @param out 出力先 (KEYLOG_SHARD_STAMP_MAX バイト。直後にキー情報を組み立てる)
+ * @return 作成したタイムスタンプの長さ (作成しない場合 0)
+ */
+static
+size_t KeyLogShard_stamp(char *out)
+{
+    if (!atomic_load_explicit(&KeyLogShard_enabled, memory_order_relaxed) || KeyLogFile_binary)
+    {
+        return 0;
+    }
+    uint64_t ns = KeyLogFile_realtime_ns();
+
+    // 10 進数に変換する。(下位桁から)
+    char digits[20];
+    size_t n = 0;
+    do
+    {
+        digits[n++] = (char) ('0' + (ns % 10));
+        ns /= 10;
+    } while (ns != 0);
+
+    char *p = out;
+    *p++ = '#';
+    *p++ = ' ';
+    while (n > 0)
+    {
+        *p++ = digits[--n];
+    }
+    *p++ = '\n';
+    return (size_t) (p - out);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 重複排除
+//
+// セッション再開や再ネゴシエーションにより、同じキー情報が繰り返し出力されることを防ぐため、
+// 最近出力したキー情報のフィンガープリント (ラベル + クライアントランダムのハッシュ値) を
+// 固定サイズのオープンアドレス法のハッシュテーブルに保持する。
+// テーブルの各エントリは CAS にて登録するため、ロックは不要となる。
+// 探索は KEYLOG_DEDUP_PROBES 個のエントリまでとし、全て使用中の場合は
+// 先頭のエントリを上書きする。(古いキー情報は忘れられ、再度出力される場合がある)
+//
+// ※ テーブルは、他スレッドのコールバックから参照される可能性があるため、解放しない。
+//
+
+static struct
+{
+    _Atomic uint64_t *entries;          // フィンガープリント (0: 未使用)
+    size_t mask;                        // エントリ数 - 1 (エントリ数は 2 のべき乗)
+    atomic_bool enabled;                // 重複排除が有効か否か
+} KeyLogDedup;
+
+/**
+ * 重複排除を開始します。
+ *
+ * @param entries エントリ数 (2 のべき乗に切り上げられ、KEYLOG_DEDUP_MAX_ENTRIES 以下に制限されます)
+ * @return true: 開始成功 / false: 開始失敗
+ */
+static
+bool KeyLogDedup_start(size_t entries)
+{
+    size_t count = KEYLOG_DEDUP_PROBES;
+    while (count < entries && count < KEYLOG_DEDUP_MAX_ENTRIES)
+    {
+        count <<= 1;
+    }
+
+    KeyLogDedup.entries = (_Atomic uint64_t *) calloc(count, sizeof(*KeyLogDedup.entries));
+    if (KeyLogDedup.entries == NULL)
+    {
+        return false;
+    }
+    KeyLogDedup.mask = count - 1;
+    atomic_store(&KeyLogDedup.enabled, true);
+    return true;
+}
+
+/**
+ * 指定されたキー情報が出力済みか否かを判定し、未出力の場合はテーブルに登録します。
+ * 重複排除が無効の場合は、常に未出力となります。
+ *
+ * @param key キー情報を識別するデータ (ラベル + クライアントランダムなど)
+ * @param len データの長さ
+ * @return true: 出力済み (出力不要) / false: 未出力
+ */
+static
+bool KeyLogDedup_seen(const void *key, size_t len)
+{
+    if (!atomic_load_explicit(&KeyLogDedup.enabled, memory_order_acquire))
+    {
+        return false;
+    }
+
+    uint64_t fingerprint = KeyLogDedup_fingerprint((const unsigned char *) key, len);
+    size_t home = (size_t) fingerprint & KeyLogDedup.mask;
+    for (size_t i = 0; i < KEYLOG_DEDUP_PROBES; i++)
+    {
+        _Atomic uint64_t *entry = &KeyLogDedup.entries[(home + i) & KeyLogDedup.mask];
+        uint64_t value = atomic_load_explicit(entry, memory_order_relaxed);
+        if (value == 0)
+        {   // 未使用のエントリ: 登録する。
+            // 他スレッドに先に登録された場合は、その値と比較する。
+            if (atomic_compare_exchange_strong_explicit(entry, &value, fingerprint,
+                    memory_order_relaxed, memory_order_relaxed))
+            {
+                return false;
+            }
+        }
+        if (value == fingerprint)
+        {
+            return true;
+        }
+    }
+
+    // 探索範囲が全て使用中: 先頭のエントリを上書きする。
+    atomic_store_explicit(&KeyLogDedup.entries[home], fingerprint, memory_order_relaxed);
+    return false;
+}
+
+/**
+ * キー情報のフィンガープリントを算出します。
+ *
+ * @param key キー情報を識別するデータ
+ * @param len データの長さ
+ * @return フィンガープリント (0 以外)
+ */
+static
+uint64_t KeyLogDedup_fingerprint(const unsigned char *key, size_t len)
+{
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= key[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    // テーブル位置の偏りを防ぐため、上位ビットを下位ビットに混ぜる。
+    hash ^= hash >> 32;
+    return (hash != 0) ? hash : 1;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// mmap 出力 (事前確保したファイルへのメモリマッピング)
+//
+// ファイルをチャンク単位で事前確保 (fallocate) してマッピングする。
+// キー情報を出力するスレッドは、atomic な fetch-add にて書き込み位置を予約し、
+// マッピング領域に memcpy するのみとなる。
+// チャンクの全バイトが書き込み完了となった時点で、そのチャンクはアンマップされる。
+// マッピング中のチャンクは KEYLOG_MMAP_SLOTS 個の領域で循環して管理する。
+// マッピングできなかったチャンクは、予約した位置に pwrite にて書き込み、同様に書き込み完了を記録する。
+// (書き込み完了とならないチャンクが領域を占有し、後続のチャンクが待ち続けることはない)
+//
+// ※ ファイル末尾は事前確保のため 0 で埋められた状態となり、
+//    プロセス終了時 (KeyLogFile_finalize) に使用済みサイズへ切り詰められる。
+//    そのため、複数プロセスから同一ファイルへの出力には利用できない。
+//
+
+static struct
+{
+    int fd;                             // マッピング用ファイルディスクリプタ (O_RDWR)
+    size_t chunk_size;                  // チャンクサイズ (ページサイズの倍数)
+    mtx_t mutex;                        // チャンクのマッピング処理用
+    atomic_bool enabled;                // mmap 出力モードが有効か否か
+    atomic_bool degraded;               // true: チャンクの解放待ちがタイムアウトしたため、以降は pwrite にて書き込む
+    KeyLogMmapChunk chunks[KEYLOG_MMAP_SLOTS];
+    size_t start;                       // 開始時のファイルサイズ
+    alignas(KEYLOG_CACHE_LINE_SIZE) atomic_size_t next;    // 次に予約する書き込み位置 (ファイル先頭からのオフセット)
+    atomic_size_t writers;              // 書き込み中のスレッド数 (next と同時に更新されるため、同じキャッシュラインに置く)
+} KeyLogMmap = { .fd = -1 };
+
+/**
+ * mmap 出力を開始します。
+ * 既存のファイル内容は保持し、ファイル末尾から追記します。
+ *
+ * @param name ファイル名
+ * @param chunk_size チャンクサイズ (ページサイズの倍数に切り上げられます)
+ * @return true: 開始成功 / false: 開始失敗
+ */
+static
+bool KeyLogMmap_start(const char *name, size_t chunk_size)
+{
+    size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+    if (chunk_size < page_size)
+    {
+        chunk_size = page_size;
+    }
+    KeyLogMmap.chunk_size = (chunk_size + page_size - 1) / page_size * page_size;
+
+    // マッピングには読み書き可能なファイルディスクリプタが必要なため、別途オープンする。
+    KeyLogMmap.fd = open(name, O_RDWR | O_CREAT, 0644);
+    if (KeyLogMmap.fd < 0)
+    {
+        return false;
+    }
+    struct stat st;
+    if (fstat(KeyLogMmap.fd, &st) != 0 || !S_ISREG(st.st_mode) || mtx_init(&KeyLogMmap.mutex, mtx_plain) != thrd_success)
+    {   // 通常ファイル以外 (FIFO など) はマッピングできない。
+        close(KeyLogMmap.fd);
+        KeyLogMmap.fd = -1;
+        return false;
+    }
+
+    for (size_t i = 0; i < KEYLOG_MMAP_SLOTS; i++)
+    {
+        atomic_init(&KeyLogMmap.chunks[i].index, SIZE_MAX);
+        atomic_init(&KeyLogMmap.chunks[i].base, 0);
+        atomic_init(&KeyLogMmap.chunks[i].committed, 0);
+    }
+    KeyLogMmap.start = (size_t) st.st_size;
+    atomic_init(&KeyLogMmap.next, KeyLogMmap.start);
+    atomic_init(&KeyLogMmap.writers, 0);
+    atomic_init(&KeyLogMmap.degraded, false);
+
+    // 最初のチャンクをマッピングしておく。(マッピングできない場合は、mmap 出力モードとしない)
+    size_t index = (size_t) st.st_size / KeyLogMmap.chunk_size;
+    KeyLogMmapChunk *chunk = KeyLogMmap_get_chunk(index);
+    if (chunk == NULL || atomic_load_explicit(&chunk->base, memory_order_relaxed) == 0)
+    {
+        mtx_destroy(&KeyLogMmap.mutex);
+        close(KeyLogMmap.fd);
+        KeyLogMmap.fd = -1;
+        return false;
+    }
+
+    atomic_store(&KeyLogMmap.enabled, true);
+    return true;
+}
+
+/**
+ * mmap 出力を停止します。
+ * 書き込み中のスレッドの完了を待ってから全チャンクをアンマップし、ファイルを使用済みサイズに切り詰めます。
+ * 以降のキー情報は同期出力となります。
+ *
+ * 書き込み中のスレッドが KEYLOG_MMAP_WAIT_MS 以内に完了しない場合 (停止したスレッドなど) は、
+ * そのスレッドが後から書き込めるよう、マッピング、ファイルディスクリプタ、ミューテックスは解放せず、
+ * 切り詰めのみ行います。
+ */
+static
+void KeyLogMmap_stop(void)
+{
+    if (!atomic_exchange(&KeyLogMmap.enabled, false))
+    {   // mmap 出力モードではない
+        return;
+    }
+
+    // 書き込み中のスレッドを待つ。(enabled を false にした後は、新たに書き込みを開始するスレッドはない)
+    size_t waited_ms = 0;
+    while (atomic_load(&KeyLogMmap.writers) != 0 && waited_ms < KEYLOG_MMAP_WAIT_MS)
+    {
+        thrd_sleep(&(struct timespec) { .tv_nsec = 1000000L }, NULL);
+        waited_ms++;
+    }
+
+    // 予約済みの位置は全て書き込み済み (または書き込み中) のため、使用済みサイズに切り詰める。
+    int ret = ftruncate(KeyLogMmap.fd, (off_t) atomic_load(&KeyLogMmap.next));
+    (void) ret;
+    if (atomic_load(&KeyLogMmap.writers) != 0)
+    {   // 書き込み中のスレッドが残っている: マッピングなどは解放しない。
+        return;
+    }
+
+    for (size_t i = 0; i < KEYLOG_MMAP_SLOTS; i++)
+    {
+        KeyLogMmapChunk *chunk = &KeyLogMmap.chunks[i];
+        if (atomic_exchange(&chunk->index, SIZE_MAX) != SIZE_MAX && atomic_load(&chunk->base) != 0)
+        {
+            munmap((void *) atomic_load(&chunk->base), KeyLogMmap.chunk_size);
+        }
+    }
+    close(KeyLogMmap.fd);
+    KeyLogMmap.fd = -1;
+    mtx_destroy(&KeyLogMmap.mutex);
+}
+
+/**
+ * fork 後の子プロセスにて呼び出され、子プロセスのファイルにマッピングし直します。
+ * 親プロセスのファイルは、親プロセスが切り詰めるため、アンマップのみ行います。
+ * (マッピングできない場合は、子プロセスのファイルへ同期出力する)
+ * 子プロセスには fork を呼び出したスレッドのみが存在するため、書き込み中のスレッドは待たない。
+ *
+ * @param name 子プロセスのファイル名
+ */
+static
+void KeyLogMmap_fork_child(const char *name)
+{
+    if (!atomic_exchange(&KeyLogMmap.enabled, false))
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < KEYLOG_MMAP_SLOTS; i++)
+    {
+        KeyLogMmapChunk *chunk = &KeyLogMmap.chunks[i];
+        if (atomic_exchange(&chunk->index, SIZE_MAX) != SIZE_MAX && atomic_load(&chunk->base) != 0)
+        {
+            munmap((void *) atomic_load(&chunk->base), KeyLogMmap.chunk_size);
+        }
+    }
+    close(KeyLogMmap.fd);
+    KeyLogMmap.fd = -1;
+    mtx_destroy(&KeyLogMmap.mutex);
+
+    KeyLogMmap_start(name, KeyLogMmap.chunk_size);
+}
+
+/**
+ * キー情報をマッピング領域にコピーします。
+ * 複数のバッファは、連続した 1 つの領域にまとめて書き込まれます。
+ * マッピングできなかったチャンク、およびチャンクの解放待ちがタイムアウトした以降は、
+ * 予約した位置に pwrite にて書き込みます。
+ *
+ * 書き込み中のスレッド数を enabled の確認前に加算するため (seq_cst)、KeyLogMmap_stop は
+ * 書き込み中のスレッドの完了を待ってからアンマップできる。
+ *
+ * @param iov 書き込むデータ
+ * @param iovcnt iov の要素数
+ * @return true: mmap 出力モードで処理した / false: mmap 出力モードではない
+ */
+static
+bool KeyLogMmap_writev(const struct iovec *iov, int iovcnt)
+{
+    atomic_fetch_add(&KeyLogMmap.writers, 1);
+    if (!atomic_load(&KeyLogMmap.enabled))
+    {
+        atomic_fetch_sub_explicit(&KeyLogMmap.writers, 1, memory_order_release);
+        return false;
+    }
+
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        len += iov[i].iov_len;
+    }
+
+    // 書き込み位置を予約する。
+    size_t offset = atomic_fetch_add_explicit(&KeyLogMmap.next, len, memory_order_relaxed);
+
+    // チャンク境界をまたぐ場合は分割してコピーする。
+    const char *src = (const char *) iov->iov_base;
+    size_t src_len = iov->iov_len;
+    while (len > 0)
+    {
+        size_t index = offset / KeyLogMmap.chunk_size;
+        size_t chunk_offset = offset % KeyLogMmap.chunk_size;
+        size_t chunk_len = KeyLogMmap.chunk_size - chunk_offset;
+        KeyLogMmapChunk *chunk = atomic_load_explicit(&KeyLogMmap.degraded, memory_order_relaxed)
+                ? NULL : KeyLogMmap_get_chunk(index);
+        char *base = (chunk != NULL) ? (char *) atomic_load_explicit(&chunk->base, memory_order_relaxed) : NULL;
+
+        size_t copied = 0;
+        while (copied < chunk_len && len > 0)
+        {
+            while (src_len == 0)
+            {
+                iov++;
+                src = (const char *) iov->iov_base;
+                src_len = iov->iov_len;
+            }
+            size_t n = (src_len < (chunk_len - copied)) ? src_len : (chunk_len - copied);
+            if (base != NULL)
+            {
+                memcpy(base + chunk_offset + copied, src, n);
+                KeyLogStats_add(KEYLOG_STATS_BYTES, n);
+            }
+            else
+            {   // マッピングなし: 予約した位置に直接書き込む。
+                KeyLogMmap_pwrite(src, n, offset + copied);
+            }
+            src += n;
+            src_len -= n;
+            copied += n;
+            len -= n;
+        }
+        if (chunk != NULL)
+        {   // マッピングできなかったチャンクも、書き込み完了として記録する。(全バイト完了で領域を解放する)
+            KeyLogMmap_commit(index, copied);
+        }
+        offset += copied;
+    }
+
+    atomic_fetch_sub_explicit(&KeyLogMmap.writers, 1, memory_order_release);
+    return true;
+}
+
+/**
+ * マッピングなしで、指定された位置にキー情報を書き込みます。
+ * シグナルによる中断 (EINTR) および部分書き込みの場合は、残りを書き込みます。
+ * (MAP_SHARED のマッピングとはページキャッシュを共有するため、マッピング中のチャンクと混在してもよい)
+ *
+ * @param buf 書き込むデータ
+ * @param len 書き込むデータのサイズ
+ * @param offset 書き込み位置 (ファイル先頭からのオフセット)
+ */
+static
+void KeyLogMmap_pwrite(const char *buf, size_t len, size_t offset)
+{
+    while (len > 0)
+    {
+        ssize_t written = pwrite(KeyLogMmap.fd, buf, len, (off_t) offset);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {   // シグナルにより中断されたため、再試行する。
+                continue;
+            }
+            KeyLogStats_add(KEYLOG_STATS_WRITE_ERRORS, 1);
+            return;
+        }
+        KeyLogStats_add(KEYLOG_STATS_BYTES, (uint64_t) written);
+        if ((size_t) written < len)
+        {
+            KeyLogStats_add(KEYLOG_STATS_SHORT_WRITES, 1);
+        }
+        buf += written;
+        len -= (size_t) written;
+        offset += (size_t) written;
+    }
+}
+
+/**
+ * 指定されたチャンクの領域を取得します。
+ * 未マッピングの場合は、ファイルを確保してマッピングします。
+ * ディスク容量不足などでマッピングできない場合は、マッピング先アドレスを 0 とした領域を返します。
+ * (各スレッドは pwrite にて書き込み、書き込み完了を記録するため、領域は全バイトの完了時に解放される)
+ *
+ * 循環先の領域に書き込み中の古いチャンクが残っている場合は、KEYLOG_MMAP_WAIT_MS まで解放を待ちます。
+ * タイムアウトした場合 (書き込み中に停止したスレッドなど) は、以降の書き込みを全て pwrite とし、NULL を返します。
+ *
+ * @param index チャンク番号
+ * @return チャンクの領域 (解放待ちのタイムアウト時 NULL)
+ */
+static
+KeyLogMmapChunk *KeyLogMmap_get_chunk(size_t index)
+{
+    KeyLogMmapChunk *chunk = &KeyLogMmap.chunks[index % KEYLOG_MMAP_SLOTS];
+    if (atomic_load_explicit(&chunk->index, memory_order_acquire) == index)
+    {   // マッピング済み (またはマッピング失敗済み)
+        return chunk;
+    }
+
+    KeyLogMmapChunk *result = NULL;
+    size_t waited_ms = 0;
+    mtx_lock(&KeyLogMmap.mutex);
+    for (;;)
+    {
+        size_t current = atomic_load_explicit(&chunk->index, memory_order_acquire);
+        if (current == index)
+        {   // 他スレッドがマッピング済み
+            result = chunk;
+            break;
+        }
+        if (current == SIZE_MAX)
+        {   // 空き領域: マッピングする。
+            off_t offset = (off_t) (index * KeyLogMmap.chunk_size);
+            void *addr = MAP_FAILED;
+            if (fallocate(KeyLogMmap.fd, 0, offset, (off_t) KeyLogMmap.chunk_size) == 0
+                    || (errno == EOPNOTSUPP && ftruncate(KeyLogMmap.fd, offset + (off_t) KeyLogMmap.chunk_size) == 0))
+            {   // fallocate 未対応のファイルシステムの場合のみ、ftruncate にて拡張する。
+                // (容量不足 (ENOSPC) の場合に拡張すると、確保されていないページへの書き込みで SIGBUS となる)
+                addr = mmap(NULL, KeyLogMmap.chunk_size, PROT_READ | PROT_WRITE, MAP_SHARED, KeyLogMmap.fd, offset);
+            }
+            if (addr == MAP_FAILED)
+            {   // マッピング失敗: 以降、このチャンクの書き込みは pwrite とする。(再試行しない)
+                addr = NULL;
+            }
+
+            // 開始時のファイル内容と重なる領域は、書き込み完了済みとして扱う。
+            size_t committed = 0;
+            if (KeyLogMmap.start > (size_t) offset)
+            {
+                committed = KeyLogMmap.start - (size_t) offset;
+            }
+            atomic_store_explicit(&chunk->base, (uintptr_t) addr, memory_order_relaxed);
+            atomic_store_explicit(&chunk->committed, committed, memory_order_relaxed);
+            atomic_store_explicit(&chunk->index, index, memory_order_release);
+            result = chunk;
+            break;
+        }
+
+        // 循環先の領域に、まだ書き込み中の古いチャンクが残っている: 完了を待つ。
+        if (waited_ms >= KEYLOG_MMAP_WAIT_MS)
+        {   // 古いチャンクは解放できないため、以降の書き込みはマッピングを使わない。
+            atomic_store_explicit(&KeyLogMmap.degraded, true, memory_order_relaxed);
+            break;
+        }
+        mtx_unlock(&KeyLogMmap.mutex);
+        thrd_sleep(&(struct timespec) { .tv_nsec = 1000000L }, NULL);
+        waited_ms++;
+        mtx_lock(&KeyLogMmap.mutex);
+    }
+    mtx_unlock(&KeyLogMmap.mutex);
+    return result;
+}
+
+/**
+ * 指定されたチャンクへの書き込み完了を記録します。
+ * チャンクの全バイトが書き込み完了となった場合、チャンクをアンマップし、領域を解放します。
+ *
+ * @param index チャンク番号
+ * @param len 書き込み完了したバイト数
+ */
+static
+void KeyLogMmap_commit(size_t index, size_t len)
+{
+    KeyLogMmapChunk *chunk = &KeyLogMmap.chunks[index % KEYLOG_MMAP_SLOTS];
+    size_t committed = atomic_fetch_add_explicit(&chunk->committed, len, memory_order_acq_rel) + len;
+    if (committed == KeyLogMmap.chunk_size)
+    {   // 全バイト書き込み完了: 以降、このチャンクにアクセスするスレッドは存在しない。
+        void *addr = (void *) atomic_load_explicit(&chunk->base, memory_order_relaxed);
+        mtx_lock(&KeyLogMmap.mutex);
+        atomic_store_explicit(&chunk->index, SIZE_MAX, memory_order_release);
+        mtx_unlock(&KeyLogMmap.mutex);
+        if (addr != NULL)
+        {
+            munmap(addr, KeyLogMmap.chunk_size);
+        }
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 統計情報
+//
+// キー情報を出力するスレッド毎に、キャッシュライン単位で確保したカウンタを持ち、
+// 所有スレッドのみが更新する。(ロック、atomic な read-modify-write は不要)
+// 取得時 (sslkeylog_get_stats、ファイル出力) に、全スレッドのカウンタを集計する。
+// 終了したスレッドのカウンタは、tss のデストラクタにて集計済みの値に加算してから解放する。
+// 破棄数は、非同期出力・ソケット出力の破棄数 (共有カウンタ) を集計時に加算する。
+//
+// SSLKEYLOG_STATS にファイル名が指定された場合、プロセス終了時および SIGUSR1 受信時に
+// 統計情報スレッドがファイルに出力する。(シグナルハンドラでは、スレッドを起こすのみ)
+// ファイルは一時ファイルに出力してからリネームするため、読み込み途中の内容が変わることはない。
+//
+
+static struct
+{
+    atomic_bool enabled;                // 統計情報の収集が有効か否か
+    bool timing;                        // 出力に要した時間を計測するか否か
+    char name[PATH_MAX];                // 出力先ファイル名 (空: ファイル出力なし)
+    tss_t key;                          // スレッド終了検知用
+    mtx_t mutex;                        // list, retired の保護用
+    KeyLogStatsCounters *list;          // 登録済みカウンタのリスト
+    uint64_t retired[KEYLOG_STATS_COUNT];   // 終了したスレッドのカウンタの合計
+    struct sigaction old_action;        // SIGUSR1 の元のハンドラ
+    sem_t wakeup;                       // 統計情報スレッド起床用 (シグナルハンドラから利用可能)
+    atomic_bool running;                // 統計情報スレッドが動作中か否か
+    thrd_t thread;                      // 統計情報スレッド
+} KeyLogStats;
+
+static thread_local KeyLogStatsCounters *KeyLogStats_self = NULL;
+
+// ファイル出力時の項目名 (SslKeyLogStats の項目順)
+static const char *const KeyLogStats_names[] = {
+    "secrets", "filtered", "dedup_hits", "lines", "bytes", "short_writes", "write_errors", "drops",
+};
+
+/**
+ * 統計情報を取得します。(公開関数。sslkeylog-stats.h を参照)
+ * キーログファイル管理の初期化前は、全て 0 となります。
+ *
+ * @param stats 統計情報の格納先
+ * @param size 格納先のサイズ
+ * @return 格納したサイズ
+ */
+size_t sslkeylog_get_stats(SslKeyLogStats *stats, size_t size)
+{
+    if (stats == NULL)
+    {
+        return 0;
+    }
+    uint64_t values[KEYLOG_STATS_COUNT];
+    KeyLogStats_collect(values);
+
+    SslKeyLogStats result;
+    memcpy(&result, values, sizeof(result));
+    if (size > sizeof(result))
+    {
+        size = sizeof(result);
+    }
+    memcpy(stats, &result, size);
+    return size;
+}
+
+/**
+ * 統計情報の収集を開始します。
+ *
+ * @param name 統計情報の出力先ファイル名 (SSLKEYLOG_STATS。%p などの変換指定可。NULL: ファイル出力なし)
+ */
+static
+void KeyLogStats_start(const char *name)
+{
+    if (tss_create(&KeyLogStats.key, KeyLogStats_thread_exit) != thrd_success)
+    {
+        return;
+    }
+    if (mtx_init(&KeyLogStats.mutex, mtx_plain) != thrd_success)
+    {
+        tss_delete(KeyLogStats.key);
+        return;
+    }
+
+    if (name != NULL && *name != '\0' && KeyLogFile_expand_name(KeyLogStats.name, sizeof(KeyLogStats.name), name, 0, 0)
+            && sem_init(&KeyLogStats.wakeup, 0, 0) == 0)
+    {   // ファイル出力、および出力に要した時間の計測
+        KeyLogStats.timing = true;
+        atomic_store(&KeyLogStats.running, true);
+        if (KeyLogFile_start_thread(&KeyLogStats.thread, KeyLogStats_thread))
+        {   // 元のハンドラは KeyLogStats_sigusr1 から呼び出す。
+            KeyLogFile_set_signal(SIGUSR1, KeyLogStats_sigusr1, &KeyLogStats.old_action);
+        }
+        else
+        {   // SIGUSR1 による出力は行わず、プロセス終了時のみ出力する。
+            atomic_store(&KeyLogStats.running, false);
+            sem_destroy(&KeyLogStats.wakeup);
+        }
+    }
+    atomic_store(&KeyLogStats.enabled, true);
+}
+
+/**
+ * 統計情報スレッドを停止し、統計情報をファイルに出力します。
+ * (他のスレッドが出力を続ける可能性があるため、収集は停止しない)
+ */
+static
+void KeyLogStats_stop(void)
+{
+    if (atomic_exchange(&KeyLogStats.running, false))
+    {
+        sem_post(&KeyLogStats.wakeup);
+        thrd_join(KeyLogStats.thread, NULL);
+    }
+    if (KeyLogStats.name[0] != '\0')
+    {
+        KeyLogStats_dump();
+    }
+}
+
+/**
+ * fork 後の子プロセスにて呼び出され、カウンタを 0 に戻し、統計情報スレッドを再開します。
+ * (子プロセスの統計情報には、親プロセスでの出力を含めない)
+ */
+static
+void KeyLogStats_fork_child(void)
+{
+    if (!atomic_load(&KeyLogStats.enabled))
+    {
+        return;
+    }
+    for (KeyLogStatsCounters *counters = KeyLogStats.list; counters != NULL; counters = counters->next)
+    {
+        for (size_t i = 0; i < KEYLOG_STATS_COUNT; i++)
+        {
+            atomic_store_explicit(&counters->values[i], 0, memory_order_relaxed);
+        }
+    }
+    memset(KeyLogStats.retired, 0, sizeof(KeyLogStats.retired));
+
+    // %p などの変換指定を、子プロセスで展開し直す。
+    const char *name = getenv("SSLKEYLOG_STATS");
+    if (KeyLogStats.name[0] != '\0' && name != NULL)
+    {
+        KeyLogFile_expand_name(KeyLogStats.name, sizeof(KeyLogStats.name), name, 0, 0);
+    }
+    if (atomic_load(&KeyLogStats.running))
+    {
+        sem_destroy(&KeyLogStats.wakeup);
+        if (sem_init(&KeyLogStats.wakeup, 0, 0) != 0
+                || !KeyLogFile_start_thread(&KeyLogStats.thread, KeyLogStats_thread))
+        {   // SIGUSR1 による出力は行わず、プロセス終了時のみ出力する。
+            atomic_store(&KeyLogStats.running, false);
+        }
+    }
+}
+
+/**
+ * 呼び出し元スレッドのカウンタに加算します。
+ *
+ * @param counter カウンタ番号 (KEYLOG_STATS_*)
+ * @param value 加算する値
+ */
+static
+void KeyLogStats_add(size_t counter, uint64_t value)
+{
+    KeyLogStatsCounters *counters = KeyLogStats_self;
+    if (counters == NULL)
+    {
+        counters = KeyLogStats_get_counters();
+        if (counters == NULL)
+        {
+            return;
+        }
+    }
+    // 所有スレッドのみが更新するため、読み込みと書き込みを分けてよい。(集計スレッドは読み込みのみ)
+    _Atomic uint64_t *p = &counters->values[counter];
+    atomic_store_explicit(p, atomic_load_explicit(p, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+/**
+ * 出力に要した時間の計測を開始します。
+ *
+ * @return 開始時刻 [ns] (計測しない場合 0)
+ */
+static
+uint64_t KeyLogStats_timer_start(void)
+{
+    if (!KeyLogStats.timing)
+    {
+        return 0;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+/**
+ * 出力に要した時間の計測を終了し、ヒストグラムに記録します。
+ *
+ * @param start 開始時刻 [ns] (KeyLogStats_timer_start の戻り値。0 の場合は何もしない)
+ */
+static
+void KeyLogStats_timer_stop(uint64_t start)
+{
+    if (start == 0)
+    {
+        return;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t us = ((uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec - start) / 1000;
+
+    // バケット i は 2^i [us] 未満
+    size_t bucket = (us == 0) ? 0 : (size_t) (64 - __builtin_clzll(us));
+    if (bucket >= SSLKEYLOG_STATS_LATENCY_BUCKETS)
+    {
+        bucket = SSLKEYLOG_STATS_LATENCY_BUCKETS - 1;
+    }
+    KeyLogStats_add(KEYLOG_STATS_LATENCY + bucket, 1);
+}
+
+/**
+ * 全スレッドのカウンタを集計します。
+ *
+ * @param values 集計結果の格納先 (KEYLOG_STATS_COUNT 個)
+ */
+static
+void KeyLogStats_collect(uint64_t *values)
+{
+    memset(values, 0, KEYLOG_STATS_COUNT * sizeof(uint64_t));
+    if (!atomic_load_explicit(&KeyLogStats.enabled, memory_order_acquire))
+    {
+        return;
+    }
+
+    mtx_lock(&KeyLogStats.mutex);
+    memcpy(values, KeyLogStats.retired, sizeof(KeyLogStats.retired));
+    for (KeyLogStatsCounters *counters = KeyLogStats.list; counters != NULL; counters = counters->next)
+    {
+        for (size_t i = 0; i < KEYLOG_STATS_COUNT; i++)
+        {
+            values[i] += atomic_load_explicit(&counters->values[i], memory_order_relaxed);
+        }
+    }
+    mtx_unlock(&KeyLogStats.mutex);
+
+    values[KEYLOG_STATS_DROPS] += atomic_load(&KeyLogAsync.dropped) + atomic_load(&KeyLogSocket.dropped);
+}
+
+/**
+ * 呼び出し元スレッドのカウンタを取得します。
+ * 初回呼び出し時に、カウンタを確保して登録します。
+ *
+ * @return カウンタ (統計情報の収集が無効、または確保できない場合 NULL)
+ */
+static
+KeyLogStatsCounters *KeyLogStats_get_counters(void)
+{
+    if (!atomic_load_explicit(&KeyLogStats.enabled, memory_order_acquire))
+    {
+        return NULL;
+    }
+
+    // 他スレッドのカウンタと同じキャッシュラインにならないよう、キャッシュライン単位で確保する。
+    size_t size = (sizeof(KeyLogStatsCounters) + KEYLOG_CACHE_LINE_SIZE - 1) / KEYLOG_CACHE_LINE_SIZE * KEYLOG_CACHE_LINE_SIZE;
+    KeyLogStatsCounters *counters = (KeyLogStatsCounters *) aligned_alloc(KEYLOG_CACHE_LINE_SIZE, size);
+    if (counters == NULL)
+    {
+        return NULL;
+    }
+    for (size_t i = 0; i < KEYLOG_STATS_COUNT; i++)
+    {
+        atomic_init(&counters->values[i], 0);
+    }
+
+    mtx_lock(&KeyLogStats.mutex);
+    counters->next = KeyLogStats.list;
+    KeyLogStats.list = counters;
+    mtx_unlock(&KeyLogStats.mutex);
+
+    // スレッド終了時に、KeyLogStats_thread_exit が呼び出されるよう登録する。
+    tss_set(KeyLogStats.key, counters);
+    KeyLogStats_self = counters;
+    return counters;
+}
+
+/**
+ * スレッド終了時に呼び出されます。
+ * 終了するスレッドのカウンタを集計済みの値に加算し、カウンタを解放します。
+ *
+ * @param arg 終了するスレッドのカウンタ
+ */
+static
+void KeyLogStats_thread_exit(void *arg)
+{
+    KeyLogStatsCounters *counters = (KeyLogStatsCounters *) arg;
+
+    mtx_lock(&KeyLogStats.mutex);
+    for (KeyLogStatsCounters **p = &KeyLogStats.list; *p != NULL; p = &(*p)->next)
+    {
+        if (*p == counters)
+        {
+            *p = counters->next;
+            break;
+        }
+    }
+    for (size_t i = 0; i < KEYLOG_STATS_COUNT; i++)
+    {
+        KeyLogStats.retired[i] += atomic_load_explicit(&counters->values[i], memory_order_relaxed);
+    }
+    mtx_unlock(&KeyLogStats.mutex);
+
+    KeyLogStats_self = NULL;
+    free(counters);
+}
+
+/**
+ * 統計情報をファイルに出力します。
+ * "<項目名>: <値>" の形式で 1 行ずつ出力し、書き込み時間は "write_latency_us_lt_<上限>" とします。
+ * (最後のバケットは "write_latency_us_ge_<下限>")
+ */
+static
+void KeyLogStats_dump(void)
+{
+    uint64_t values[KEYLOG_STATS_COUNT];
+    KeyLogStats_collect(values);
+
+    char buf[2048];
+    size_t len = (size_t) snprintf(buf, sizeof(buf), "pid: %ld\n", (long) getpid());
+    for (size_t i = 0; i < KEYLOG_STATS_LATENCY; i++)
+    {
+        len += (size_t) snprintf(buf + len, sizeof(buf) - len, "%s: %" PRIu64 "\n", KeyLogStats_names[i], values[i]);
+    }
+    for (size_t i = 0; i < SSLKEYLOG_STATS_LATENCY_BUCKETS; i++)
+    {
+        bool last = ((i + 1) == SSLKEYLOG_STATS_LATENCY_BUCKETS);
+        len += (size_t) snprintf(buf + len, sizeof(buf) - len, "write_latency_us_%s_%lu: %" PRIu64 "\n",
+                last ? "ge" : "lt", 1UL << (last ? (i - 1) : i), values[KEYLOG_STATS_LATENCY + i]);
+    }
+    len += (size_t) snprintf(buf + len, sizeof(buf) - len, "quic_secrets: %" PRIu64 "\n", values[KEYLOG_STATS_QUIC_SECRETS]);
+    len += (size_t) snprintf(buf + len, sizeof(buf) - len, "config_errors: %" PRIu64 "\n", values[KEYLOG_STATS_CONFIG_ERRORS]);
+
+    // 統計情報自体の書き込みは、統計情報に含めない。(KeyLogFile_write_all は利用しない)
+    char tmp[PATH_MAX + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", KeyLogStats.name);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        return;
+    }
+    bool written = (write(fd, buf, len) == (ssize_t) len);
+    close(fd);
+    if (!written || rename(tmp, KeyLogStats.name) != 0)
+    {
+        unlink(tmp);
+    }
+}
+
+/**
+ * SIGUSR1 のシグナルハンドラ。
+ * 統計情報スレッドにファイル出力を要求し、元のハンドラを呼び出します。
+ *
+ * @param sig シグナル番号
+ * @param info シグナル情報
+ * @param context コンテキスト
+ */
+static
+void KeyLogStats_sigusr1(int sig, siginfo_t *info, void *context)
+{
+    int saved_errno = errno;
+    sem_post(&KeyLogStats.wakeup);
+    errno = saved_errno;
+    KeyLogFile_chain_signal(&KeyLogStats.old_action, sig, info, context);
+}
+
+/**
+ * 統計情報スレッド。
+ * SIGUSR1 を受信する毎に、統計情報をファイルに出力します。
+ *
+ * @param arg 未使用
+ * @return 0 固定
+ */
+static
+int KeyLogStats_thread(void *arg)
+{
+    (void) arg;
+    for (;;)
+    {
+        sem_wait(&KeyLogStats.wakeup);
+        if (!atomic_load(&KeyLogStats.running))
+        {
+            break;
+        }
+        KeyLogStats_dump();
+    }
+    return 0;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// ハンドシェイクのトレース
+//
+// SSLKEYLOG_TRACE にファイル名が指定された場合、ハンドシェイク関数 (SSL_connect, SSL_accept,
+// SSL_do_handshake) の呼び出し毎に開始時刻・所要時間・戻り値を、キー情報の生成毎にラベルと時刻を記録し、
+// Chrome のトレース形式 (JSON Array Format) で出力する。
+// chrome://tracing や Perfetto UI にそのまま読み込むことができ、接続 (args.ssl: SSL オブジェクトのアドレス)
+// 毎に、ハンドシェイクの所要時間と、各キー情報が生成されるまでの時間を確認できる。
+//
+// レコードはスレッド毎のバッファに蓄積し、以下のいずれかの契機で 1 回の write でまとめて出力する。
+// (バッファには完全なレコードのみ格納されるため、レコードが分割して出力されることはない)
+//   - バッファが一杯になった時 (レコードを記録したスレッドにて出力)
+//   - スレッド終了時 (tss のデストラクタにて出力)
+//   - プロセス終了時 (KeyLogFile_finalize にて出力)
+// 時刻は CLOCK_MONOTONIC [us] とする。
+// ファイルが空の場合のみ先頭に "[" を出力し、末尾の "]" は出力しない。(トレース形式では省略可能)
+//
+
+static struct
+{
+    atomic_bool enabled;                // トレースが有効か否か
+    int fd;                             // 出力先ファイルディスクリプタ
+    long pid;                           // プロセスID
+    tss_t key;                          // スレッド終了検知用
+    mtx_t mutex;                        // 登録済みバッファのリスト保護用
+    KeyLogTraceBuffer *list;            // 登録済みバッファのリスト
+} KeyLogTrace;
+
+static thread_local KeyLogTraceBuffer *KeyLogTrace_self = NULL;
+
+/**
+ * トレースを開始します。
+ * ファイルを開けない場合は、トレースしません。
+ *
+ * @param name 出力先ファイル名 (SSLKEYLOG_TRACE。%p などの変換指定可。NULL: トレースしない)
+ */
+static
+void KeyLogTrace_start(const char *name)
+{
+    char path[PATH_MAX];
+    if (SSL_connect_traced == NULL || name == NULL || *name == '\0'
+            || !KeyLogFile_expand_name(path, sizeof(path), name, 0, 0))
+    {
+        return;
+    }
+    if (tss_create(&KeyLogTrace.key, KeyLogTrace_thread_exit) != thrd_success)
+    {
+        return;
+    }
+    if (mtx_init(&KeyLogTrace.mutex, mtx_plain) != thrd_success)
+    {
+        goto error_tss;
+    }
+    KeyLogTrace.fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (KeyLogTrace.fd < 0)
+    {
+        goto error_mutex;
+    }
+
+    struct stat st;
+    if (fstat(KeyLogTrace.fd, &st) == 0 && st.st_size == 0 && write(KeyLogTrace.fd, "[\n", 2) != 2)
+    {
+        goto error_fd;
+    }
+    KeyLogTrace.pid = (long) getpid();
+    KeyLogTrace.list = NULL;
+    atomic_store(&KeyLogTrace.enabled, true);
+    return;
+
+error_fd:
+    close(KeyLogTrace.fd);
+error_mutex:
+    mtx_destroy(&KeyLogTrace.mutex);
+error_tss:
+    tss_delete(KeyLogTrace.key);
+}
+
+/**
+ * トレースを停止します。
+ * 全スレッドのバッファに残っているレコードを出力し、ファイルを閉じます。
+ * (バッファは各スレッドの終了時に解放される)
+ */
+static
+void KeyLogTrace_stop(void)
+{
+    if (!atomic_exchange(&KeyLogTrace.enabled, false))
+    {   // トレースしていない
+        return;
+    }
+
+    mtx_lock(&KeyLogTrace.mutex);
+    for (KeyLogTraceBuffer *buffer = KeyLogTrace.list; buffer != NULL; buffer = buffer->next)
+    {
+        while (atomic_flag_test_and_set_explicit(&buffer->lock, memory_order_acquire))
+        {
+            thrd_yield();
+        }
+        KeyLogTrace_flush(buffer);
+        atomic_flag_clear_explicit(&buffer->lock, memory_order_release);
+    }
+    int fd = KeyLogTrace.fd;
+    KeyLogTrace.fd = -1;
+    mtx_unlock(&KeyLogTrace.mutex);
+    close(fd);
+}
+
+/**
+ * トレース用の現在時刻を取得します。
+ *
+ * @return 現在時刻 (CLOCK_MONOTONIC [ns]。トレースしない場合 0)
+ */
+static
+uint64_t KeyLogTrace_now(void)
+{
+    if (!atomic_load_explicit(&KeyLogTrace.enabled, memory_order_relaxed))
+    {
+        return 0;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+/**
+ * ハンドシェイク関数の呼び出しを、所要時間付きのイベント ("ph":"X") として記録します。
+ *
+ * @param ssl SSL オブジェクト
+ * @param name 関数名
+ * @param start 開始時刻 (KeyLogTrace_now の戻り値。0 の場合は何もしない)
+ * @param ret ハンドシェイク関数の戻り値
+ */
+static
+void KeyLogTrace_handshake(const SSL *ssl, const char *name, uint64_t start, int ret)
+{
+    uint64_t end = KeyLogTrace_now();
+    if (start == 0 || end == 0)
+    {
+        return;
+    }
+    KeyLogTraceBuffer *buffer = KeyLogTrace_get_buffer();
+    if (buffer == NULL)
+    {
+        return;
+    }
+    uint64_t dur = end - start;
+
+    char record[KEYLOG_TRACE_RECORD_MAX];
+    int len = snprintf(record, sizeof(record),
+            "{\"name\":\"%s\",\"cat\":\"handshake\",\"ph\":\"X\",\"ts\":%" PRIu64 ".%03u,\"dur\":%" PRIu64 ".%03u,"
+            "\"pid\":%ld,\"tid\":%ld,\"args\":{\"ssl\":\"%p\",\"ret\":%d}},\n",
+            name, start / 1000, (unsigned int) (start % 1000), dur / 1000, (unsigned int) (dur % 1000),
+            KeyLogTrace.pid, buffer->tid, (const void *) ssl, ret);
+    if (len > 0 && (size_t) len < sizeof(record))
+    {
+        KeyLogTrace_append(buffer, record, (size_t) len);
+    }
+}
+
+/**
+ * キー情報の生成を、瞬間イベント ("ph":"i") として記録します。
+ *
+ * @param ssl SSL オブジェクト
+ * @param label キー情報のラベル (NUL 終端でなくてもよい)
+ * @param label_len ラベルの長さ
+ */
+static
+void KeyLogTrace_secret(const SSL *ssl, const char *label, size_t label_len)
+{
+    uint64_t now = KeyLogTrace_now();
+    KeyLogTraceBuffer *buffer = (now != 0) ? KeyLogTrace_get_buffer() : NULL;
+    if (buffer == NULL)
+    {
+        return;
+    }
+    if (label_len > 64)
+    {
+        label_len = 64;
+    }
+
+    char record[KEYLOG_TRACE_RECORD_MAX];
+    int len = snprintf(record, sizeof(record),
+            "{\"name\":\"%.*s\",\"cat\":\"keylog\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%" PRIu64 ".%03u,"
+            "\"pid\":%ld,\"tid\":%ld,\"args\":{\"ssl\":\"%p\"}},\n",
+            (int) label_len, label, now / 1000, (unsigned int) (now % 1000), KeyLogTrace.pid, buffer->tid,
+            (const void *) ssl);
+    if (len > 0 && (size_t) len < sizeof(record))
+    {
+        KeyLogTrace_append(buffer, record, (size_t) len);
+    }
+}
+
+/**
+ * 呼び出し元スレッドのバッファにレコードを追加します。
+ * バッファに収まらない場合は、バッファの内容を出力してから追加します。
+ *
+ * @param buffer 呼び出し元スレッドのバッファ
+ * @param record レコード
+ * @param len レコードの長さ (KEYLOG_TRACE_RECORD_MAX 未満)
+ */
+static
+void KeyLogTrace_append(KeyLogTraceBuffer *buffer, const char *record, size_t len)
+{
+    // 終了処理が出力中の場合は、完了を待つ。
+    while (atomic_flag_test_and_set_explicit(&buffer->lock, memory_order_acquire))
+    {
+        thrd_yield();
+    }
+    if ((buffer->used + len) > sizeof(buffer->data))
+    {
+        KeyLogTrace_flush(buffer);
+    }
+    memcpy(buffer->data + buffer->used, record, len);
+    buffer->used += len;
+    atomic_flag_clear_explicit(&buffer->lock, memory_order_release);
+}
+
+/**
+ * 呼び出し元スレッドのバッファを取得します。
+ * 初回呼び出し時に、バッファを確保して登録します。
+ *
+ * @return バッファ (確保できない場合 NULL)
+ */
+static
+KeyLogTraceBuffer *KeyLogTrace_get_buffer(void)
+{
+    KeyLogTraceBuffer *buffer = KeyLogTrace_self;
+    if (buffer != NULL)
+    {
+        return buffer;
+    }
+
+    buffer = (KeyLogTraceBuffer *) malloc(sizeof(KeyLogTraceBuffer));
+    if (buffer == NULL)
+    {
+        return NULL;
+    }
+    atomic_flag_clear(&buffer->lock);
+    buffer->tid = (long) gettid();
+    buffer->used = 0;
+
+    mtx_lock(&KeyLogTrace.mutex);
+    buffer->next = KeyLogTrace.list;
+    KeyLogTrace.list = buffer;
+    mtx_unlock(&KeyLogTrace.mutex);
+
+    // スレッド終了時に、KeyLogTrace_thread_exit が呼び出されるよう登録する。
+    tss_set(KeyLogTrace.key, buffer);
+    KeyLogTrace_self = buffer;
+    return buffer;
+}
+
+/**
+ * 指定されたバッファの内容を出力します。
+ * 呼び出し元でバッファをロックしている必要があります。
+ * (トレース自体の書き込みは、統計情報に含めない。KeyLogFile_write_all は利用しない)
+ *
+ * @param buffer バッファ
+ */
+static
+void KeyLogTrace_flush(KeyLogTraceBuffer *buffer)
+{
+    size_t written = 0;
+    while (written < buffer->used && KeyLogTrace.fd >= 0)
+    {
+        ssize_t ret = write(KeyLogTrace.fd, buffer->data + written, buffer->used - written);
+        if (ret < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (ret <= 0)
+        {   // 書き込みエラー: 残りは破棄する。
+            break;
+        }
+        written += (size_t) ret;
+    }
+    buffer->used = 0;
+}
+
+/**
+ * スレッド終了時に呼び出されます。
+ * 終了するスレッドのバッファの内容を出力し、バッファを解放します。
+ *
+ * @param arg 終了するスレッドのバッファ
+ */
+static
+void KeyLogTrace_thread_exit(void *arg)
+{
+    KeyLogTraceBuffer *buffer = (KeyLogTraceBuffer *) arg;
+
+    mtx_lock(&KeyLogTrace.mutex);
+    for (KeyLogTraceBuffer **p = &KeyLogTrace.list; *p != NULL; p = &(*p)->next)
+    {
+        if (*p == buffer)
+        {
+            *p = buffer->next;
+            break;
+        }
+    }
+    // リストから外したため、他スレッドからは参照されない。(ファイルを閉じないよう、ロック中に出力する)
+    KeyLogTrace_flush(buffer);
+    mtx_unlock(&KeyLogTrace.mutex);
+
+    KeyLogTrace_self = NULL;
+    free(buffer);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// ディスクへの同期 (SSLKEYLOG_SYNC)
+//
+// 出力したキー情報を fdatasync にてディスクに同期する。
+// 同期はハンドシェイクを行うスレッドでは行わず、以下のバックグラウンドのスレッドで行う。
+//   batch   : 非同期出力モードの書き込みスレッド、バッチ出力モードのフラッシュスレッドが、
+//             まとめて出力する毎に同期する。(それらのスレッドがない場合は、KEYLOG_SYNC_DEFAULT_MS 毎)
+//   <N>     : 同期スレッドが N [ms] 毎に同期する。
+//             書き込みバイト数 (統計情報) が前回の同期から増えていない場合は同期しない。
+// ソケット出力モード、FIFO では同期しない。
+//
+
+static struct
+{
+    int policy;                         // 同期ポリシー (KEYLOG_SYNC_*)
+    size_t interval_ms;                 // 同期スレッドの同期間隔 [ms]
+    uint64_t synced_bytes;              // 前回同期した時点の書き込みバイト数
+    bool running;                       // 同期スレッドが動作中か否か
+    thrd_t thread;
+    mtx_t mutex;
+    cnd_t cond;
+} KeyLogSync = { .policy = KEYLOG_SYNC_NONE };
+
+/**
+ * 同期ポリシーを解析します。
+ *
+ * @param value 同期ポリシー ("none", "batch", または同期間隔 [ms]。NULL の場合 "none")
+ * @param interval_ms 同期間隔 [ms] の格納先 (KEYLOG_SYNC_PERIODIC の場合のみ設定)
+ * @return 同期ポリシー (KEYLOG_SYNC_*。解釈できない場合 KEYLOG_SYNC_NONE)
+ */
+static
+int KeyLogSync_parse(const char *value, size_t *interval_ms)
+{
+    if (value == NULL || *value == '\0' || strcasecmp(value, "none") == 0)
+    {
+        return KEYLOG_SYNC_NONE;
+    }
+    if (strcasecmp(value, "batch") == 0)
+    {
+        return KEYLOG_SYNC_BATCH;
+    }
+
+    char *endptr = NULL;
+    unsigned long long result = strtoull(value, &endptr, 10);
+    if (*endptr != '\0' || result == 0)
+    {   // 数値以外が含まれる、または 0
+        return KEYLOG_SYNC_NONE;
+    }
+    *interval_ms = (size_t) result;
+    return KEYLOG_SYNC_PERIODIC;
+}
+
+/**
+ * 同期を開始します。
+ * 同期ポリシーが batch で、まとめて出力するスレッドがない場合は、KEYLOG_SYNC_DEFAULT_MS 毎に同期します。
+ *
+ * @param value 同期ポリシー (環境変数 SSLKEYLOG_SYNC の値)
+ * @param batch_writer 書き込みスレッド、またはフラッシュスレッドが動作しているか否か
+ */
+static
+void KeyLogSync_start(const char *value, bool batch_writer)
+{
+    size_t interval_ms = KEYLOG_SYNC_DEFAULT_MS;
+    int policy = KeyLogSync_parse(value, &interval_ms);
+    if (policy == KEYLOG_SYNC_BATCH && !batch_writer)
+    {
+        policy = KEYLOG_SYNC_PERIODIC;
+    }
+    if (policy != KEYLOG_SYNC_PERIODIC)
+    {
+        KeyLogSync.policy = policy;
+        return;
+    }
+
+    KeyLogSync.interval_ms = interval_ms;
+    KeyLogSync.synced_bytes = 0;
+    if (mtx_init(&KeyLogSync.mutex, mtx_plain) != thrd_success)
+    {
+        return;
+    }
+    if (cnd_init(&KeyLogSync.cond) != thrd_success)
+    {
+        mtx_destroy(&KeyLogSync.mutex);
+        return;
+    }
+    KeyLogSync.running = true;
+    if (!KeyLogFile_start_thread(&KeyLogSync.thread, KeyLogSync_thread))
+    {
+        KeyLogSync.running = false;
+        cnd_destroy(&KeyLogSync.cond);
+        mtx_destroy(&KeyLogSync.mutex);
+        return;
+    }
+    KeyLogSync.policy = policy;
+}
+
+/**
+ * 同期を停止します。
+ * 同期スレッドを停止し、最後に 1 回同期します。
+ * (各出力モードの停止後、ファイルを閉じる前に呼び出すこと)
+ */
+static
+void KeyLogSync_stop(void)
+{
+    int policy = KeyLogSync.policy;
+    KeyLogSync.policy = KEYLOG_SYNC_NONE;
+    if (policy == KEYLOG_SYNC_NONE)
+    {
+        return;
+    }
+
+    if (policy == KEYLOG_SYNC_PERIODIC)
+    {
+        mtx_lock(&KeyLogSync.mutex);
+        bool running = KeyLogSync.running;
+        KeyLogSync.running = false;
+        cnd_signal(&KeyLogSync.cond);
+        mtx_unlock(&KeyLogSync.mutex);
+        if (running)
+        {
+            thrd_join(KeyLogSync.thread, NULL);
+        }
+        cnd_destroy(&KeyLogSync.cond);
+        mtx_destroy(&KeyLogSync.mutex);
+    }
+    KeyLogSync_all();
+}
+
+/**
+ * まとめて出力した後に呼び出され、同期ポリシーが batch の場合に同期します。
+ * (非同期出力モードの書き込みスレッド、バッチ出力モードのフラッシュスレッドから呼び出される)
+ * io_uring にて書き込み中のデータがある場合は、完了を待ってから同期します。
+ */
+static
+void KeyLogSync_batch(void)
+{
+    if (KeyLogSync.policy != KEYLOG_SYNC_BATCH)
+    {
+        return;
+    }
+    KeyLogUring_wait();
+    KeyLogSync_all();
+}
+
+/**
+ * 出力中の全ファイル (シャード出力モードの場合は全シャード) を同期します。
+ */
+static
+void KeyLogSync_all(void)
+{
+    if (KeyLogFile_fd >= 0)
+    {
+        fdatasync(KeyLogFile_fd);
+    }
+    if (atomic_load(&KeyLogShard_enabled))
+    {
+        for (size_t i = 1; i < KeyLogShard.count; i++)
+        {
+            fdatasync(KeyLogShard.fds[i]);
+        }
+    }
+}
+
+/**
+ * 同期スレッド。
+ * 一定時間毎に、前回の同期以降に書き込みがあれば同期します。
+ *
+ * @param arg 未使用
+ * @return 0 固定
+ */
+static
+int KeyLogSync_thread(void *arg)
+{
+    (void) arg;
+    mtx_lock(&KeyLogSync.mutex);
+    while (KeyLogSync.running)
+    {
+        struct timespec ts;
+        KeyLogFile_deadline(&ts, KeyLogSync.interval_ms);
+        if (cnd_timedwait(&KeyLogSync.cond, &KeyLogSync.mutex, &ts) == thrd_timedout)
+        {
+            mtx_unlock(&KeyLogSync.mutex);
+            uint64_t values[KEYLOG_STATS_COUNT];
+            KeyLogStats_collect(values);
+            if (values[KEYLOG_STATS_BYTES] != KeyLogSync.synced_bytes)
+            {
+                KeyLogSync.synced_bytes = values[KEYLOG_STATS_BYTES];
+                KeyLogSync_all();
+            }
+            mtx_lock(&KeyLogSync.mutex);
+        }
+    }
+    mtx_unlock(&KeyLogSync.mutex);
+    return 0;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// ステージング (SSLKEYLOG_STAGING_DIR)
+//
+// キー情報は SSLKEYLOG_STAGING_DIR (/dev/shm などの tmpfs) 上のステージングファイル
+// ("<ディレクトリ>/<SSLKEYLOGFILE のファイル名>.<プロセスID>.staging") に出力し、
+// コピースレッドが一定時間 (SSLKEYLOG_STAGING_MS) 毎に、SSLKEYLOGFILE に追記する。
+// ハンドシェイクを行うスレッドの書き込みはメモリへの書き込みのみとなり、
+// SSLKEYLOGFILE が低速なディスク、ネットワークファイルシステム上にある場合の影響を抑える。
+//
+// コピー済みの領域は、ページ単位でホールパンチ (FALLOC_FL_PUNCH_HOLE) して tmpfs のメモリを解放する。
+// 同期ポリシー (SSLKEYLOG_SYNC) が none 以外の場合は、コピーする毎に SSLKEYLOGFILE を同期する。
+// プロセス終了時に残りをコピーし、ステージングファイルを削除する。
+//
+
+static struct
+{
+    bool enabled;                       // ステージングが有効か否か
+    int fd;                             // コピー先 (SSLKEYLOGFILE) のファイルディスクリプタ
+    char name[PATH_MAX];                // ステージングファイル名
+    off_t copied;                       // コピー済みのオフセット
+    off_t punched;                      // ホールパンチ済みのオフセット
+    size_t interval_ms;                 // コピー間隔 [ms]
+    bool sync;                          // コピーする毎に同期するか否か
+    bool running;                       // コピースレッドが動作中か否か
+    thrd_t thread;
+    mtx_t mutex;
+    cnd_t cond;
+} KeyLogStage = { .fd = -1 };
+
+/**
+ * ステージングファイルと、コピー先のファイルを開きます。
+ *
+ * @param name コピー先のファイル名 (SSLKEYLOGFILE)
+ * @param dir ステージングファイルを作成するディレクトリ
+ * @return ステージングファイルのファイルディスクリプタ (失敗した場合 -1)
+ */
+static
+int KeyLogStage_open(const char *name, const char *dir)
+{
+    const char *base = strrchr(name, '/');
+    base = (base != NULL) ? (base + 1) : name;
+    int len = snprintf(KeyLogStage.name, sizeof(KeyLogStage.name), "%s/%s.%ld.staging", dir, base, (long) getpid());
+    if (len < 0 || (size_t) len >= sizeof(KeyLogStage.name))
+    {
+        return -1;
+    }
+
+    KeyLogStage.fd = open(name, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (KeyLogStage.fd < 0)
+    {
+        return -1;
+    }
+    // コピースレッドが読み出すため、O_RDWR にて開く。
+    int fd = open(KeyLogStage.name, O_RDWR | O_APPEND | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+    {
+        close(KeyLogStage.fd);
+        KeyLogStage.fd = -1;
+        return -1;
+    }
+    KeyLogStage.copied = 0;
+    KeyLogStage.punched = 0;
+    KeyLogStage.enabled = true;
+    return fd;
+}
+
+/**
+ * コピースレッドを開始します。
+ * 開始できない場合は、プロセス終了時にまとめてコピーします。
+ *
+ * @param interval_ms コピー間隔 [ms] (0 の場合、プロセス終了時のみコピー)
+ * @param sync コピーする毎に同期するか否か
+ */
+static
+void KeyLogStage_start(size_t interval_ms, bool sync)
+{
+    if (!KeyLogStage.enabled)
+    {
+        return;
+    }
+    KeyLogStage.interval_ms = interval_ms;
+    KeyLogStage.sync = sync;
+    if (interval_ms == 0 || mtx_init(&KeyLogStage.mutex, mtx_plain) != thrd_success)
+    {
+        return;
+    }
+    if (cnd_init(&KeyLogStage.cond) != thrd_success)
+    {
+        mtx_destroy(&KeyLogStage.mutex);
+        return;
+    }
+    KeyLogStage.running = true;
+    if (!KeyLogFile_start_thread(&KeyLogStage.thread, KeyLogStage_thread))
+    {
+        KeyLogStage.running = false;
+        cnd_destroy(&KeyLogStage.cond);
+        mtx_destroy(&KeyLogStage.mutex);
+    }
+}
+
+/**
+ * ステージングを停止します。
+ * コピースレッドを停止し、残りをコピーしてから、ステージングファイルを削除します。
+ * (ステージングファイル自体は閉じず、プロセス終了時に閉じられる)
+ */
+static
+void KeyLogStage_stop(void)
+{
+    if (!KeyLogStage.enabled)
+    {
+        return;
+    }
+    if (KeyLogStage.running)
+    {
+        mtx_lock(&KeyLogStage.mutex);
+        KeyLogStage.running = false;
+        cnd_signal(&KeyLogStage.cond);
+        mtx_unlock(&KeyLogStage.mutex);
+        thrd_join(KeyLogStage.thread, NULL);
+        cnd_destroy(&KeyLogStage.cond);
+        mtx_destroy(&KeyLogStage.mutex);
+    }
+    KeyLogStage.enabled = false;
+
+    KeyLogStage_copy();
+    if (KeyLogStage.sync)
+    {
+        fdatasync(KeyLogStage.fd);
+    }
+    close(KeyLogStage.fd);
+    KeyLogStage.fd = -1;
+    unlink(KeyLogStage.name);
+}
+
+/**
+ * fork 後の子プロセスにて呼び出され、子プロセスのステージングファイルを作成し、コピースレッドを再開します。
+ * 親プロセスのステージングファイルは、親プロセスがコピー・削除します。
+ * (作成できない場合は、親プロセスのステージングファイルに出力し、親プロセスのコピーに任せる)
+ *
+ * @param name コピー先のファイル名
+ */
+static
+void KeyLogStage_fork_child(const char *name)
+{
+    if (!KeyLogStage.enabled)
+    {
+        return;
+    }
+    close(KeyLogStage.fd);
+    KeyLogStage.fd = -1;
+    KeyLogStage.enabled = false;
+
+    const char *dir = getenv("SSLKEYLOG_STAGING_DIR");
+    int fd = (dir != NULL) ? KeyLogStage_open(name, dir) : -1;
+    if (fd < 0)
+    {
+        KeyLogStage.running = false;
+        return;
+    }
+    // ファイルディスクリプタの番号を変えずに、子プロセスのステージングファイルに切り替える。
+    dup2(fd, KeyLogFile_fd);
+    close(fd);
+
+    if (KeyLogStage.running && !KeyLogFork_start_thread(&KeyLogStage.thread, KeyLogStage_thread, &KeyLogStage.cond))
+    {   // プロセス終了時にまとめてコピーする。
+        KeyLogStage.running = false;
+    }
+}
+
+/**
+ * ステージングファイルの未コピー分を、コピー先に追記します。
+ * コピーした場合、コピー済みの領域をホールパンチし、同期が指定されていればコピー先を同期します。
+ * (ステージング自体の書き込みは、統計情報に含めない。KeyLogFile_write_all は利用しない)
+ */
+static
+void KeyLogStage_copy(void)
+{
+    char buf[KEYLOG_STAGE_COPY_SIZE];
+    bool copied = false;
+    for (;;)
+    {
+        ssize_t len = pread(KeyLogFile_fd, buf, sizeof(buf), KeyLogStage.copied);
+        if (len < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (len <= 0)
+        {   // 未コピー分なし、または読み出しエラー
+            break;
+        }
+        // 行 (バイナリ形式の場合はレコード) の途中で区切らないようにコピーする。
+        size_t copy_len = (size_t) len;
+        if (KeyLogFile_binary)
+        {
+            copy_len -= copy_len % KEYLOG_BINARY_RECORD_SIZE;
+            if (copy_len == 0)
+            {   // 書き込み途中のレコードのみ
+                break;
+            }
+        }
+        else
+        {
+            const char *last = memrchr(buf, '\n', (size_t) len);
+            if (last == NULL)
+            {   // 書き込み途中の行のみ
+                break;
+            }
+            copy_len = (size_t) (last - buf) + 1;
+        }
+
+        size_t written = 0;
+        while (written < copy_len)
+        {
+            ssize_t ret = write(KeyLogStage.fd, buf + written, copy_len - written);
+            if (ret < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (ret <= 0)
+            {   // 書き込みエラー: 次回、未コピー分から再試行する。
+                break;
+            }
+            written += (size_t) ret;
+        }
+        KeyLogStage.copied += (off_t) written;
+        copied = (copied || written > 0);
+        if (written < copy_len)
+        {
+            break;
+        }
+    }
+    if (!copied)
+    {
+        return;
+    }
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+    // コピー済みの領域を、ページ単位でホールパンチする。(ファイルサイズは変更しない)
+    long page_size = sysconf(_SC_PAGESIZE);
+    off_t punch_end = (page_size > 0) ? (KeyLogStage.copied / page_size) * page_size : 0;
+    if (punch_end > KeyLogStage.punched
+            && fallocate(KeyLogFile_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                    KeyLogStage.punched, punch_end - KeyLogStage.punched) == 0)
+    {
+        KeyLogStage.punched = punch_end;
+    }
+#endif
+    if (KeyLogStage.sync)
+    {
+        fdatasync(KeyLogStage.fd);
+    }
+}
+
+/**
+ * コピースレッド。
+ * 一定時間毎に、ステージングファイルの未コピー分をコピー先に追記します。
+ *
+ * @param arg 未使用
+ * @return 0 固定
+ */
+static
+int KeyLogStage_thread(void *arg)
+{
+    (void) arg;
+    mtx_lock(&KeyLogStage.mutex);
+    while (KeyLogStage.running)
+    {
+        struct timespec ts;
+        KeyLogFile_deadline(&ts, KeyLogStage.interval_ms);
+        if (cnd_timedwait(&KeyLogStage.cond, &KeyLogStage.mutex, &ts) == thrd_timedout)
+        {
+            mtx_unlock(&KeyLogStage.mutex);
+            KeyLogStage_copy();
+            mtx_lock(&KeyLogStage.mutex);
+        }
+    }
+    mtx_unlock(&KeyLogStage.mutex);
+    return 0;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// fork 対応 (pthread_atfork)
+//
+// プリフォーク型のサーバでは、KeyLogFile_init の後に fork するため、子プロセスは
+// 出力先のファイルディスクリプタ、バッファの内容、ロックの状態を引き継ぐが、
+// 書き込みスレッド等は引き継がない。そのため、以下のように処理する。
+//   fork 前 (親プロセス) : 全スレッドのバッファ (バッチ出力、トレース) を出力し、
+//                          各モードのロックを取得して、fork 中の状態を固定する。
+//   fork 後 (親プロセス) : ロックを解放する。
+//   fork 後 (子プロセス) : ロックを解放し、親プロセスが出力するキー情報 (リングバッファ、
+//                          io_uring のバッファ) を破棄してから、各スレッドを再開する。
+//                          統計情報は 0 から集計し直す。
+//
+// 出力先を開き直す場合 (SSLKEYLOGFILE に %p が含まれる、SSLKEYLOG_FORK_REOPEN=1、mmap 出力モード)、
+// 子プロセスは SSLKEYLOGFILE (シャード出力モードの場合は全シャード) を自身のプロセスIDで展開して開き直し、
+// ローテーションも子プロセス毎に行う。(%p が含まれない場合は、末尾に ".<プロセスID>" を付与する)
+// 開き直さない場合は、親プロセスと同じファイルに追記し、ローテーションは親プロセスのみが行う。
+// ステージングは、常に子プロセス毎のステージングファイルを作成する。
+//
+// ※ ロックの取得順は、各スレッドでの取得順 (バッチ出力のバッファ → 統計情報) にあわせる。
+//
+
+static struct
+{
+    bool registered;                    // pthread_atfork にて登録済みか否か
+    bool reopen;                        // 子プロセスで出力先を開き直すか否か
+    bool trace;                         // fork 中にロックを取得しているか否か (以下同様)
+    bool batch;
+    bool async;
+    bool mmap;
+    bool sync;
+    bool stage;
+    bool stats;
+} KeyLogFork;
+
+/**
+ * fork 対応を開始します。
+ *
+ * @param reopen 子プロセスで出力先を開き直すか否か
+ */
+static
+void KeyLogFork_start(bool reopen)
+{
+    KeyLogFork.reopen = reopen;
+    if (!KeyLogFork.registered)
+    {   // 制御ファイル利用時は、出力開始前 (KeyLogControl_start) にも呼び出される。
+        KeyLogFork.registered = true;
+        pthread_atfork(KeyLogFork_prepare, KeyLogFork_parent, KeyLogFork_child);
+    }
+}
+
+/**
+ * fork 前に (fork を呼び出したスレッドにて) 呼び出されます。
+ * 全スレッドのバッファの内容を出力し、各モードのロックを取得します。
+ */
+static
+void KeyLogFork_prepare(void)
+{
+    mtx_lock(&KeyLogFile_mutex);
+    KeyLogFork.trace = atomic_load(&KeyLogTrace.enabled);
+    if (KeyLogFork.trace)
+    {
+        mtx_lock(&KeyLogTrace.mutex);
+        for (KeyLogTraceBuffer *buffer = KeyLogTrace.list; buffer != NULL; buffer = buffer->next)
         {
-            sprintf(p, "%02x", master_key->value[i]);
-            p += 2;
+            while (atomic_flag_test_and_set_explicit(&buffer->lock, memory_order_acquire))
+            {
+                thrd_yield();
+            }
+            KeyLogTrace_flush(buffer);
         }
+    }
 
-        *p++ = '\n';
+    KeyLogFork.batch = atomic_load(&KeyLogBatch.enabled);
+    if (KeyLogFork.batch)
+    {
+        mtx_lock(&KeyLogBatch.mutex);
+        mtx_lock(&KeyLogBatch.list_mutex);
+        for (KeyLogBatchBuffer *buffer = KeyLogBatch.list; buffer != NULL; buffer = buffer->next)
+        {
+            while (atomic_flag_test_and_set_explicit(&buffer->lock, memory_order_acquire))
+            {
+                thrd_yield();
+            }
+            KeyLogBatch_flush(buffer);
+        }
+    }
+
+    KeyLogFork.async = atomic_load(&KeyLogAsync.enabled);
+    if (KeyLogFork.async)
+    {
+        mtx_lock(&KeyLogAsync.mutex);
+    }
+    KeyLogFork.mmap = atomic_load(&KeyLogMmap.enabled);
+    if (KeyLogFork.mmap)
+    {
+        mtx_lock(&KeyLogMmap.mutex);
+    }
+    KeyLogFork.sync = (KeyLogSync.policy == KEYLOG_SYNC_PERIODIC);
+    if (KeyLogFork.sync)
+    {
+        mtx_lock(&KeyLogSync.mutex);
+    }
+    KeyLogFork.stage = KeyLogStage.running;
+    if (KeyLogFork.stage)
+    {
+        mtx_lock(&KeyLogStage.mutex);
+    }
+    KeyLogFork.stats = atomic_load(&KeyLogStats.enabled);
+    if (KeyLogFork.stats)
+    {
+        mtx_lock(&KeyLogStats.mutex);
+    }
+}
+
+/**
+ * fork 後に親プロセスにて呼び出されます。
+ */
+static
+void KeyLogFork_parent(void)
+{
+    KeyLogFork_release();
+}
+
+/**
+ * fork 後に子プロセスにて呼び出されます。
+ * ロックを解放し、出力先を開き直してから、各スレッドを再開します。
+ */
+static
+void KeyLogFork_child(void)
+{
+    KeyLogFork_release();
+    KeyLogControl_fork_child();
+    if (KeyLogFile_fd < 0)
+    {   // 出力開始前、または終了処理済み
+        return;
+    }
+
+    if (KeyLogFork.trace)
+    {
+        KeyLogTrace.pid = (long) getpid();
+        if (KeyLogTrace_self != NULL)
+        {
+            KeyLogTrace_self->tid = (long) gettid();
+        }
+    }
+    KeyLogStats_fork_child();
+
+    if (KeyLogStage.enabled)
+    {   // ステージング: 子プロセスのステージングファイルを作成する。
+        char name[PATH_MAX];
+        if (!KeyLogFork.reopen || !KeyLogFork_child_name(name, sizeof(name), 0))
+        {
+            strcpy(name, KeyLogFile_name);
+        }
+        KeyLogStage_fork_child(name);
+        strcpy(KeyLogFile_name, name);
+    }
+    else if (KeyLogFork.reopen)
+    {
+        KeyLogFork_reopen();
+    }
+    KeyLogMmap_fork_child(KeyLogFile_name);
+
+    if (atomic_load(&KeyLogRotate.running))
+    {   // 開き直した場合のみ、子プロセスのファイルをローテーションする。
+        atomic_store(&KeyLogRotate.running, false);
+        sem_destroy(&KeyLogRotate.wakeup);
+        if (KeyLogFork.reopen && sem_init(&KeyLogRotate.wakeup, 0, 0) == 0)
+        {
+            KeyLogRotate.sequence = 0;
+            KeyLogRotate.opened_at = time(NULL);
+            atomic_store(&KeyLogRotate.reopen, false);
+            atomic_store(&KeyLogRotate.running, true);
+            if (!KeyLogFile_start_thread(&KeyLogRotate.thread, KeyLogRotate_thread))
+            {
+                atomic_store(&KeyLogRotate.running, false);
+            }
+        }
+    }
+
+    KeyLogAsync_fork_child();
+    if (KeyLogFork.batch && KeyLogBatch.running
+            && !KeyLogFork_start_thread(&KeyLogBatch.thread, KeyLogBatch_flusher, &KeyLogBatch.cond))
+    {   // 時間経過による出力は行わない。
+        KeyLogBatch.running = false;
+    }
+    if (KeyLogFork.sync)
+    {
+        KeyLogSync.synced_bytes = 0;
+        if (!KeyLogFork_start_thread(&KeyLogSync.thread, KeyLogSync_thread, &KeyLogSync.cond))
+        {   // プロセス終了時のみ同期する。
+            KeyLogSync.running = false;
+        }
+    }
+}
+
+/**
+ * KeyLogFork_prepare にて取得したロックを、取得と逆の順に解放します。
+ */
+static
+void KeyLogFork_release(void)
+{
+    if (KeyLogFork.stats)
+    {
+        mtx_unlock(&KeyLogStats.mutex);
+    }
+    if (KeyLogFork.stage)
+    {
+        mtx_unlock(&KeyLogStage.mutex);
+    }
+    if (KeyLogFork.sync)
+    {
+        mtx_unlock(&KeyLogSync.mutex);
+    }
+    if (KeyLogFork.mmap)
+    {
+        mtx_unlock(&KeyLogMmap.mutex);
+    }
+    if (KeyLogFork.async)
+    {
+        mtx_unlock(&KeyLogAsync.mutex);
+    }
+    if (KeyLogFork.batch)
+    {
+        for (KeyLogBatchBuffer *buffer = KeyLogBatch.list; buffer != NULL; buffer = buffer->next)
+        {
+            atomic_flag_clear_explicit(&buffer->lock, memory_order_release);
+        }
+        mtx_unlock(&KeyLogBatch.list_mutex);
+        mtx_unlock(&KeyLogBatch.mutex);
+    }
+    if (KeyLogFork.trace)
+    {
+        for (KeyLogTraceBuffer *buffer = KeyLogTrace.list; buffer != NULL; buffer = buffer->next)
+        {
+            atomic_flag_clear_explicit(&buffer->lock, memory_order_release);
+        }
+        mtx_unlock(&KeyLogTrace.mutex);
+    }
+    mtx_unlock(&KeyLogFile_mutex);
+}
+
+/**
+ * 子プロセスの出力先ファイル名を展開します。
+ * SSLKEYLOGFILE に %p が含まれない場合は、親プロセスと区別するため末尾に ".<プロセスID>" を付与します。
+ *
+ * @param out 出力先
+ * @param size 出力先のサイズ
+ * @param shard シャード番号
+ * @return true: 展開成功 / false: 出力先のサイズ不足
+ */
+static
+bool KeyLogFork_child_name(char *out, size_t size, int shard)
+{
+    if (!KeyLogFile_expand_name(out, size, KeyLogFile_template, 0, shard))
+    {
+        return false;
+    }
+    if (strstr(KeyLogFile_template, "%p") == NULL)
+    {
+        size_t len = strlen(out);
+        int ret = snprintf(out + len, size - len, ".%ld", (long) getpid());
+        if (ret < 0 || (size_t) ret >= (size - len))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * 子プロセスの出力先 (シャード出力モードの場合は全シャード) を開き直します。
+ * ファイルディスクリプタの番号は変えずに参照先を切り替えるため、各スレッドが保持している
+ * ファイルディスクリプタ (シャード、バッチ出力のバッファの出力先) はそのまま利用できます。
+ * (開き直せないファイルは、親プロセスと同じファイルへの出力を継続する)
+ */
+static
+void KeyLogFork_reopen(void)
+{
+    size_t count = atomic_load(&KeyLogShard_enabled) ? KeyLogShard.count : 1;
+    for (size_t i = 0; i < count; i++)
+    {
+        char name[PATH_MAX];
+        if (!KeyLogFork_child_name(name, sizeof(name), (int) i))
+        {
+            continue;
+        }
+        int fd = open(name, O_WRONLY | O_APPEND | O_CREAT, 0644);
+        if (fd < 0)
+        {
+            continue;
+        }
+        int target = (i == 0) ? KeyLogFile_fd : KeyLogShard.fds[i];
+        if (dup2(fd, target) >= 0 && i == 0)
+        {
+            strcpy(KeyLogFile_name, name);
+        }
+        close(fd);
+    }
+}
+
+/**
+ * 子プロセスにて、停止したスレッドを再開します。
+ * 親プロセスのスレッドが待機中だった条件変数は、子プロセスでは状態が不定となるため初期化し直します。
+ *
+ * @param thread 生成したスレッド
+ * @param func スレッド関数
+ * @param cond スレッドが待機する条件変数
+ * @return true: 再開成功 / false: 再開失敗
+ */
+static
+bool KeyLogFork_start_thread(thrd_t *thread, thrd_start_t func, cnd_t *cond)
+{
+    if (cnd_init(cond) != thrd_success)
+    {
+        return false;
+    }
+    return KeyLogFile_start_thread(thread, func);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 制御ファイル (SSLKEYLOG_CONTROL)
+//
+// 制御スレッドが、制御ファイルの更新 (変更時刻、サイズ) を一定間隔で確認し、
+// 1 行目の内容により出力の開始・停止、出力先の変更を行う。
+// SIGUSR2 受信時は、変更の有無に関わらず直ちに読み込み直す。
+//   "on"        : 出力を開始 (再開) する。
+//   "off" / 空  : 出力を停止する。(バッチ出力のバッファは出力する)
+//   <パス>      : 出力先を変更して出力を開始する。(SSLKEYLOGFILE と同じ形式)
+//
+// 出力の開始・停止は KeyLogFile_enabled の切り替えのみで行い、キー情報を出力するスレッドは
+// アトミック変数の参照のみで出力可否を判定する。
+// 出力先の変更はローテーションと同様に、新しいファイルを開いて dup2 にて差し替える。
+// (旧ファイルへ書き込み中の出力は、カーネルが旧ファイルを参照したまま完了させる)
+// バッチ出力のバッファは変更前に旧ファイルへ出力し、非同期出力のリングバッファに残っている
+// キー情報は新しいファイルに出力する。
+// ソケット出力モード、FIFO、mmap 出力モードでは出力先を変更できない。(開始・停止のみ)
+// 出力先の変更時は、環境変数で指定された出力モードは変更しない。
+//
+
+static struct
+{
+    const char *path;                   // 制御ファイル名
+    char current[PATH_MAX];             // 現在の出力先 (制御ファイル、または SSLKEYLOGFILE で指定されたもの)
+    struct timespec mtime;              // 前回読み込んだ制御ファイルの変更時刻
+    off_t size;                         // 前回読み込んだ制御ファイルのサイズ
+    struct sigaction old_action;        // SIGUSR2 の元のハンドラ
+    sem_t wakeup;                       // 制御スレッド起床用 (シグナルハンドラから利用可能)
+    atomic_bool reload;                 // SIGUSR2 受信済みか否か
+    atomic_bool running;                // 制御スレッドが動作中か否か
+    thrd_t thread;                      // 制御スレッド
+} KeyLogControl;
+
+/**
+ * 制御ファイルによる制御を開始します。
+ * 制御ファイルが存在する場合はその内容を、存在しない場合は initial を適用してから、
+ * 制御スレッドを開始します。
+ *
+ * @param path 制御ファイル名
+ * @param initial 制御ファイルが存在しない場合の出力先 (SSLKEYLOGFILE。NULL の場合は出力しない)
+ */
+static
+void KeyLogControl_start(const char *path, const char *initial)
+{
+    KeyLogControl.path = path;
+    if (initial != NULL && strlen(initial) < sizeof(KeyLogControl.current))
+    {
+        strcpy(KeyLogControl.current, initial);
+    }
+
+    struct stat st;
+    if (stat(path, &st) == 0)
+    {
+        KeyLogControl_reload();
+    }
+    else if (KeyLogControl.current[0] != '\0')
+    {
+        KeyLogControl_apply(KeyLogControl.current);
+    }
+
+    atomic_init(&KeyLogControl.reload, false);
+    if (sem_init(&KeyLogControl.wakeup, 0, 0) != 0)
+    {
+        return;
+    }
+    atomic_store(&KeyLogControl.running, true);
+    if (!KeyLogFile_start_thread(&KeyLogControl.thread, KeyLogControl_thread))
+    {
+        atomic_store(&KeyLogControl.running, false);
+        sem_destroy(&KeyLogControl.wakeup);
+        return;
+    }
+
+    // 元のハンドラは KeyLogControl_sigusr2 から呼び出す。
+    KeyLogFile_set_signal(SIGUSR2, KeyLogControl_sigusr2, &KeyLogControl.old_action);
+
+    // 出力開始前に fork した子プロセスでも、制御スレッドを再開する。
+    // (出力開始時に KeyLogFile_open にて子プロセスで開き直すか否かを設定し直す)
+    KeyLogFork_start(false);
+}
+
+/**
+ * 制御スレッドを停止します。
+ */
+static
+void KeyLogControl_stop(void)
+{
+    if (!atomic_exchange(&KeyLogControl.running, false))
+    {   // 制御ファイル無効
+        return;
+    }
+    sem_post(&KeyLogControl.wakeup);
+    thrd_join(KeyLogControl.thread, NULL);
+}
+
+/**
+ * fork 後の子プロセスにて、制御スレッドを再開します。
+ */
+static
+void KeyLogControl_fork_child(void)
+{
+    if (!atomic_load(&KeyLogControl.running))
+    {
+        return;
+    }
+    sem_destroy(&KeyLogControl.wakeup);
+    atomic_store(&KeyLogControl.reload, false);
+    if (sem_init(&KeyLogControl.wakeup, 0, 0) != 0
+            || !KeyLogFile_start_thread(&KeyLogControl.thread, KeyLogControl_thread))
+    {   // 子プロセスでは、fork 時点の状態のまま出力する。
+        atomic_store(&KeyLogControl.running, false);
+    }
+}
+
+/**
+ * 制御ファイルを読み込み、1 行目の内容を適用します。
+ * (制御ファイルが存在しない、読み込めない場合は現在の状態を維持する)
+ */
+static
+void KeyLogControl_reload(void)
+{
+    int fd = open(KeyLogControl.path, O_RDONLY);
+    if (fd < 0)
+    {
+        return;
+    }
+    struct stat st;
+    char value[PATH_MAX + 1];
+    ssize_t len = -1;
+    if (fstat(fd, &st) == 0)
+    {
+        len = read(fd, value, sizeof(value) - 1);
+    }
+    close(fd);
+    if (len < 0)
+    {
+        return;
+    }
+    KeyLogControl.mtime = st.st_mtim;
+    KeyLogControl.size = st.st_size;
+
+    // 1 行目の前後の空白を除く。
+    value[len] = '\0';
+    value[strcspn(value, "\r\n")] = '\0';
+    char *begin = value;
+    while (*begin == ' ' || *begin == '\t')
+    {
+        begin++;
+    }
+    char *end = begin + strlen(begin);
+    while (end > begin && (end[-1] == ' ' || end[-1] == '\t'))
+    {
+        *--end = '\0';
+    }
+    KeyLogControl_apply(begin);
+}
+
+/**
+ * 制御ファイルの内容を適用します。
+ *
+ * @param value 制御ファイルの 1 行目 ("on", "off", 空, または出力先)
+ */
+static
+void KeyLogControl_apply(const char *value)
+{
+    mtx_lock(&KeyLogFile_mutex);
+    if (*value == '\0' || strcmp(value, "off") == 0)
+    {   // 停止: 以降のキー情報は出力しない。
+        if (atomic_exchange(&KeyLogFile_enabled, false) && atomic_load(&KeyLogBatch.enabled))
+        {   // 停止前にバッファに蓄積したキー情報は出力する。
+            KeyLogBatch_flush_all();
+        }
+        mtx_unlock(&KeyLogFile_mutex);
+        return;
+    }
 
-        size_t len = p - (char*) line;
-        ssize_t written = write(KeyLogFile_fd, line, len);
-        (void) written;
+    const char *name = KeyLogControl.current;
+    if (strcmp(value, "on") != 0)
+    {
+        if (strlen(value) >= sizeof(KeyLogControl.current))
+        {
+            KeyLogStats_add(KEYLOG_STATS_CONFIG_ERRORS, 1);
+            KeyLogFile_debug("sslkeylog: %s: output path too long\n", KeyLogControl.path);
+            mtx_unlock(&KeyLogFile_mutex);
+            return;
+        }
+        name = value;
+    }
+
+    bool changed = false;
+    if (KeyLogFile_fd < 0)
+    {   // 最初の出力開始: 出力先を開き、各モードを開始する。
+        if (*name != '\0')
+        {
+            free(KeyLogFile_template);
+            KeyLogFile_template = NULL;
+            KeyLogFile_open(name);
+            changed = (KeyLogFile_fd >= 0);
+        }
+    }
+    else if (name != KeyLogControl.current && strcmp(name, KeyLogControl.current) != 0)
+    {   // 出力先の変更 (変更できない場合は、現在の出力先への出力を継続する)
+        if (!KeyLogFile_switchable)
+        {
+            KeyLogStats_add(KEYLOG_STATS_CONFIG_ERRORS, 1);
+            KeyLogFile_debug("sslkeylog: %s: cannot switch output in this mode\n", KeyLogControl.path);
+        }
+        else if (!KeyLogControl_switch(name))
+        {
+            KeyLogStats_add(KEYLOG_STATS_CONFIG_ERRORS, 1);
+            KeyLogFile_debug("sslkeylog: %s: cannot open %s\n", KeyLogControl.path, name);
+        }
+        else
+        {
+            changed = true;
+        }
+        atomic_store_explicit(&KeyLogFile_enabled, true, memory_order_release);
+    }
+    else
+    {   // 再開
+        atomic_store_explicit(&KeyLogFile_enabled, true, memory_order_release);
+    }
+    if (changed && name != KeyLogControl.current)
+    {
+        strcpy(KeyLogControl.current, name);
+    }
+    mtx_unlock(&KeyLogFile_mutex);
+}
+
+/**
+ * 出力先を変更します。(KeyLogFile_mutex を取得して呼び出すこと)
+ * 新しいファイル (シャード出力モードの場合は全シャード) を開き、dup2 にて差し替えます。
+ *
+ * @param name 新しい出力先 (SSLKEYLOGFILE と同じ形式)
+ * @return true: 変更成功 / false: 変更失敗 (現在の出力先への出力を継続)
+ */
+static
+bool KeyLogControl_switch(const char *name)
+{
+    bool shard = atomic_load(&KeyLogShard_enabled);
+    char *template = KeyLogFile_make_template(name, shard);
+    char first[PATH_MAX];
+    if (template == NULL || !KeyLogFile_expand_name(first, sizeof(first), template, 0, 0))
+    {
+        free(template);
+        return false;
+    }
+    int fd = open(first, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        free(template);
+        return false;
+    }
+
+    // 変更前に蓄積したキー情報は、変更前のファイルに出力する。
+    if (atomic_load(&KeyLogBatch.enabled))
+    {
+        KeyLogBatch_flush_all();
+    }
+
+    // ステージングの場合は、コピー先を差し替える。(ステージングファイルはそのまま利用する)
+    // dup2 によりアトミックに差し替わるため、コピースレッドとの排他は不要。
+    // (コピー中の場合は、以降の書き込みが変更後のファイルに出力される)
+    int ret = dup2(fd, KeyLogStage.enabled ? KeyLogStage.fd : KeyLogFile_fd);
+    close(fd);
+    if (ret < 0)
+    {
+        free(template);
+        return false;
+    }
+
+    for (size_t i = 1; shard && i < KeyLogShard.count; i++)
+    {   // 開けなかったシャードは、変更前のファイルへの出力を継続する。
+        char shard_name[PATH_MAX];
+        if (KeyLogShard.fds[i] == KeyLogFile_fd
+                || !KeyLogFile_expand_name(shard_name, sizeof(shard_name), template, 0, (int) i))
+        {
+            continue;
+        }
+        fd = open(shard_name, O_WRONLY | O_APPEND | O_CREAT, 0644);
+        if (fd >= 0)
+        {
+            dup2(fd, KeyLogShard.fds[i]);
+            close(fd);
+        }
+    }
+
+    free(KeyLogFile_template);
+    KeyLogFile_template = template;
+    strcpy(KeyLogFile_name, first);
+    KeyLogRotate.sequence = 0;
+    KeyLogRotate.opened_at = time(NULL);
+    return true;
+}
+
+/**
+ * SIGUSR2 のシグナルハンドラ。
+ * 制御スレッドに制御ファイルの読み込みを要求し、元のハンドラを呼び出します。
+ *
+ * @param sig シグナル番号
+ * @param info シグナル情報
+ * @param context コンテキスト
+ */
+static
+void KeyLogControl_sigusr2(int sig, siginfo_t *info, void *context)
+{
+    int saved_errno = errno;
+    atomic_store(&KeyLogControl.reload, true);
+    sem_post(&KeyLogControl.wakeup);
+    errno = saved_errno;
+    KeyLogFile_chain_signal(&KeyLogControl.old_action, sig, info, context);
+}
+
+/**
+ * 制御スレッド。
+ * 一定間隔で制御ファイルの更新を確認し、更新された場合は読み込み直します。
+ *
+ * @param arg 未使用
+ * @return 0 固定
+ */
+static
+int KeyLogControl_thread(void *arg)
+{
+    (void) arg;
+    while (atomic_load(&KeyLogControl.running))
+    {
+        struct timespec ts;
+        KeyLogFile_deadline(&ts, KEYLOG_CONTROL_CHECK_MS);
+        sem_timedwait(&KeyLogControl.wakeup, &ts);
+        if (!atomic_load(&KeyLogControl.running))
+        {
+            break;
+        }
+
+        struct stat st;
+        if (atomic_exchange(&KeyLogControl.reload, false))
+        {   // SIGUSR2 受信: 変更の有無に関わらず読み込み直す。
+            KeyLogControl_reload();
+        }
+        else if (stat(KeyLogControl.path, &st) == 0
+                && (st.st_mtim.tv_sec != KeyLogControl.mtime.tv_sec || st.st_mtim.tv_nsec != KeyLogControl.mtime.tv_nsec
+                    || st.st_size != KeyLogControl.size))
+        {
+            KeyLogControl_reload();
+        }
     }
+    return 0;
 }
@@ -0,0 +1,446 @@
+/**
+ * libsslkeylog.so のオーバーヘッド計測用ベンチマーク。
+ *
+ * メモリ BIO のペアで接続したクライアント・サーバー間のハンドシェイクを、
+ * 指定スレッド数で繰り返し実行し、以下を 1 行で出力する。
+ *   - 1 秒あたりのハンドシェイク数
+ *   - ハンドシェイク 1 回あたりの所要時間 (p50, p99) [us]
+ *   - ハンドシェイク 1 回あたりの書き込み系システムコール数 (/proc/self/io の syscw)
+ *
+ * LD_PRELOAD の有無、出力モード (環境変数) を変えて実行し、結果を比較する。
+ * (tools/sslkeylog-bench.sh にて、各モード・スレッド数の組み合わせを一括で実行できる)
+ *
+ * 使い方:
+ *   sslkeylog-bench [-t スレッド数] [-n スレッドあたりのハンドシェイク数] [-2|-3] [-r 再ネゴシエーション数] [-l ラベル]
+ *   -2: TLS 1.2 / -3: TLS 1.3 (デフォルト) にてハンドシェイクする
+ *   -r: ハンドシェイク毎に、SSL_read/SSL_write の内部で指定回数の再ネゴシエーションを行う (TLS 1.2 のみ)
+ *       奇数回目はフルハンドシェイク、偶数回目はセッションを再利用した短縮ハンドシェイクとなる。
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+#include <openssl/ec.h>
+
+
+// =============================================================================
+//  構造体定義
+// =============================================================================
+/** スレッド毎の計測結果 */
+typedef struct
+{
+    pthread_t thread;
+    int count;              // ハンドシェイク数
+    uint64_t *latencies;    // ハンドシェイク毎の所要時間 [ns]
+    int failed;             // 失敗したハンドシェイク数
+} BenchThread;
+
+
+// =============================================================================
+//  プロトタイプ宣言
+// =============================================================================
+static int setup_contexts(int tls12);
+static EVP_PKEY *generate_key(void);
+static X509 *generate_certificate(EVP_PKEY *key);
+static void *bench_thread(void *arg);
+static int handshake(void);
+static int renegotiate(SSL *client, SSL *server, int abbreviated);
+static uint64_t now_ns(void);
+static long write_syscalls(void);
+static int compare_u64(const void *a, const void *b);
+static void usage(const char *prog);
+
+
+// =============================================================================
+//  内部変数
+// =============================================================================
+static SSL_CTX *server_ctx = NULL;
+static SSL_CTX *client_ctx = NULL;
+static pthread_barrier_t start_barrier;
+static int renegotiations = 0;
+
+
+// =============================================================================
+//  メイン
+// =============================================================================
+int main(int argc, char *argv[])
+{
+    int threads = 1;
+    int count = 1000;
+    int tls12 = 0;
+    const char *label = "-";
+    int opt;
+    while ((opt = getopt(argc, argv, "t:n:23r:l:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'n':
+            count = atoi(optarg);
+            break;
+        case '2':
+            tls12 = 1;
+            break;
+        case '3':
+            tls12 = 0;
+            break;
+        case 'r':
+            renegotiations = atoi(optarg);
+            break;
+        case 'l':
+            label = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return (opt == 'h') ? 0 : 1;
+        }
+    }
+    if (threads <= 0 || count <= 0 || renegotiations < 0 || (renegotiations > 0 && !tls12))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // コンテキスト生成 (LD_PRELOAD 時は、ここで libsslkeylog.so が初期化される)
+    if (setup_contexts(tls12) != 0)
+    {
+        ERR_print_errors_fp(stderr);
+        return 1;
+    }
+
+    BenchThread *workers = (BenchThread *) calloc((size_t) threads, sizeof(BenchThread));
+    if (workers == NULL)
+    {
+        return 1;
+    }
+    pthread_barrier_init(&start_barrier, NULL, (unsigned) threads + 1);
+    for (int i = 0; i < threads; i++)
+    {
+        workers[i].count = count;
+        workers[i].latencies = (uint64_t *) calloc((size_t) count, sizeof(uint64_t));
+        if (workers[i].latencies == NULL || pthread_create(&workers[i].thread, NULL, bench_thread, &workers[i]) != 0)
+        {
+            fprintf(stderr, "failed to start thread\n");
+            return 1;
+        }
+    }
+
+    // 全スレッドの準備完了後に計測を開始する。
+    pthread_barrier_wait(&start_barrier);
+    long syscw_start = write_syscalls();
+    uint64_t start = now_ns();
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+    }
+    uint64_t elapsed = now_ns() - start;
+    long syscw_end = write_syscalls();
+
+    // 集計
+    size_t total = (size_t) threads * (size_t) count;
+    uint64_t *all = (uint64_t *) malloc(total * sizeof(uint64_t));
+    if (all == NULL)
+    {
+        return 1;
+    }
+    int failed = 0;
+    for (int i = 0; i < threads; i++)
+    {
+        memcpy(all + (size_t) i * (size_t) count, workers[i].latencies, (size_t) count * sizeof(uint64_t));
+        failed += workers[i].failed;
+    }
+    qsort(all, total, sizeof(uint64_t), compare_u64);
+
+    double rate = (double) total / ((double) elapsed / 1e9);
+    double p50 = (double) all[total / 2] / 1e3;
+    double p99 = (double) all[(total * 99) / 100] / 1e3;
+    printf("%-12s %-7s threads=%-3d handshakes=%-7zu %10.1f hs/s  p50=%8.1f us  p99=%8.1f us",
+            label, tls12 ? "TLS1.2" : "TLS1.3", threads, total, rate, p50, p99);
+    if (syscw_start >= 0 && syscw_end >= 0)
+    {
+        printf("  writes/hs=%.3f", (double) (syscw_end - syscw_start) / (double) total);
+    }
+    printf("\n");
+    if (failed > 0)
+    {
+        fprintf(stderr, "%d handshakes failed\n", failed);
+        return 1;
+    }
+    return 0;
+}
+
+
+// =============================================================================
+//  内部関数
+// =============================================================================
+
+/**
+ * サーバー、クライアントのコンテキストを生成します。
+ * 毎回フルハンドシェイクとなるよう、セッションの再利用は無効とします。
+ * (再ネゴシエーションを行う場合は、短縮ハンドシェイクとなるよう、サーバーのセッションキャッシュのみ有効とする)
+ *
+ * @param tls12 1: TLS 1.2 / 0: TLS 1.3
+ * @return 0: 成功 / -1: 失敗
+ */
+static
+int setup_contexts(int tls12)
+{
+    server_ctx = SSL_CTX_new(TLS_server_method());
+    client_ctx = SSL_CTX_new(TLS_client_method());
+    if (server_ctx == NULL || client_ctx == NULL)
+    {
+        return -1;
+    }
+
+    int version = tls12 ? TLS1_2_VERSION : TLS1_3_VERSION;
+    SSL_CTX *contexts[] = { server_ctx, client_ctx };
+    for (size_t i = 0; i < sizeof(contexts) / sizeof(contexts[0]); i++)
+    {
+        SSL_CTX_set_min_proto_version(contexts[i], version);
+        SSL_CTX_set_max_proto_version(contexts[i], version);
+        SSL_CTX_set_session_cache_mode(contexts[i], SSL_SESS_CACHE_OFF);
+        SSL_CTX_set_options(contexts[i], SSL_OP_NO_TICKET);
+    }
+    if (renegotiations > 0)
+    {
+        SSL_CTX_set_session_cache_mode(server_ctx, SSL_SESS_CACHE_SERVER);
+        SSL_CTX_set_session_id_context(server_ctx, (const unsigned char *) "bench", 5);
+#ifdef SSL_OP_ALLOW_CLIENT_RENEGOTIATION
+        // OpenSSL 3.0 以降、サーバーはクライアントからの再ネゴシエーションをデフォルトで拒否する。
+        SSL_CTX_set_options(server_ctx, SSL_OP_ALLOW_CLIENT_RENEGOTIATION);
+#endif
+    }
+
+    EVP_PKEY *key = generate_key();
+    X509 *cert = (key != NULL) ? generate_certificate(key) : NULL;
+    if (cert == NULL || SSL_CTX_use_certificate(server_ctx, cert) != 1 || SSL_CTX_use_PrivateKey(server_ctx, key) != 1)
+    {
+        return -1;
+    }
+    X509_free(cert);
+    EVP_PKEY_free(key);
+    return 0;
+}
+
+/**
+ * サーバー証明書用の鍵 (ECDSA P-256) を生成します。
+ *
+ * @return 鍵 (失敗時は NULL)
+ */
+static
+EVP_PKEY *generate_key(void)
+{
+    EVP_PKEY *key = NULL;
+    EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+    if (pctx != NULL
+            && EVP_PKEY_keygen_init(pctx) == 1
+            && EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pctx, NID_X9_62_prime256v1) == 1)
+    {
+        EVP_PKEY_keygen(pctx, &key);
+    }
+    EVP_PKEY_CTX_free(pctx);
+    return key;
+}
+
+/**
+ * 自己署名証明書を生成します。
+ *
+ * @param key 鍵
+ * @return 証明書 (失敗時は NULL)
+ */
+static
+X509 *generate_certificate(EVP_PKEY *key)
+{
+    X509 *cert = X509_new();
+    if (cert == NULL)
+    {
+        return NULL;
+    }
+    X509_set_version(cert, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 24 * 60 * 60);
+    X509_set_pubkey(cert, key);
+    X509_NAME *name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *) "sslkeylog-bench", -1, -1, 0);
+    X509_set_issuer_name(cert, name);
+    if (X509_sign(cert, key, EVP_sha256()) == 0)
+    {
+        X509_free(cert);
+        return NULL;
+    }
+    return cert;
+}
+
+/**
+ * 計測スレッド。
+ *
+ * @param arg スレッド毎の計測結果 (BenchThread)
+ * @return NULL 固定
+ */
+static
+void *bench_thread(void *arg)
+{
+    BenchThread *worker = (BenchThread *) arg;
+    pthread_barrier_wait(&start_barrier);
+    for (int i = 0; i < worker->count; i++)
+    {
+        uint64_t start = now_ns();
+        if (handshake() != 0)
+        {
+            worker->failed++;
+        }
+        worker->latencies[i] = now_ns() - start;
+    }
+    return NULL;
+}
+
+/**
+ * メモリ BIO のペアにて、クライアント・サーバー間のハンドシェイクを 1 回実行します。
+ * (OpenSSL 1.1.0 の経路も計測できるよう、SSL_connect / SSL_accept を利用する)
+ *
+ * @return 0: 成功 / -1: 失敗
+ */
+static
+int handshake(void)
+{
+    SSL *server = SSL_new(server_ctx);
+    SSL *client = SSL_new(client_ctx);
+    BIO *server_bio = NULL;
+    BIO *client_bio = NULL;
+    int ret = -1;
+    if (server == NULL || client == NULL || BIO_new_bio_pair(&server_bio, 0, &client_bio, 0) != 1)
+    {
+        goto end;
+    }
+    SSL_set_bio(server, server_bio, server_bio);
+    SSL_set_bio(client, client_bio, client_bio);
+
+    int server_done = 0;
+    int client_done = 0;
+    for (int i = 0; i < 100 && !(server_done && client_done); i++)
+    {
+        if (!client_done)
+        {
+            client_done = (SSL_connect(client) == 1);
+        }
+        if (!server_done)
+        {
+            server_done = (SSL_accept(server) == 1);
+        }
+    }
+    ret = (server_done && client_done) ? 0 : -1;
+    for (int i = 0; ret == 0 && i < renegotiations; i++)
+    {
+        ret = renegotiate(client, server, i % 2);
+    }
+
+end:
+    SSL_free(server);
+    SSL_free(client);
+    return ret;
+}
+
+/**
+ * クライアントから再ネゴシエーションを開始し、アプリケーションデータの読み書き
+ * (SSL_read/SSL_write) の内部で完了させます。
+ *
+ * @param client クライアントの SSL オブジェクト (ハンドシェイク完了済み)
+ * @param server サーバーの SSL オブジェクト (ハンドシェイク完了済み)
+ * @param abbreviated 1: セッションを再利用した短縮ハンドシェイク / 0: フルハンドシェイク
+ * @return 0: 成功 / -1: 失敗
+ */
+static
+int renegotiate(SSL *client, SSL *server, int abbreviated)
+{
+    if ((abbreviated ? SSL_renegotiate_abbreviated(client) : SSL_renegotiate(client)) != 1)
+    {
+        return -1;
+    }
+    char buf[16];
+    for (int i = 0; i < 100; i++)
+    {
+        SSL_write(client, "c", 1);
+        SSL_read(server, buf, sizeof(buf));
+        SSL_write(server, "s", 1);
+        SSL_read(client, buf, sizeof(buf));
+        if (!SSL_renegotiate_pending(client) && SSL_is_init_finished(client) && SSL_is_init_finished(server))
+        {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * 単調増加する現在時刻を取得します。
+ *
+ * @return 現在時刻 [ns]
+ */
+static
+uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+/**
+ * プロセス全体の書き込み系システムコール数を取得します。(/proc/self/io の syscw)
+ *
+ * @return システムコール数 (取得できない場合 -1)
+ */
+static
+long write_syscalls(void)
+{
+    FILE *fp = fopen("/proc/self/io", "r");
+    if (fp == NULL)
+    {
+        return -1;
+    }
+    long value = -1;
+    char line[128];
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        if (sscanf(line, "syscw: %ld", &value) == 1)
+        {
+            break;
+        }
+    }
+    fclose(fp);
+    return value;
+}
+
+/**
+ * 所要時間を昇順に比較します。
+ */
+static
+int compare_u64(const void *a, const void *b)
+{
+    uint64_t va = *(const uint64_t *) a;
+    uint64_t vb = *(const uint64_t *) b;
+    return (va > vb) - (va < vb);
+}
+
+/**
+ * 使い方を表示します。
+ */
+static
+void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-t threads] [-n handshakes] [-2|-3] [-r renegotiations] [-l label]\n", prog);
+    fprintf(stderr, "  Run in-memory TLS handshakes and report handshakes/sec, p50/p99 latency\n");
+    fprintf(stderr, "  and write syscalls per handshake. (-2: TLS 1.2, -3: TLS 1.3 (default))\n");
+    fprintf(stderr, "  -r: renegotiate inside SSL_read/SSL_write after each handshake (TLS 1.2 only)\n");
+}
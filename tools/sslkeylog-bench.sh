@@ -0,0 +1,57 @@
+#!/bin/sh
+# ==============================================================================
+#  libsslkeylog.so のオーバーヘッド計測 (make bench)
+#
+#  LD_PRELOAD なし (baseline)、SSLKEYLOGFILE 未設定の LD_PRELOAD あり (disabled) と、
+#  各出力モードを指定した LD_PRELOAD ありで bin/sslkeylog-bench を実行し、結果を一覧表示する。
+#  OpenSSL 1.1.0 の経路 (ハンドシェイク関数のフック) は、SSLKEYLOG_FORCE_LEGACY=1 にて計測する。
+#  (1.1.0 の経路は TLS 1.3 のキーを出力できないため、TLS 1.2 のみ計測する)
+#
+#  環境変数:
+#    BENCH_THREADS    : スレッド数の一覧 (デフォルト: "1 2 4 8")
+#    BENCH_HANDSHAKES : スレッドあたりのハンドシェイク数 (デフォルト: 500)
+#    BENCH_DIR        : キーログファイルの出力先ディレクトリ (デフォルト: 一時ディレクトリ)
+# ==============================================================================
+set -e
+
+cd "$(dirname "$0")/.."
+LIB="$(pwd)/libsslkeylog.so"
+BENCH="$(pwd)/bin/sslkeylog-bench"
+THREADS="${BENCH_THREADS:-1 2 4 8}"
+HANDSHAKES="${BENCH_HANDSHAKES:-500}"
+DIR="${BENCH_DIR:-$(mktemp -d)}"
+
+# ラベル TLSオプション 環境変数...
+run()
+{
+    label="$1"
+    versions="$2"
+    shift 2
+    for threads in $THREADS; do
+        for tls in $versions; do
+            rm -f "$DIR"/bench.log*
+            if [ "$label" = "baseline" ]; then
+                "$BENCH" -t "$threads" -n "$HANDSHAKES" $tls -l "$label"
+            elif [ "$label" = "disabled" ]; then
+                env -u SSLKEYLOGFILE LD_PRELOAD="$LIB" \
+                    "$BENCH" -t "$threads" -n "$HANDSHAKES" $tls -l "$label"
+            else
+                env LD_PRELOAD="$LIB" SSLKEYLOGFILE="$DIR/bench.log" "$@" \
+                    "$BENCH" -t "$threads" -n "$HANDSHAKES" $tls -l "$label"
+            fi
+        done
+    done
+}
+
+run baseline "-3 -2"
+run disabled "-3 -2"
+run sync     "-3 -2"
+run batch    "-3 -2" SSLKEYLOG_BATCH_BYTES=65536
+run async    "-3 -2" SSLKEYLOG_ASYNC=1
+run mmap     "-3 -2" SSLKEYLOG_MMAP=1
+run legacy   "-2"    SSLKEYLOG_FORCE_LEGACY=1
+
+rm -f "$DIR"/bench.log*
+if [ -z "$BENCH_DIR" ]; then
+    rmdir "$DIR"
+fi
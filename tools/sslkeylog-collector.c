@@ -0,0 +1,313 @@
+/**
+ * ソケット出力モード (SSLKEYLOGFILE=unix:<パス> / udp://<ホスト>:<ポート>) で
+ * 送信されたキー情報を受信し、1 つのファイルに追記するコレクタ。
+ *
+ * 複数のプロセスからの送信をまとめて受信できる。
+ * 各データグラムには完全なレコード (テキスト形式の行、またはバイナリ形式のレコード) のみが
+ * 含まれるため、受信したデータグラムをそのまま出力する。
+ * SIGINT, SIGTERM を受信すると終了する。(UNIX ドメインソケットのファイルは削除する)
+ *
+ * 使い方:
+ *   sslkeylog-collector [-o 出力ファイル] アドレス
+ *   (出力ファイル未指定時は標準出力に出力する)
+ *   例: sslkeylog-collector -o sslkey.log unix:/run/sslkeylog.sock
+ *       sslkeylog-collector -o sslkey.log udp://0.0.0.0:9999
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+
+// =============================================================================
+//  マクロ定義
+// =============================================================================
+#define RECEIVE_MESSAGES 64
+#define RECEIVE_BUFFER_SIZE (64 * 1024)
+#define RECEIVE_SOCKET_BUFFER_SIZE (4 * 1024 * 1024)
+
+
+// =============================================================================
+//  プロトタイプ宣言
+// =============================================================================
+static int open_socket(const char *address, char *unix_path, size_t unix_path_size);
+static int write_all(int fd, const char *buf, size_t len);
+static void on_signal(int sig);
+static void usage(const char *prog);
+
+
+// =============================================================================
+//  内部変数
+// =============================================================================
+static volatile sig_atomic_t terminated = 0;
+
+
+// =============================================================================
+//  メイン
+// =============================================================================
+int main(int argc, char *argv[])
+{
+    const char *output_name = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "o:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'o':
+            output_name = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return (opt == 'h') ? 0 : 1;
+        }
+    }
+    if (optind + 1 != argc)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    int out = STDOUT_FILENO;
+    if (output_name != NULL)
+    {
+        out = open(output_name, O_WRONLY | O_APPEND | O_CREAT, 0644);
+        if (out < 0)
+        {
+            perror(output_name);
+            return 1;
+        }
+    }
+
+    char unix_path[sizeof(((struct sockaddr_un *) 0)->sun_path)] = { 0 };
+    int sock = open_socket(argv[optind], unix_path, sizeof(unix_path));
+    if (sock < 0)
+    {
+        return 1;
+    }
+
+    // recvmmsg を中断させるため、SA_RESTART は指定しない。
+    struct sigaction sa = { 0 };
+    sa.sa_handler = on_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    static char buffers[RECEIVE_MESSAGES][RECEIVE_BUFFER_SIZE];
+    struct mmsghdr messages[RECEIVE_MESSAGES];
+    struct iovec iov[RECEIVE_MESSAGES];
+    int ret = 0;
+    while (!terminated)
+    {
+        memset(messages, 0, sizeof(messages));
+        for (int i = 0; i < RECEIVE_MESSAGES; i++)
+        {
+            iov[i].iov_base = buffers[i];
+            iov[i].iov_len = RECEIVE_BUFFER_SIZE;
+            messages[i].msg_hdr.msg_iov = &iov[i];
+            messages[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        // 1 つ以上受信するまで待ち、受信済みのものをまとめて取り出す。
+        int count = recvmmsg(sock, messages, RECEIVE_MESSAGES, MSG_WAITFORONE, NULL);
+        if (count < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("recvmmsg");
+            ret = 1;
+            break;
+        }
+        for (int i = 0; i < count; i++)
+        {
+            if (write_all(out, buffers[i], messages[i].msg_len) != 0)
+            {
+                perror("write");
+                ret = 1;
+                terminated = 1;
+                break;
+            }
+        }
+    }
+
+    close(sock);
+    if (unix_path[0] != '\0')
+    {
+        unlink(unix_path);
+    }
+    if (out != STDOUT_FILENO)
+    {
+        close(out);
+    }
+    return ret;
+}
+
+
+// =============================================================================
+//  内部関数
+// =============================================================================
+
+/**
+ * 指定されたアドレスで受信するソケットを生成します。
+ *
+ * @param address アドレス ("unix:<パス>" または "udp://<ホスト>:<ポート>"、IPv6 は "[<アドレス>]:<ポート>")
+ * @param unix_path UNIX ドメインソケットのパスの格納先 (終了時の削除用。UDP の場合は変更しない)
+ * @param unix_path_size unix_path のサイズ
+ * @return ソケット (失敗時は -1)
+ */
+static
+int open_socket(const char *address, char *unix_path, size_t unix_path_size)
+{
+    struct sockaddr_storage addr = { 0 };
+    socklen_t addr_len;
+    if (strncmp(address, "unix:", 5) == 0)
+    {
+        struct sockaddr_un *un = (struct sockaddr_un *) &addr;
+        const char *path = address + 5;
+        if (strlen(path) >= unix_path_size)
+        {
+            fprintf(stderr, "%s: path too long\n", address);
+            return -1;
+        }
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, path);
+        addr_len = (socklen_t) sizeof(struct sockaddr_un);
+
+        // 前回の実行で残ったソケットファイルを削除する。
+        unlink(path);
+        strcpy(unix_path, path);
+    }
+    else if (strncmp(address, "udp://", 6) == 0)
+    {   // ホスト名とポートに分割する。
+        char host[NI_MAXHOST];
+        const char *p = address + 6;
+        const char *port = NULL;
+        size_t host_len;
+        if (*p == '[')
+        {   // IPv6 アドレス
+            const char *end = strchr(p, ']');
+            if (end == NULL || end[1] != ':')
+            {
+                fprintf(stderr, "%s: invalid address\n", address);
+                return -1;
+            }
+            p++;
+            host_len = (size_t) (end - p);
+            port = end + 2;
+        }
+        else
+        {
+            port = strrchr(p, ':');
+            if (port == NULL)
+            {
+                fprintf(stderr, "%s: invalid address\n", address);
+                return -1;
+            }
+            host_len = (size_t) (port - p);
+            port++;
+        }
+        if (host_len >= sizeof(host))
+        {
+            fprintf(stderr, "%s: invalid address\n", address);
+            return -1;
+        }
+        memcpy(host, p, host_len);
+        host[host_len] = '\0';
+
+        struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_DGRAM, .ai_flags = AI_PASSIVE };
+        struct addrinfo *result = NULL;
+        int err = getaddrinfo((host_len > 0) ? host : NULL, port, &hints, &result);
+        if (err != 0)
+        {
+            fprintf(stderr, "%s: %s\n", address, gai_strerror(err));
+            return -1;
+        }
+        memcpy(&addr, result->ai_addr, result->ai_addrlen);
+        addr_len = result->ai_addrlen;
+        freeaddrinfo(result);
+    }
+    else
+    {
+        fprintf(stderr, "%s: unsupported address (use unix:<path> or udp://<host>:<port>)\n", address);
+        return -1;
+    }
+
+    int sock = socket(addr.ss_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+
+    // 多数のプロセスからの送信が集中しても取りこぼさないよう、受信バッファを拡張する。
+    // (拡張できない場合は、デフォルトのサイズで受信する)
+    int size = RECEIVE_SOCKET_BUFFER_SIZE;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+    if (bind(sock, (struct sockaddr *) &addr, addr_len) != 0)
+    {
+        perror(address);
+        close(sock);
+        unix_path[0] = '\0';
+        return -1;
+    }
+    return sock;
+}
+
+/**
+ * 指定されたバッファの内容を全てファイルに書き込みます。
+ *
+ * @param fd ファイルディスクリプタ
+ * @param buf 書き込むデータ
+ * @param len 書き込むデータのサイズ
+ * @return 0: 成功 / -1: 書き込みエラー
+ */
+static
+int write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t written = write(fd, buf, len);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        buf += written;
+        len -= (size_t) written;
+    }
+    return 0;
+}
+
+/**
+ * 終了シグナルのハンドラ。
+ */
+static
+void on_signal(int sig)
+{
+    (void) sig;
+    terminated = 1;
+}
+
+/**
+ * 使い方を表示します。
+ */
+static
+void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-o output] address\n", prog);
+    fprintf(stderr, "  Receive key log datagrams on address (unix:<path> or udp://<host>:<port>)\n");
+    fprintf(stderr, "  and append them to output.\n");
+}
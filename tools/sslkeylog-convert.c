@@ -0,0 +1,683 @@
+/**
+ * バイナリ形式 (SSLKEYLOG_FORMAT=binary) で出力されたキーログファイルを、
+ * Wireshark 互換のテキスト形式 (NSS Key Log Format) に変換する。
+ *
+ * 複数のファイルが指定された場合 (シャード出力、ローテーションなど)、
+ * 全ファイルのレコードをタイムスタンプ順に並べて 1 つのファイルに出力する。
+ * テキストのまま格納された行 (KEYLOG_BINARY_LABEL_TEXT) は、そのまま出力する。
+ * 形式不正のレコード (書き込み途中で終了した末尾など) は読み飛ばす。
+ *
+ * -d (--decompress) を指定した場合、圧縮出力 (SSLKEYLOG_COMPRESS=zstd|lz4) されたファイルを展開する。
+ * 展開した内容がテキスト形式の場合はそのまま (ファイルの指定順に) 出力し、
+ * バイナリ形式の場合は同様にテキスト形式に変換して出力する。
+ * 不完全なフレーム (書き込み途中で終了した末尾など) は読み飛ばす。
+ *
+ * 使い方:
+ *   sslkeylog-convert [-d] [-o 出力ファイル] ファイル...
+ *   (出力ファイル未指定時は標準出力に出力する)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <dlfcn.h>
+
+#include "sslkeylog-binary.h"
+#include "sslkeylog-compress.h"
+
+
+// =============================================================================
+//  構造体定義
+// =============================================================================
+/** レコード 1 件分 */
+typedef struct
+{
+    uint64_t timestamp;     // タイムスタンプ [ns]
+    size_t sequence;        // 読み込み順 (同一タイムスタンプの順序保持用)
+    unsigned char data[KEYLOG_BINARY_RECORD_SIZE];
+    char *text;             // テキストのまま格納された行 (KEYLOG_BINARY_LABEL_TEXT の場合のみ。malloc にて確保)
+    size_t text_len;        // text の長さ
+} ConvertRecord;
+
+/** 読み込んだレコードの一覧 */
+typedef struct
+{
+    ConvertRecord *records;
+    size_t count;
+    size_t capacity;
+    size_t skipped;         // 形式不正のため読み飛ばしたレコード数
+    size_t skipped_frames;  // 不完全、または形式不正のため読み飛ばしたフレーム数 (-d 指定時)
+} ConvertRecords;
+
+/** 展開したデータ */
+typedef struct
+{
+    unsigned char *data;
+    size_t len;
+    size_t capacity;
+} ConvertBuffer;
+
+
+// =============================================================================
+//  プロトタイプ宣言
+// =============================================================================
+static int load_file(ConvertRecords *records, const char *name, int decompress, FILE *out);
+static void load_records(ConvertRecords *records, const unsigned char *data, size_t len);
+static unsigned char *read_file(const char *name, size_t *len);
+static int decompress_data(ConvertRecords *records, ConvertBuffer *plain, const unsigned char *data, size_t len);
+static int decompress_zstd(ConvertBuffer *plain, const unsigned char *data, size_t len, size_t *used);
+static int decompress_lz4(ConvertBuffer *plain, const unsigned char *data, size_t len, size_t *used);
+static void *load_compress_function(const char *library, const char *sym);
+static int reserve_buffer(ConvertBuffer *buffer, size_t len);
+static int add_record(ConvertRecords *records, const unsigned char *data);
+static size_t load_text_record(ConvertRecords *records, const unsigned char *data, size_t len);
+static int write_record(FILE *out, const unsigned char *data);
+static void write_hex(FILE *out, const unsigned char *data, size_t len);
+static int compare_record(const void *a, const void *b);
+static void usage(const char *prog);
+
+
+// =============================================================================
+//  メイン
+// =============================================================================
+int main(int argc, char *argv[])
+{
+    static const struct option long_options[] = {
+        { "decompress", no_argument, NULL, 'd' },
+        { "output", required_argument, NULL, 'o' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+    const char *output_name = NULL;
+    int decompress = 0;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "do:h", long_options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            decompress = 1;
+            break;
+        case 'o':
+            output_name = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return (opt == 'h') ? 0 : 1;
+        }
+    }
+    if (optind >= argc)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // 展開したテキスト形式は読み込み時に出力するため、先に出力ファイルを開く。
+    FILE *out = stdout;
+    if (output_name != NULL)
+    {
+        out = fopen(output_name, "w");
+        if (out == NULL)
+        {
+            perror(output_name);
+            return 1;
+        }
+    }
+
+    ConvertRecords records = { 0 };
+    for (int i = optind; i < argc; i++)
+    {
+        if (load_file(&records, argv[i], decompress, out) != 0)
+        {
+            return 1;
+        }
+    }
+
+    qsort(records.records, records.count, sizeof(ConvertRecord), compare_record);
+
+    for (size_t i = 0; i < records.count; i++)
+    {
+        const ConvertRecord *record = &records.records[i];
+        if (record->text != NULL)
+        {   // テキストのまま格納された行
+            fwrite(record->text, 1, record->text_len, out);
+            fputc('\n', out);
+        }
+        else if (write_record(out, record->data) != 0)
+        {
+            records.skipped++;
+        }
+    }
+    if (out != stdout)
+    {
+        fclose(out);
+    }
+
+    if (records.skipped > 0)
+    {
+        fprintf(stderr, "%zu invalid records skipped\n", records.skipped);
+    }
+    if (records.skipped_frames > 0)
+    {
+        fprintf(stderr, "%zu incomplete or invalid frames skipped\n", records.skipped_frames);
+    }
+    return 0;
+}
+
+
+// =============================================================================
+//  内部関数
+// =============================================================================
+
+/**
+ * 指定されたファイルのレコードを読み込みます。
+ * decompress が指定された場合は展開し、テキスト形式であればそのまま出力します。
+ *
+ * @param records 読み込み先
+ * @param name ファイル名
+ * @param decompress 圧縮出力されたファイルを展開するか否か
+ * @param out テキスト形式の出力先 (decompress 指定時)
+ * @return 0: 成功 / -1: 失敗
+ */
+static
+int load_file(ConvertRecords *records, const char *name, int decompress, FILE *out)
+{
+    size_t len;
+    unsigned char *data = read_file(name, &len);
+    if (data == NULL)
+    {
+        return -1;
+    }
+    if (!decompress)
+    {
+        load_records(records, data, len);
+        free(data);
+        return 0;
+    }
+
+    ConvertBuffer plain = { 0 };
+    int ret = decompress_data(records, &plain, data, len);
+    free(data);
+    if (ret != 0)
+    {
+        fprintf(stderr, "%s: cannot decompress\n", name);
+    }
+    else if (plain.len >= 2 && memcmp(plain.data + KEYLOG_BINARY_OFFSET_MAGIC, KEYLOG_BINARY_MAGIC, 2) == 0)
+    {   // バイナリ形式
+        load_records(records, plain.data, plain.len);
+    }
+    else if (fwrite(plain.data, 1, plain.len, out) != plain.len)
+    {   // テキスト形式
+        perror("write");
+        ret = -1;
+    }
+    free(plain.data);
+    return ret;
+}
+
+/**
+ * バイナリ形式のレコードを読み込みます。
+ *
+ * @param records 読み込み先
+ * @param data ファイルの内容
+ * @param len ファイルの内容の長さ
+ */
+static
+void load_records(ConvertRecords *records, const unsigned char *data, size_t len)
+{
+    size_t offset = 0;
+    for (; (offset + KEYLOG_BINARY_RECORD_SIZE) <= len; offset += KEYLOG_BINARY_RECORD_SIZE)
+    {
+        const unsigned char *record = data + offset;
+        if (memcmp(record + KEYLOG_BINARY_OFFSET_MAGIC, KEYLOG_BINARY_MAGIC, 2) != 0
+                || record[KEYLOG_BINARY_OFFSET_VERSION] != KEYLOG_BINARY_VERSION
+                || record[KEYLOG_BINARY_OFFSET_LABEL] == KEYLOG_BINARY_LABEL_TEXT_CONTINUATION)
+        {   // 形式不正 (mmap 出力モードの未使用領域、先頭のレコードが欠けた行など)
+            records->skipped++;
+            continue;
+        }
+        if (record[KEYLOG_BINARY_OFFSET_LABEL] == KEYLOG_BINARY_LABEL_TEXT)
+        {   // テキストのまま格納された行: 後続のレコードもまとめて読み込む。
+            size_t count = load_text_record(records, record, len - offset);
+            if (count == 0)
+            {
+                records->skipped++;
+                continue;
+            }
+            offset += (count - 1) * KEYLOG_BINARY_RECORD_SIZE;
+            continue;
+        }
+        if (add_record(records, record) != 0)
+        {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    if (offset != len)
+    {   // 末尾の不完全なレコード (書き込み途中で終了したなど)
+        records->skipped++;
+    }
+}
+
+/**
+ * テキストのまま格納された行 (先頭のレコードと後続のレコード) を読み込みます。
+ *
+ * @param records 読み込み先
+ * @param data 先頭のレコード
+ * @param len data 以降の長さ
+ * @return 読み込んだレコード数 (0: 後続のレコードが欠けている、または長さ不正)
+ */
+static
+size_t load_text_record(ConvertRecords *records, const unsigned char *data, size_t len)
+{
+    size_t count = data[KEYLOG_BINARY_OFFSET_TEXT_COUNT];
+    size_t text_len = (size_t) data[KEYLOG_BINARY_OFFSET_TEXT_LENGTH]
+            | ((size_t) data[KEYLOG_BINARY_OFFSET_TEXT_LENGTH + 1] << 8);
+    if (count == 0 || count != KEYLOG_BINARY_TEXT_RECORDS(text_len) || (count * KEYLOG_BINARY_RECORD_SIZE) > len)
+    {
+        return 0;
+    }
+    for (size_t i = 1; i < count; i++)
+    {
+        const unsigned char *record = data + i * KEYLOG_BINARY_RECORD_SIZE;
+        if (memcmp(record + KEYLOG_BINARY_OFFSET_MAGIC, KEYLOG_BINARY_MAGIC, 2) != 0
+                || record[KEYLOG_BINARY_OFFSET_VERSION] != KEYLOG_BINARY_VERSION
+                || record[KEYLOG_BINARY_OFFSET_LABEL] != KEYLOG_BINARY_LABEL_TEXT_CONTINUATION)
+        {
+            return 0;
+        }
+    }
+
+    char *text = (char *) malloc(text_len + 1);
+    if (text == NULL || add_record(records, data) != 0)
+    {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t chunk = (i + 1 < count) ? KEYLOG_BINARY_TEXT_CHUNK : text_len - i * KEYLOG_BINARY_TEXT_CHUNK;
+        memcpy(text + i * KEYLOG_BINARY_TEXT_CHUNK, data + i * KEYLOG_BINARY_RECORD_SIZE + KEYLOG_BINARY_OFFSET_TEXT, chunk);
+    }
+    records->records[records->count - 1].text = text;
+    records->records[records->count - 1].text_len = text_len;
+    return count;
+}
+
+/**
+ * ファイルの内容を全て読み込みます。
+ *
+ * @param name ファイル名
+ * @param len 読み込んだ長さの格納先
+ * @return ファイルの内容 (malloc にて確保。失敗した場合 NULL)
+ */
+static
+unsigned char *read_file(const char *name, size_t *len)
+{
+    FILE *fp = fopen(name, "rb");
+    if (fp == NULL)
+    {
+        perror(name);
+        return NULL;
+    }
+
+    ConvertBuffer buffer = { 0 };
+    size_t n;
+    do
+    {
+        if (reserve_buffer(&buffer, 64 * 1024) != 0)
+        {
+            fprintf(stderr, "%s: out of memory\n", name);
+            free(buffer.data);
+            fclose(fp);
+            return NULL;
+        }
+        n = fread(buffer.data + buffer.len, 1, buffer.capacity - buffer.len, fp);
+        buffer.len += n;
+    } while (n > 0);
+    if (ferror(fp))
+    {
+        perror(name);
+        free(buffer.data);
+        buffer.data = NULL;
+    }
+    fclose(fp);
+    *len = buffer.len;
+    return buffer.data;
+}
+
+/**
+ * 圧縮出力された内容 (フレームの連続) を展開します。
+ * 各フレームの形式はマジックナンバーにより判定し、展開できないフレーム以降は読み飛ばします。
+ *
+ * @param records 読み飛ばしたフレーム数の記録先
+ * @param plain 展開先
+ * @param data 圧縮された内容
+ * @param len 圧縮された内容の長さ
+ * @return 0: 成功 / -1: 圧縮ライブラリがない、またはメモリ不足
+ */
+static
+int decompress_data(ConvertRecords *records, ConvertBuffer *plain, const unsigned char *data, size_t len)
+{
+    size_t offset = 0;
+    while (offset < len)
+    {
+        size_t remain = len - offset;
+        uint32_t magic = 0;
+        for (size_t i = 0; i < 4 && i < remain; i++)
+        {
+            magic |= (uint32_t) data[offset + i] << (i * 8);
+        }
+
+        size_t used = 0;
+        int ret = 1;
+        if (remain >= 4 && magic == KEYLOG_COMPRESS_ZSTD_MAGIC)
+        {
+            ret = decompress_zstd(plain, data + offset, remain, &used);
+        }
+        else if (remain >= 4 && magic == KEYLOG_COMPRESS_LZ4_MAGIC)
+        {
+            ret = decompress_lz4(plain, data + offset, remain, &used);
+        }
+        if (ret < 0)
+        {
+            return -1;
+        }
+        if (ret > 0)
+        {   // 不完全なフレーム (書き込み途中で終了した末尾など)、または未知の形式
+            records->skipped_frames++;
+            break;
+        }
+        offset += used;
+    }
+    return 0;
+}
+
+/**
+ * zstd フレームを 1 つ展開します。
+ *
+ * @param plain 展開先 (末尾に追加する)
+ * @param data フレームの先頭
+ * @param len data 以降の長さ
+ * @param used フレームの長さの格納先
+ * @return 0: 成功 / 1: 不完全・形式不正のフレーム / -1: libzstd がない、またはメモリ不足
+ */
+static
+int decompress_zstd(ConvertBuffer *plain, const unsigned char *data, size_t len, size_t *used)
+{
+    static KeyLogCompress_ZSTD_findFrameCompressedSize find_size = NULL;
+    static KeyLogCompress_ZSTD_getFrameContentSize content_size = NULL;
+    static KeyLogCompress_ZSTD_decompress decompress = NULL;
+    static KeyLogCompress_ZSTD_isError is_error = NULL;
+    if (is_error == NULL)
+    {
+        find_size = (KeyLogCompress_ZSTD_findFrameCompressedSize)
+                load_compress_function(KEYLOG_COMPRESS_ZSTD_LIBRARY, "ZSTD_findFrameCompressedSize");
+        content_size = (KeyLogCompress_ZSTD_getFrameContentSize)
+                load_compress_function(KEYLOG_COMPRESS_ZSTD_LIBRARY, "ZSTD_getFrameContentSize");
+        decompress = (KeyLogCompress_ZSTD_decompress)
+                load_compress_function(KEYLOG_COMPRESS_ZSTD_LIBRARY, "ZSTD_decompress");
+        is_error = (KeyLogCompress_ZSTD_isError)
+                load_compress_function(KEYLOG_COMPRESS_ZSTD_LIBRARY, "ZSTD_isError");
+        if (find_size == NULL || content_size == NULL || decompress == NULL || is_error == NULL)
+        {
+            is_error = NULL;
+            return -1;
+        }
+    }
+
+    // ZSTD_compress にて圧縮したフレームには、展開後のサイズが含まれる。
+    size_t frame_size = find_size(data, len);
+    unsigned long long size = content_size(data, len);
+    if (is_error(frame_size) || size == KEYLOG_COMPRESS_ZSTD_CONTENTSIZE_UNKNOWN
+            || size == KEYLOG_COMPRESS_ZSTD_CONTENTSIZE_ERROR)
+    {
+        return 1;
+    }
+    if (reserve_buffer(plain, (size_t) size) != 0)
+    {
+        fprintf(stderr, "out of memory\n");
+        return -1;
+    }
+    size_t ret = decompress(plain->data + plain->len, (size_t) size, data, frame_size);
+    if (is_error(ret))
+    {
+        return 1;
+    }
+    plain->len += ret;
+    *used = frame_size;
+    return 0;
+}
+
+/**
+ * LZ4 フレームを 1 つ展開します。
+ * フレームの終端まで展開できない場合は、そのフレームの展開結果を破棄します。
+ *
+ * @param plain 展開先 (末尾に追加する)
+ * @param data フレームの先頭
+ * @param len data 以降の長さ
+ * @param used フレームの長さの格納先
+ * @return 0: 成功 / 1: 不完全・形式不正のフレーム / -1: liblz4 がない、またはメモリ不足
+ */
+static
+int decompress_lz4(ConvertBuffer *plain, const unsigned char *data, size_t len, size_t *used)
+{
+    static KeyLogCompress_LZ4F_createDecompressionContext create_context = NULL;
+    static KeyLogCompress_LZ4F_freeDecompressionContext free_context = NULL;
+    static KeyLogCompress_LZ4F_decompress decompress = NULL;
+    static KeyLogCompress_LZ4F_isError is_error = NULL;
+    if (is_error == NULL)
+    {
+        create_context = (KeyLogCompress_LZ4F_createDecompressionContext)
+                load_compress_function(KEYLOG_COMPRESS_LZ4_LIBRARY, "LZ4F_createDecompressionContext");
+        free_context = (KeyLogCompress_LZ4F_freeDecompressionContext)
+                load_compress_function(KEYLOG_COMPRESS_LZ4_LIBRARY, "LZ4F_freeDecompressionContext");
+        decompress = (KeyLogCompress_LZ4F_decompress)
+                load_compress_function(KEYLOG_COMPRESS_LZ4_LIBRARY, "LZ4F_decompress");
+        is_error = (KeyLogCompress_LZ4F_isError)
+                load_compress_function(KEYLOG_COMPRESS_LZ4_LIBRARY, "LZ4F_isError");
+        if (create_context == NULL || free_context == NULL || decompress == NULL || is_error == NULL)
+        {
+            is_error = NULL;
+            return -1;
+        }
+    }
+
+    void *context = NULL;
+    if (is_error(create_context(&context, KEYLOG_COMPRESS_LZ4F_VERSION)))
+    {
+        fprintf(stderr, "out of memory\n");
+        return -1;
+    }
+    size_t start = plain->len;
+    size_t offset = 0;
+    int result = 1;
+    while (offset < len)
+    {
+        if (reserve_buffer(plain, 64 * 1024) != 0)
+        {
+            fprintf(stderr, "out of memory\n");
+            result = -1;
+            break;
+        }
+        size_t dst_size = plain->capacity - plain->len;
+        size_t src_size = len - offset;
+        size_t ret = decompress(context, plain->data + plain->len, &dst_size, data + offset, &src_size, NULL);
+        if (is_error(ret))
+        {
+            break;
+        }
+        plain->len += dst_size;
+        offset += src_size;
+        if (ret == 0)
+        {   // フレームの終端
+            result = 0;
+            break;
+        }
+    }
+    free_context(context);
+    if (result != 0)
+    {
+        plain->len = start;
+    }
+    *used = offset;
+    return result;
+}
+
+/**
+ * 圧縮ライブラリの関数を取得します。(ライブラリは閉じない)
+ *
+ * @param library 圧縮ライブラリ
+ * @param sym シンボル
+ * @return 関数 (取得できない場合 NULL)
+ */
+static
+void *load_compress_function(const char *library, const char *sym)
+{
+    void *handle = dlopen(library, RTLD_LAZY);
+    if (handle == NULL)
+    {
+        fprintf(stderr, "%s not found\n", library);
+        return NULL;
+    }
+    return dlsym(handle, sym);
+}
+
+/**
+ * バッファの末尾に、指定サイズ以上の空きを確保します。
+ *
+ * @param buffer バッファ
+ * @param len 必要な空きサイズ
+ * @return 0: 成功 / -1: メモリ不足
+ */
+static
+int reserve_buffer(ConvertBuffer *buffer, size_t len)
+{
+    if ((buffer->capacity - buffer->len) >= len)
+    {
+        return 0;
+    }
+    size_t capacity = (buffer->capacity == 0) ? 64 * 1024 : buffer->capacity;
+    while ((capacity - buffer->len) < len)
+    {
+        capacity *= 2;
+    }
+    unsigned char *data = (unsigned char *) realloc(buffer->data, capacity);
+    if (data == NULL)
+    {
+        return -1;
+    }
+    buffer->data = data;
+    buffer->capacity = capacity;
+    return 0;
+}
+
+/**
+ * レコードを追加します。
+ *
+ * @param records 追加先
+ * @param data レコード (複製して保持します)
+ * @return 0: 成功 / -1: メモリ不足
+ */
+static
+int add_record(ConvertRecords *records, const unsigned char *data)
+{
+    if (records->count == records->capacity)
+    {
+        size_t capacity = (records->capacity == 0) ? 1024 : records->capacity * 2;
+        ConvertRecord *new_records = (ConvertRecord *) realloc(records->records, capacity * sizeof(ConvertRecord));
+        if (new_records == NULL)
+        {
+            return -1;
+        }
+        records->records = new_records;
+        records->capacity = capacity;
+    }
+
+    ConvertRecord *record = &records->records[records->count];
+    record->timestamp = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        record->timestamp |= (uint64_t) data[KEYLOG_BINARY_OFFSET_TIMESTAMP + i] << (i * 8);
+    }
+    record->sequence = records->count;
+    memcpy(record->data, data, KEYLOG_BINARY_RECORD_SIZE);
+    record->text = NULL;
+    record->text_len = 0;
+    records->count++;
+    return 0;
+}
+
+/**
+ * レコードをテキスト形式で出力します。
+ *
+ * @param out 出力先
+ * @param data レコード
+ * @return 0: 成功 / -1: 未知のラベル、または長さ不正
+ */
+static
+int write_record(FILE *out, const unsigned char *data)
+{
+    unsigned int label = data[KEYLOG_BINARY_OFFSET_LABEL];
+    size_t random_len = data[KEYLOG_BINARY_OFFSET_RANDOM_LENGTH];
+    size_t secret_len = data[KEYLOG_BINARY_OFFSET_SECRET_LENGTH];
+    if (label == 0 || label >= KEYLOG_BINARY_LABEL_COUNT
+            || random_len > KEYLOG_BINARY_RANDOM_MAX || secret_len > KEYLOG_BINARY_SECRET_MAX)
+    {
+        return -1;
+    }
+
+    fputs(KeyLogBinary_labels[label], out);
+    fputc(' ', out);
+    write_hex(out, data + KEYLOG_BINARY_OFFSET_RANDOM, random_len);
+    fputc(' ', out);
+    write_hex(out, data + KEYLOG_BINARY_OFFSET_SECRET, secret_len);
+    fputc('\n', out);
+    return 0;
+}
+
+/**
+ * バイト列を小文字の 16 進数文字列で出力します。
+ *
+ * @param out 出力先
+ * @param data バイト列
+ * @param len バイト列の長さ
+ */
+static
+void write_hex(FILE *out, const unsigned char *data, size_t len)
+{
+    static const char digits[] = "0123456789abcdef";
+    for (size_t i = 0; i < len; i++)
+    {
+        fputc(digits[data[i] >> 4], out);
+        fputc(digits[data[i] & 0x0f], out);
+    }
+}
+
+/**
+ * レコードを、タイムスタンプ、読み込み順の順に比較します。
+ */
+static
+int compare_record(const void *a, const void *b)
+{
+    const ConvertRecord *ra = (const ConvertRecord *) a;
+    const ConvertRecord *rb = (const ConvertRecord *) b;
+    if (ra->timestamp != rb->timestamp)
+    {
+        return (ra->timestamp < rb->timestamp) ? -1 : 1;
+    }
+    return (ra->sequence < rb->sequence) ? -1 : (ra->sequence > rb->sequence);
+}
+
+/**
+ * 使い方を表示します。
+ */
+static
+void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-d] [-o output] file...\n", prog);
+    fprintf(stderr, "  Convert binary key log files (SSLKEYLOG_FORMAT=binary) to the NSS key log format.\n");
+    fprintf(stderr, "  -d, --decompress  decompress files written with SSLKEYLOG_COMPRESS=zstd|lz4\n");
+}
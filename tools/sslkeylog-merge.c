@@ -0,0 +1,266 @@
+/**
+ * シャード出力モードで出力された複数のキーログファイルを、
+ * タイムスタンプ順に 1 つの Wireshark 互換ファイルにまとめる。
+ *
+ * 各キー情報の前のコメント行 ("# <UNIX時刻[ns]>") をタイムスタンプとして扱う。
+ * タイムスタンプが無いキー情報は、同じファイル内の直前のタイムスタンプを引き継ぐ。
+ * タイムスタンプのコメント行は出力しない。
+ *
+ * 使い方:
+ *   sslkeylog-merge [-o 出力ファイル] ファイル...
+ *   (出力ファイル未指定時は標準出力に出力する)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+
+// =============================================================================
+//  構造体定義
+// =============================================================================
+/** キー情報 1 行分 */
+typedef struct
+{
+    uint64_t timestamp;     // タイムスタンプ [ns]
+    size_t sequence;        // 読み込み順 (同一タイムスタンプの順序保持用)
+    char *line;             // キー情報 (改行含む)
+} MergeRecord;
+
+/** 読み込んだキー情報の一覧 */
+typedef struct
+{
+    MergeRecord *records;
+    size_t count;
+    size_t capacity;
+} MergeRecords;
+
+
+// =============================================================================
+//  プロトタイプ宣言
+// =============================================================================
+static int load_file(MergeRecords *records, const char *name);
+static int add_record(MergeRecords *records, uint64_t timestamp, const char *line);
+static int parse_timestamp(const char *line, uint64_t *timestamp);
+static int compare_record(const void *a, const void *b);
+static void usage(const char *prog);
+
+
+// =============================================================================
+//  メイン
+// =============================================================================
+int main(int argc, char *argv[])
+{
+    const char *output_name = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "o:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'o':
+            output_name = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return (opt == 'h') ? 0 : 1;
+        }
+    }
+    if (optind >= argc)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    MergeRecords records = { 0 };
+    for (int i = optind; i < argc; i++)
+    {
+        if (load_file(&records, argv[i]) != 0)
+        {
+            return 1;
+        }
+    }
+
+    qsort(records.records, records.count, sizeof(MergeRecord), compare_record);
+
+    FILE *out = stdout;
+    if (output_name != NULL)
+    {
+        out = fopen(output_name, "w");
+        if (out == NULL)
+        {
+            perror(output_name);
+            return 1;
+        }
+    }
+    for (size_t i = 0; i < records.count; i++)
+    {
+        fputs(records.records[i].line, out);
+    }
+    if (out != stdout)
+    {
+        fclose(out);
+    }
+    return 0;
+}
+
+
+// =============================================================================
+//  内部関数
+// =============================================================================
+
+/**
+ * 指定されたファイルのキー情報を読み込みます。
+ *
+ * @param records 読み込み先
+ * @param name ファイル名
+ * @return 0: 成功 / -1: 失敗
+ */
+static
+int load_file(MergeRecords *records, const char *name)
+{
+    FILE *fp = fopen(name, "r");
+    if (fp == NULL)
+    {
+        perror(name);
+        return -1;
+    }
+
+    uint64_t timestamp = 0;
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    int ret = 0;
+    while ((len = getline(&line, &size, fp)) != -1)
+    {
+        if (line[0] == '#')
+        {   // コメント行: タイムスタンプであれば保持する。
+            parse_timestamp(line, &timestamp);
+            continue;
+        }
+        if (line[0] == '\n' || line[0] == '\0')
+        {   // 空行
+            continue;
+        }
+        if (line[len - 1] != '\n')
+        {   // 末尾の改行が無い行 (書き込み途中で終了したなど) は、改行を補う。
+            char *fixed = (char *) realloc(line, len + 2);
+            if (fixed == NULL)
+            {
+                ret = -1;
+                break;
+            }
+            line = fixed;
+            size = len + 2;
+            line[len] = '\n';
+            line[len + 1] = '\0';
+        }
+        if (add_record(records, timestamp, line) != 0)
+        {
+            ret = -1;
+            break;
+        }
+    }
+    free(line);
+    fclose(fp);
+    if (ret != 0)
+    {
+        fprintf(stderr, "%s: out of memory\n", name);
+    }
+    return ret;
+}
+
+/**
+ * キー情報を追加します。
+ *
+ * @param records 追加先
+ * @param timestamp タイムスタンプ
+ * @param line キー情報 (複製して保持します)
+ * @return 0: 成功 / -1: メモリ不足
+ */
+static
+int add_record(MergeRecords *records, uint64_t timestamp, const char *line)
+{
+    if (records->count == records->capacity)
+    {
+        size_t capacity = (records->capacity == 0) ? 1024 : records->capacity * 2;
+        MergeRecord *new_records = (MergeRecord *) realloc(records->records, capacity * sizeof(MergeRecord));
+        if (new_records == NULL)
+        {
+            return -1;
+        }
+        records->records = new_records;
+        records->capacity = capacity;
+    }
+
+    char *copy = strdup(line);
+    if (copy == NULL)
+    {
+        return -1;
+    }
+    MergeRecord *record = &records->records[records->count];
+    record->timestamp = timestamp;
+    record->sequence = records->count;
+    record->line = copy;
+    records->count++;
+    return 0;
+}
+
+/**
+ * タイムスタンプのコメント行 ("# <UNIX時刻[ns]>") を解析します。
+ *
+ * @param line コメント行
+ * @param timestamp 解析したタイムスタンプの格納先 (解析できない場合は変更しない)
+ * @return 0: 成功 / -1: タイムスタンプではない
+ */
+static
+int parse_timestamp(const char *line, uint64_t *timestamp)
+{
+    const char *p = line + 1;
+    while (*p == ' ')
+    {
+        p++;
+    }
+    if (*p < '0' || *p > '9')
+    {
+        return -1;
+    }
+
+    uint64_t value = 0;
+    while (*p >= '0' && *p <= '9')
+    {
+        value = value * 10 + (uint64_t) (*p - '0');
+        p++;
+    }
+    if (*p != '\n' && *p != '\0')
+    {
+        return -1;
+    }
+    *timestamp = value;
+    return 0;
+}
+
+/**
+ * キー情報を、タイムスタンプ、読み込み順の順に比較します。
+ */
+static
+int compare_record(const void *a, const void *b)
+{
+    const MergeRecord *ra = (const MergeRecord *) a;
+    const MergeRecord *rb = (const MergeRecord *) b;
+    if (ra->timestamp != rb->timestamp)
+    {
+        return (ra->timestamp < rb->timestamp) ? -1 : 1;
+    }
+    return (ra->sequence < rb->sequence) ? -1 : (ra->sequence > rb->sequence);
+}
+
+/**
+ * 使い方を表示します。
+ */
+static
+void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-o output] file...\n", prog);
+    fprintf(stderr, "  Merge sharded key log files into one file ordered by timestamp.\n");
+}
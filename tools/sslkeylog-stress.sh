@@ -0,0 +1,248 @@
+#!/bin/sh
+# ==============================================================================
+#  libsslkeylog.so の並行出力の検証とスループット計測 (make stress)
+#
+#  bin/sslkeylog-bench にて、複数スレッドから同時にハンドシェイクを行い、各出力モードについて
+#  以下を検証する。いずれかを満たさない場合は FAIL を表示し、終了コード 1 で終了する。
+#    - 全ての行が、完全な NSS Key Log Format の行である (行の混在・分断がない)
+#    - 出力した行数 + 統計情報の破棄数 (drops) = ハンドシェイク数から求めた期待行数
+#    - 統計情報の出力行数 (lines) = 出力した行数
+#    - 破棄がない場合、クライアントランダム毎の行数が全て期待値どおり (欠落・重複がない)
+#  SSL_CTX_set_keylog_callback の経路 (KeyLogFile_callback) と、
+#  OpenSSL 1.1.0 の経路 (KeyLogFile_raw_dump。SSLKEYLOG_FORCE_LEGACY=1) の両方を検証する。
+#  ただし、OpenSSL 1.1.1 以降のヘッダでビルドしたライブラリで検証するため、1.1.0 のヘッダでビルドした
+#  ライブラリ (SSL_CTX_set_keylog_callback をフックしない) は対象外である。
+#  ハンドシェイク関数 (SSL_connect/SSL_do_handshake/SSL_accept) がエクスポートされていることのみ確認する。
+#  renego は、SSL_read/SSL_write の内部で再ネゴシエーション (フル、セッション再利用を交互) を行い、
+#  再ネゴシエーション毎のキー情報も出力されることを検証する。(TLS 1.2 のみ)
+#
+#  計測したスループット (hs/s) は STRESS_RESULTS に保存でき、STRESS_BASELINE に前回の結果を
+#  指定すると、許容範囲 (STRESS_TOLERANCE) を超えて低下した組み合わせを FAIL とする。
+#
+#  環境変数:
+#    STRESS_THREADS    : スレッド数の一覧 (デフォルト: "8")
+#    STRESS_HANDSHAKES : スレッドあたりのハンドシェイク数 (デフォルト: 500)
+#    STRESS_DIR        : キーログファイルの出力先ディレクトリ (デフォルト: 一時ディレクトリ)
+#    STRESS_STAGING_DIR: ステージングファイルの出力先 (デフォルト: /dev/shm、存在しない場合は STRESS_DIR)
+#    STRESS_RESULTS    : 計測結果の保存先 (デフォルト: 保存しない)
+#    STRESS_BASELINE   : 比較する計測結果 (STRESS_RESULTS で保存したもの)
+#    STRESS_TOLERANCE  : 許容するスループットの低下率 [%] (デフォルト: 20)
+# ==============================================================================
+set -e
+
+cd "$(dirname "$0")/.."
+LIB="$(pwd)/libsslkeylog.so"
+BENCH="$(pwd)/bin/sslkeylog-bench"
+CONVERT="$(pwd)/bin/sslkeylog-convert"
+COLLECTOR="$(pwd)/bin/sslkeylog-collector"
+THREADS="${STRESS_THREADS:-8}"
+HANDSHAKES="${STRESS_HANDSHAKES:-500}"
+TOLERANCE="${STRESS_TOLERANCE:-20}"
+DIR="${STRESS_DIR:-$(mktemp -d)}"
+STAGING_DIR="${STRESS_STAGING_DIR:-/dev/shm}"
+if [ ! -d "$STAGING_DIR" ]; then
+    STAGING_DIR="$DIR"
+fi
+RESULTS="$DIR/stress.results"
+: > "$RESULTS"
+FAILED=0
+RENEGOTIATIONS=0
+
+# NSS Key Log Format の 1 行 (ラベル、クライアントランダム、シークレット (32 または 48 バイト))
+PATTERN='^(CLIENT_RANDOM|CLIENT_EARLY_TRAFFIC_SECRET|CLIENT_HANDSHAKE_TRAFFIC_SECRET|SERVER_HANDSHAKE_TRAFFIC_SECRET|CLIENT_TRAFFIC_SECRET_0|SERVER_TRAFFIC_SECRET_0|EARLY_EXPORTER_SECRET|EXPORTER_SECRET) [0-9a-f]{64} ([0-9a-f]{64}|[0-9a-f]{96})$'
+
+# 統計情報ファイルの項目を取得する。 (項目名)
+stat_value()
+{
+    if [ ! -f "$DIR/stress.stats" ]; then
+        return 0
+    fi
+    awk -F': ' -v key="$1" '$1 == key { print $2 }' "$DIR/stress.stats"
+}
+
+# 出力されたキーログを、検証用のテキスト ($DIR/stress.txt) にする。 (形式)
+# 変換時のエラー (読み飛ばしたレコード・フレーム) は標準エラー出力 ($DIR/stress.convert) に出力される。
+extract()
+{
+    : > "$DIR/stress.convert"
+    case "$1" in
+    shards)
+        # シャードのタイムスタンプのコメント行は、形式が正しいもののみ除く。
+        cat "$DIR"/stress.log* | grep -Ev '^# [0-9]+$' > "$DIR/stress.txt" || true
+        ;;
+    binary)
+        "$CONVERT" -o "$DIR/stress.txt" "$DIR/stress.log" 2> "$DIR/stress.convert"
+        ;;
+    compress)
+        "$CONVERT" -d -o "$DIR/stress.txt" "$DIR/stress.log" 2> "$DIR/stress.convert"
+        ;;
+    *)
+        cat "$DIR/stress.log" > "$DIR/stress.txt"
+        ;;
+    esac
+}
+
+# 1 回分の出力を検証する。検証結果を表示し、不合格の場合は FAILED を設定する。
+# (ラベル 経路 TLSオプション スレッド数 特記事項 ベンチマーク結果)
+verify()
+{
+    per_hs=2
+    tls_name=TLS1.2
+    if [ "$3" = "-3" ]; then
+        per_hs=10
+        tls_name=TLS1.3
+    fi
+    # 再ネゴシエーション毎に、新しいクライアントランダムの行が出力される。
+    expected=$(( $4 * HANDSHAKES * per_hs * (1 + RENEGOTIATIONS) ))
+    lines=$(grep -c '' "$DIR/stress.txt" || true)
+    complete=$(wc -l < "$DIR/stress.txt")
+    bad=$(grep -Evc "$PATTERN" "$DIR/stress.txt" || true)
+    drops=$(stat_value drops)
+    stat_lines=$(stat_value lines)
+    hs=$(echo "$6" | awk '{ for (i = 2; i <= NF; i++) if ($i == "hs/s") print $(i - 1) }')
+
+    reason=""
+    if [ -n "$5" ]; then
+        reason="$5"
+    elif [ -z "$drops" ] || [ -z "$stat_lines" ]; then
+        reason="no stats"
+    elif [ "$lines" -ne "$complete" ]; then
+        reason="incomplete last line"
+    elif [ "$bad" -ne 0 ]; then
+        reason="$bad malformed lines"
+    elif [ $(( lines + drops )) -ne "$expected" ]; then
+        reason="lines + drops != $expected"
+    elif [ "$stat_lines" -ne "$lines" ]; then
+        reason="stats lines=$stat_lines"
+    elif [ -s "$DIR/stress.convert" ]; then
+        reason="$(head -n 1 "$DIR/stress.convert")"
+    elif [ "$drops" -eq 0 ]; then
+        # クライアントランダム毎の行数 (クライアント・サーバーの両方が出力する)
+        uneven=$(awk -v n="$per_hs" '{ count[$2]++ } END { bad = 0; for (r in count) if (count[r] != n) bad++; print bad }' "$DIR/stress.txt")
+        if [ "$uneven" -ne 0 ]; then
+            reason="$uneven connections with missing or duplicated lines"
+        fi
+    fi
+
+    if [ -n "$reason" ]; then
+        status=FAIL
+        FAILED=1
+    else
+        status=OK
+    fi
+    printf '%-4s %-10s %-8s %-7s threads=%-3s lines=%-8s drops=%-6s %10s hs/s  %s\n' \
+        "$status" "$1" "$2" "$tls_name" "$4" "$lines" "${drops:-?}" "${hs:-?}" "$reason"
+    if [ "$status" = OK ]; then
+        printf '%s\t%s\t%s\t%s\t%s\n' "$1" "$2" "$tls_name" "$4" "$hs" >> "$RESULTS"
+    fi
+}
+
+# ラベル 形式 TLSオプション 環境変数...
+# (形式: text, shards, binary, compress, socket。経路は SSLKEYLOG_FORCE_LEGACY の有無で判定する)
+run()
+{
+    label="$1"
+    kind="$2"
+    versions="$3"
+    shift 3
+    path=callback
+    case " $* " in
+    *" SSLKEYLOG_FORCE_LEGACY=1 "*)
+        path=legacy
+        ;;
+    esac
+    for threads in $THREADS; do
+        for tls in $versions; do
+            rm -f "$DIR"/stress.log* "$DIR"/stress.stats "$DIR"/stress.txt "$DIR"/stress.sock
+            target="$DIR/stress.log"
+            collector=""
+            if [ "$kind" = socket ]; then
+                target="unix:$DIR/stress.sock"
+                "$COLLECTOR" -o "$DIR/stress.log" "$target" &
+                collector=$!
+                while [ ! -S "$DIR/stress.sock" ]; do
+                    sleep 0.1
+                done
+            fi
+
+            note=""
+            renegotiate=""
+            if [ "$RENEGOTIATIONS" -gt 0 ]; then
+                renegotiate="-r $RENEGOTIATIONS"
+            fi
+            result=$(env LD_PRELOAD="$LIB" SSLKEYLOGFILE="$target" SSLKEYLOG_STATS="$DIR/stress.stats" "$@" \
+                "$BENCH" -t "$threads" -n "$HANDSHAKES" $tls $renegotiate -l "$label" 2> "$DIR/stress.err") || note="bench failed"
+            if [ -n "$collector" ]; then
+                kill "$collector"
+                wait "$collector" || true
+            fi
+            if grep -q 'handshakes failed' "$DIR/stress.err"; then
+                note="$(grep 'handshakes failed' "$DIR/stress.err")"
+            elif grep -q 'SSLKEYLOG_COMPRESS' "$DIR/stress.err"; then
+                # 圧縮ライブラリがない環境では検証しない。
+                printf '%-4s %-10s %-8s %s\n' SKIP "$label" "$path" "$(head -n 1 "$DIR/stress.err")"
+                continue
+            fi
+            touch "$DIR/stress.log"
+            extract "$kind"
+            verify "$label" "$path" "$tls" "$threads" "$note" "$result"
+        done
+    done
+}
+
+# ハンドシェイク関数のフックは、ビルドに用いたヘッダのバージョンによらずエクスポートされていること
+# (OpenSSL 1.1.0 の経路は、これらのフックからのみ実行される)
+for symbol in SSL_connect SSL_do_handshake SSL_accept; do
+    if ! nm -D --defined-only "$LIB" | awk '{ print $NF }' | grep -qx "$symbol"; then
+        printf '%-4s %-10s %s\n' FAIL export "$symbol is not exported"
+        FAILED=1
+    fi
+done
+
+for legacy in "" SSLKEYLOG_FORCE_LEGACY=1; do
+    # OpenSSL 1.1.0 の経路は TLS 1.3 のキーを出力できないため、TLS 1.2 のみ検証する。
+    versions="-3 -2"
+    if [ -n "$legacy" ]; then
+        versions="-2"
+    fi
+    run sync     text     "$versions" $legacy
+    run batch    text     "$versions" $legacy SSLKEYLOG_BATCH_BYTES=65536
+    run async    text     "$versions" $legacy SSLKEYLOG_ASYNC=1
+    run io_uring text     "$versions" $legacy SSLKEYLOG_ASYNC=1 SSLKEYLOG_IO_URING=1
+    run mmap     text     "$versions" $legacy SSLKEYLOG_MMAP=1
+    run shards   shards   "$versions" $legacy SSLKEYLOG_SHARDS=4 SSLKEYLOG_BATCH_BYTES=65536
+    run staging  text     "$versions" $legacy SSLKEYLOG_STAGING_DIR="$STAGING_DIR"
+    run binary   binary   "$versions" $legacy SSLKEYLOG_FORMAT=binary
+    run zstd     compress "$versions" $legacy SSLKEYLOG_COMPRESS=zstd
+    run lz4      compress "$versions" $legacy SSLKEYLOG_COMPRESS=lz4
+    run socket   socket   "$versions" $legacy
+    # 再ネゴシエーション (ベンチマークの -r。TLS 1.3 には再ネゴシエーションがない)
+    RENEGOTIATIONS=2
+    run renego   text     "-2"        $legacy
+    RENEGOTIATIONS=0
+done
+
+# 前回の計測結果との比較 (ラベル、経路、TLS バージョン、スレッド数が一致するもの)
+if [ -n "$STRESS_BASELINE" ]; then
+    if ! awk -F'\t' -v tolerance="$TOLERANCE" '
+        NR == FNR { baseline[$1 FS $2 FS $3 FS $4] = $5; next }
+        ($1 FS $2 FS $3 FS $4) in baseline {
+            base = baseline[$1 FS $2 FS $3 FS $4]
+            if (base > 0 && $5 < base * (100 - tolerance) / 100) {
+                printf "FAIL %-10s %-8s %-7s threads=%-3s %10s hs/s  (baseline %s hs/s)\n", $1, $2, $3, $4, $5, base
+                regressed = 1
+            }
+        }
+        END { exit regressed }' "$STRESS_BASELINE" "$RESULTS"; then
+        FAILED=1
+    fi
+fi
+if [ -n "$STRESS_RESULTS" ]; then
+    cp "$RESULTS" "$STRESS_RESULTS"
+fi
+
+rm -f "$DIR"/stress.*
+if [ -z "$STRESS_DIR" ]; then
+    rmdir "$DIR"
+fi
+exit $FAILED